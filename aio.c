@@ -0,0 +1,505 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__) && !defined(NO_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_URING 1
+#endif
+#include "aio.h"
+
+#define AIO_STDIO_BUFFER 65536   // stdio buffer of a prefetch stream
+
+enum { BUF_FREE, BUF_QUEUED, BUF_DONE };
+
+typedef struct {
+    unsigned char *data;
+    size_t cap, len;            // len: bytes to read, or filled to write
+    off_t offset;
+    int state;
+    ssize_t result;             // Bytes done, or -1
+} aio_buf;
+
+#ifdef HAVE_URING
+typedef struct {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_len, cq_len, sqes_len;
+} uring;
+#endif
+
+typedef struct {
+    FILE *file;
+    int fd, writing;
+    int seekable;               // Regular file at a known position
+    int adaptive;               // Grow the chunk when the codec waits
+    off_t start, offset;        // First byte; offset of the next request
+    size_t chunk;
+    aio_buf bufs[AIO_DEPTH];
+    int head;                   // Buffer being read from or filled
+    size_t pos;                 // Reader: bytes of bufs[head] handed out
+    long long consumed;         // Reader: bytes handed out in total
+    int end;                    // Reader: a read came back short
+    int error;
+
+    int use_uring;
+#ifdef HAVE_URING
+    uring ring;
+#endif
+    // Thread backend: serves the buffers in ring order
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int next, stop;
+} aio;
+
+// ---- io_uring, through the raw system calls ----
+
+#ifdef HAVE_URING
+static int uring_enter(uring *r, unsigned submit, unsigned wait) {
+    int ret;
+
+    do {
+        ret = syscall(__NR_io_uring_enter, r->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+static void uring_exit(uring *r) {
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_len);
+    munmap(r->sq_map, r->sq_len);
+    close(r->fd);
+}
+
+static int uring_init(uring *r, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) return -1;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+    r->sq_map = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                     IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+    r->cq_map = r->sq_map;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        r->cq_map = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                         IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) {
+            munmap(r->sq_map, r->sq_len);
+            close(r->fd);
+            return -1;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                   IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        if (r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_len);
+        munmap(r->sq_map, r->sq_len);
+        close(r->fd);
+        return -1;
+    }
+    r->sq_tail = (unsigned *)((char *)r->sq_map + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_map + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_map + p.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->cq_map + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_map + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_map + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_map + p.cq_off.cqes);
+    return 0;
+}
+
+static void uring_submit(aio *a, int i) {
+    uring *r = &a->ring;
+    aio_buf *b = &a->bufs[i];
+    unsigned tail = *r->sq_tail, index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = a->writing ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = a->fd;
+    sqe->addr = (unsigned long)b->data;
+    sqe->len = b->len;
+    sqe->off = b->offset;
+    sqe->user_data = i;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    if (uring_enter(r, 1, 0) < 0) {
+        b->result = -1;
+        b->state = BUF_DONE;
+    }
+}
+
+// A request can come back short; the rest is done in place
+static ssize_t complete_short(aio *a, aio_buf *b, ssize_t done) {
+    while (done >= 0 && (size_t)done < b->len) {
+        ssize_t n = a->writing ? pwrite(a->fd, b->data + done, b->len - done, b->offset + done)
+                               : pread(a->fd, b->data + done, b->len - done, b->offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) return a->writing ? -1 : done;
+        done += n;
+    }
+    return done;
+}
+
+static void uring_reap(aio *a) {
+    uring *r = &a->ring;
+    unsigned head = *r->cq_head, tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        aio_buf *b = &a->bufs[cqe->user_data];
+
+        b->result = cqe->res < 0 ? -1 : cqe->res > 0 ? complete_short(a, b, cqe->res) : 0;
+        b->state = BUF_DONE;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+// ---- Thread backend ----
+
+static void *io_thread(void *arg) {
+    aio *a = (aio *)arg;
+
+    pthread_mutex_lock(&a->lock);
+    for (;;) {
+        aio_buf *b = &a->bufs[a->next];
+        size_t n;
+
+        while (b->state != BUF_QUEUED && !a->stop)
+            pthread_cond_wait(&a->cond, &a->lock);
+        if (b->state != BUF_QUEUED) break;
+        pthread_mutex_unlock(&a->lock);
+
+        if (a->writing) {
+            n = fwrite(b->data, 1, b->len, a->file);
+            b->result = n == b->len ? (ssize_t)n : -1;
+        } else {
+            n = fread(b->data, 1, b->len, a->file);
+            b->result = n < b->len && ferror(a->file) ? -1 : (ssize_t)n;
+        }
+
+        pthread_mutex_lock(&a->lock);
+        b->state = BUF_DONE;
+        a->next = (a->next + 1) % AIO_DEPTH;
+        pthread_cond_broadcast(&a->cond);
+    }
+    pthread_mutex_unlock(&a->lock);
+    return NULL;
+}
+
+// ---- Common ----
+
+static void submit(aio *a, int i) {
+#ifdef HAVE_URING
+    if (a->use_uring) {
+        a->bufs[i].state = BUF_QUEUED;
+        uring_submit(a, i);
+        return;
+    }
+#endif
+    pthread_mutex_lock(&a->lock);
+    a->bufs[i].state = BUF_QUEUED;
+    pthread_cond_broadcast(&a->cond);
+    pthread_mutex_unlock(&a->lock);
+}
+
+// Waits for buffer i to complete; returns 1 if it was not done yet
+static int wait_buf(aio *a, int i) {
+    aio_buf *b = &a->bufs[i];
+    int stalled;
+
+#ifdef HAVE_URING
+    if (a->use_uring) {
+        uring_reap(a);
+        stalled = b->state == BUF_QUEUED;
+        while (b->state == BUF_QUEUED) {
+            if (uring_enter(&a->ring, 0, 1) < 0) {
+                b->result = -1;
+                b->state = BUF_DONE;
+                break;
+            }
+            uring_reap(a);
+        }
+        return stalled;
+    }
+#endif
+    pthread_mutex_lock(&a->lock);
+    stalled = b->state == BUF_QUEUED;
+    while (b->state == BUF_QUEUED)
+        pthread_cond_wait(&a->cond, &a->lock);
+    pthread_mutex_unlock(&a->lock);
+    return stalled;
+}
+
+// The codec waited for I/O: fewer, larger requests hide more latency
+static void grow(aio *a) {
+    if (a->adaptive && a->chunk < AIO_CHUNK_MAX) a->chunk *= 2;
+}
+
+// Makes buffer b at least one chunk; it must hold nothing
+static int size_buf(aio *a, aio_buf *b) {
+    unsigned char *data;
+
+    if (b->cap >= a->chunk) return 0;
+    data = malloc(a->chunk);
+    if (!data) return b->cap ? 0 : -1;
+    free(b->data);
+    b->data = data;
+    b->cap = a->chunk;
+    return 0;
+}
+
+// Queues buffer i at the next offset
+static void queue(aio *a, int i) {
+    aio_buf *b = &a->bufs[i];
+
+    b->offset = a->offset;
+    a->offset += b->len;
+    submit(a, i);
+}
+
+static void reader_queue(aio *a, int i) {
+    aio_buf *b = &a->bufs[i];
+
+    if (size_buf(a, b) != 0) {
+        a->error = 1;
+        return;
+    }
+    b->len = b->cap;
+    queue(a, i);
+}
+
+// Waits for everything in flight
+static void drain(aio *a) {
+    for (int i = 0; i < AIO_DEPTH; i++)
+        if (a->bufs[i].state == BUF_QUEUED) wait_buf(a, i);
+}
+
+static void aio_free(aio *a) {
+    drain(a);
+#ifdef HAVE_URING
+    if (a->use_uring) {
+        uring_exit(&a->ring);
+    } else
+#endif
+    {
+        pthread_mutex_lock(&a->lock);
+        a->stop = 1;
+        pthread_cond_broadcast(&a->cond);
+        pthread_mutex_unlock(&a->lock);
+        pthread_join(a->thread, NULL);
+        pthread_mutex_destroy(&a->lock);
+        pthread_cond_destroy(&a->cond);
+    }
+    for (int i = 0; i < AIO_DEPTH; i++)
+        free(a->bufs[i].data);
+    free(a);
+}
+
+static aio *aio_open(FILE *file, int writing) {
+    aio *a = calloc(1, sizeof(*a));
+    struct stat st;
+    int positioned;
+
+    if (!a) return NULL;
+    a->file = file;
+    a->fd = fileno(file);
+    a->writing = writing;
+    a->chunk = AIO_CHUNK_MIN;
+    if (writing) fflush(file);
+
+    if (a->fd >= 0 && fstat(a->fd, &st) == 0) {
+        size_t device = (size_t)st.st_blksize * 64;
+        if (device > a->chunk) a->chunk = device < AIO_CHUNK_MAX ? device : AIO_CHUNK_MAX;
+        a->seekable = S_ISREG(st.st_mode) && (a->start = ftello(file)) >= 0;
+    }
+    if (!a->seekable) a->start = 0;
+    a->offset = a->start;
+    a->adaptive = a->seekable;
+    // Appends ignore the offset, so their writes must stay in order
+    positioned = a->seekable && !(writing && (fcntl(a->fd, F_GETFL) & O_APPEND));
+
+#ifdef HAVE_URING
+    if (positioned && uring_init(&a->ring, AIO_DEPTH) == 0) a->use_uring = 1;
+#else
+    (void)positioned;
+#endif
+    if (!a->use_uring) {
+        pthread_mutex_init(&a->lock, NULL);
+        pthread_cond_init(&a->cond, NULL);
+        if (pthread_create(&a->thread, NULL, io_thread, a) != 0) {
+            pthread_mutex_destroy(&a->lock);
+            pthread_cond_destroy(&a->cond);
+            free(a);
+            return NULL;
+        }
+    }
+    return a;
+}
+
+// ---- Prefetch stream ----
+
+static ssize_t prefetch_read(void *cookie, char *buf, size_t size) {
+    aio *a = (aio *)cookie;
+    size_t done = 0;
+
+    while (done < size && !a->error) {
+        aio_buf *b = &a->bufs[a->head];
+
+        if (b->state == BUF_FREE) break;            // Nothing left in flight: end of input
+        if (wait_buf(a, a->head)) grow(a);
+        if (b->result < 0) {
+            a->error = 1;
+            break;
+        }
+        if (a->pos < (size_t)b->result) {
+            size_t n = (size_t)b->result - a->pos;
+            if (n > size - done) n = size - done;
+            memcpy(buf + done, b->data + a->pos, n);
+            a->pos += n;
+            a->consumed += n;
+            done += n;
+            continue;
+        }
+        // Used up: send it after the last one in flight
+        if ((size_t)b->result < b->len) a->end = 1;
+        b->state = BUF_FREE;
+        a->pos = 0;
+        if (!a->end) reader_queue(a, a->head);
+        a->head = (a->head + 1) % AIO_DEPTH;
+    }
+    if (a->error && done == 0) return -1;
+    return done;
+}
+
+static int prefetch_close(void *cookie) {
+    aio *a = (aio *)cookie;
+    int ret = a->error ? -1 : 0;
+
+    // Readahead never gets to the caller; put the source back after what did
+    drain(a);
+    if (a->seekable && fseeko(a->file, a->start + a->consumed, SEEK_SET) != 0) ret = -1;
+    aio_free(a);
+    return ret;
+}
+
+// Function to read source through AIO_DEPTH buffers kept in flight.
+// Returns NULL if the stream cannot be set up; source can then be read
+// directly.
+FILE *stream_prefetch(FILE *source) {
+    cookie_io_functions_t io = { 0 };
+    aio *a = aio_open(source, 0);
+    FILE *f;
+
+    if (!a) return NULL;
+    for (int i = 0; i < AIO_DEPTH && !a->error; i++)
+        reader_queue(a, i);
+    io.read = prefetch_read;
+    io.close = prefetch_close;
+    if (a->error || !(f = fopencookie(a, "rb", io))) {
+        aio_free(a);
+        return NULL;
+    }
+    setvbuf(f, NULL, _IOFBF, AIO_STDIO_BUFFER);
+    return f;
+}
+
+// ---- Write-behind stream ----
+
+// Collects the result of a finished write so its buffer can be refilled
+static void retire(aio *a, aio_buf *b) {
+    if (b->result < 0 || (size_t)b->result != b->len) a->error = 1;
+    b->state = BUF_FREE;
+    b->len = 0;
+}
+
+static ssize_t writebehind_write(void *cookie, const char *buf, size_t size) {
+    aio *a = (aio *)cookie;
+    size_t done = 0;
+
+    while (done < size && !a->error) {
+        aio_buf *b = &a->bufs[a->head];
+        size_t n;
+
+        if (b->state != BUF_FREE) {
+            if (wait_buf(a, a->head)) grow(a);
+            retire(a, b);
+            if (a->error) break;
+        }
+        if (b->len == 0 && size_buf(a, b) != 0) {
+            a->error = 1;
+            break;
+        }
+        n = b->cap - b->len;
+        if (n > size - done) n = size - done;
+        memcpy(b->data + b->len, buf + done, n);
+        b->len += n;
+        done += n;
+        if (b->len == b->cap) {
+            queue(a, a->head);
+            a->head = (a->head + 1) % AIO_DEPTH;
+        }
+    }
+    if (a->error && done == 0) return -1;
+    return done;
+}
+
+static int writebehind_close(void *cookie) {
+    aio *a = (aio *)cookie;
+    aio_buf *b = &a->bufs[a->head];
+    int ret;
+
+    if (b->state == BUF_FREE && b->len > 0 && !a->error) queue(a, a->head);
+    for (int i = 0; i < AIO_DEPTH; i++) {
+        if (a->bufs[i].state == BUF_FREE) continue;
+        wait_buf(a, i);
+        retire(a, &a->bufs[i]);
+    }
+    ret = a->error ? -1 : 0;
+    // Positioned writes went around the FILE; move it to the end of them
+    if (a->use_uring && fseeko(a->file, a->offset, SEEK_SET) != 0) ret = -1;
+    if (fflush(a->file) != 0) ret = -1;
+    aio_free(a);
+    return ret;
+}
+
+// Function to write dest through AIO_DEPTH buffers, each written while
+// the next is filled. Returns NULL if the stream cannot be set up; dest
+// can then be written directly.
+FILE *stream_writebehind(FILE *dest) {
+    cookie_io_functions_t io = { 0 };
+    aio *a = aio_open(dest, 1);
+    FILE *f;
+
+    if (!a) return NULL;
+    io.write = writebehind_write;
+    io.close = writebehind_close;
+    if (!(f = fopencookie(a, "wb", io))) {
+        aio_free(a);
+        return NULL;
+    }
+    // Writes go straight into the buffers
+    setvbuf(f, NULL, _IONBF, 0);
+    return f;
+}
@@ -0,0 +1,33 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <stdio.h>
+
+// Overlapped file I/O for the codecs. A prefetch stream keeps several
+// large reads of its source in flight while the codec works on the data
+// already read, and a write-behind stream hands full buffers to the
+// kernel and lets the codec carry on filling the next one. Both are
+// FILE*s, so any codec function can run on them.
+//
+// Regular files go through io_uring: each buffer is a read or write at
+// its own offset, so AIO_DEPTH of them are in flight at once. Pipes,
+// files opened for append, and kernels without io_uring (or builds with
+// -DNO_IO_URING) use a helper thread instead, one request at a time but
+// still overlapped with the codec.
+//
+// Buffers start at AIO_CHUNK_MIN or 64 blocks of the device, whichever
+// is larger, and double whenever the codec has to wait for one, up to
+// AIO_CHUNK_MAX; high-latency storage ends up with few large requests.
+//
+// Closing a prefetch stream leaves its source positioned after the bytes
+// read through it (when the source is seekable) and open. Closing a
+// write-behind stream waits for its writes and flushes dest, leaving it
+// open; it fails if any write did.
+#define AIO_DEPTH 4                     // Buffers per stream
+#define AIO_CHUNK_MIN (256 * 1024)
+#define AIO_CHUNK_MAX (8 << 20)
+
+FILE *stream_prefetch(FILE *source);
+FILE *stream_writebehind(FILE *dest);
+
+#endif // AIO_H
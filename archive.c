@@ -0,0 +1,1053 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "archive.h"
+#include "codec.h"
+#include "compress.h"
+#include "crc32c.h"
+#include "dedup.h"
+#include "input.h"
+#include "pool.h"
+
+// Journal of archive_create_file, next to its temp file:
+//   "FCJL" version reserved(3) archive_header(16) source_size(8)
+//   source_mtime_sec(8) source_mtime_nsec(4) path_len(4) path crc32c(4)
+// then one record per block: its index record and that record's CRC-32C
+#define JOURNAL_MAGIC "FCJL"
+#define JOURNAL_VERSION 1
+#define JOURNAL_FIXED_SIZE 48
+#define JOURNAL_HEADER_MAX (JOURNAL_FIXED_SIZE + PATH_MAX + 4)
+#define JOURNAL_RECORD_SIZE (ARCHIVE_ENTRY_SIZE + 4)
+
+// The previous archive's blocks sorted by hash, for archive_update
+typedef struct {
+    unsigned char hash[32];
+    uint64_t index;
+} manifest_entry;
+
+typedef struct {
+    const archive_t *ar;
+    manifest_entry *entries;
+    uint64_t count;
+} manifest;
+
+// Checkpoint state of a resumable build (archive_create_file). The blocks
+// written so far are made durable every ARCHIVE_CHECKPOINT input bytes,
+// and only then recorded in the journal, so a record that survives a
+// crash always describes a block that did too.
+typedef struct {
+    FILE *file;
+    archive_entry *entries;         // Blocks kept from an interrupted run
+    uint64_t nentries;
+    uint64_t journalled;            // Entries recorded so far
+    uint64_t since;                 // Input bytes since the last checkpoint
+    unsigned long long checkpoints;
+} checkpoint;
+
+// One block of archive_create on its way through the worker pool
+typedef struct ablock {
+    unsigned char *in;              // Read buffer, unused when the input is mapped
+    const unsigned char *data;
+    size_t in_len;
+    unsigned char *out;
+    size_t out_len, out_cap;
+    int codec, level;
+    uint32_t check;
+    unsigned char hash[32];
+    const manifest *prev;           // Blocks that may be reused, or NULL
+    int reused;
+    int done, failed;
+    pthread_mutex_t *lock;
+    pthread_cond_t *cond;
+} ablock;
+
+static void put_le32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = v >> (8 * i);
+}
+
+static void put_le64(unsigned char *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = v >> (8 * i);
+}
+
+static uint32_t get_le32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_le64(const unsigned char *p) {
+    return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+// Checksum of an uncompressed block under the archive's check type
+static uint32_t block_check(int check_type, const unsigned char *data, size_t len) {
+    if (check_type == ARCHIVE_CHECK_CRC32C) return crc32c(0, data, len);
+    return crc32(crc32(0L, Z_NULL, 0), data, len);
+}
+
+static int compare_manifest(const void *a, const void *b) {
+    return memcmp(((const manifest_entry *)a)->hash, ((const manifest_entry *)b)->hash, 32);
+}
+
+// Previous block with the same contents as blk, or NULL
+static const archive_entry *find_unchanged(const manifest *m, const ablock *blk) {
+    manifest_entry key;
+    const manifest_entry *found;
+    const archive_entry *e;
+
+    memcpy(key.hash, blk->hash, 32);
+    found = bsearch(&key, m->entries, m->count, sizeof(manifest_entry), compare_manifest);
+    if (!found) return NULL;
+    e = &m->ar->entries[found->index];
+    return e->ulen == blk->in_len && e->check == blk->check ? e : NULL;
+}
+
+// Copies the compressed payload of an unchanged block from the previous
+// archive into blk->out
+static int reuse_block(ablock *blk, const archive_t *ar, const archive_entry *e) {
+    if (e->codec != FC_STORE) {
+        if (blk->out_cap < e->clen) {
+            unsigned char *out = realloc(blk->out, e->clen);
+            if (!out) return -1;
+            blk->out = out;
+            blk->out_cap = e->clen;
+        }
+        if (pread(fileno(ar->file), blk->out, e->clen, e->coff) != (ssize_t)e->clen) return -1;
+    }
+    blk->codec = e->codec;
+    blk->out_len = e->clen;
+    blk->reused = 1;
+    return 0;
+}
+
+// Worker job: checksum and compress one block, storing it if it grows.
+// With a previous archive, a block found in its manifest is copied as is.
+static void ablock_compress(void *arg) {
+    ablock *blk = (ablock *)arg;
+    size_t bound = compress_bound(blk->codec, blk->in_len);
+    const archive_entry *e;
+    int failed = 0;
+
+    blk->check = block_check(ARCHIVE_CHECK_CRC32C, blk->data, blk->in_len);
+    sha256(blk->data, blk->in_len, blk->hash);
+    blk->reused = 0;
+    if (blk->prev && (e = find_unchanged(blk->prev, blk)) != NULL &&
+        reuse_block(blk, blk->prev->ar, e) == 0) {
+        pthread_mutex_lock(blk->lock);
+        blk->failed = 0;
+        blk->done = 1;
+        pthread_cond_broadcast(blk->cond);
+        pthread_mutex_unlock(blk->lock);
+        return;
+    }
+
+    if (blk->out_cap < bound) {
+        unsigned char *out = realloc(blk->out, bound);
+        if (out) {
+            blk->out = out;
+            blk->out_cap = bound;
+        } else {
+            failed = 1;
+        }
+    }
+    if (!failed) {
+        blk->out_len = compress_buffer(blk->codec, blk->level, blk->data, blk->in_len, blk->out, blk->out_cap);
+        if (blk->out_len == 0 || blk->out_len >= blk->in_len) {
+            blk->codec = FC_STORE;
+            blk->out_len = blk->in_len;
+        }
+    }
+
+    pthread_mutex_lock(blk->lock);
+    blk->failed = failed;
+    blk->done = 1;
+    pthread_cond_broadcast(blk->cond);
+    pthread_mutex_unlock(blk->lock);
+}
+
+static void read_entry(const unsigned char *p, archive_entry *e, int version) {
+    e->uoff = get_le64(p);
+    e->coff = get_le64(p + 8);
+    e->ulen = get_le32(p + 16);
+    e->clen = get_le32(p + 20);
+    e->check = get_le32(p + 24);
+    e->codec = p[28];
+    if (version >= 2) memcpy(e->hash, p + 32, 32);
+}
+
+static void make_header(unsigned char *header, int codec, int level, size_t block_size) {
+    memcpy(header, ARCHIVE_MAGIC, 4);
+    header[4] = ARCHIVE_VERSION;
+    header[5] = codec;
+    header[6] = level;
+    header[7] = ARCHIVE_CHECK_CRC32C;
+    put_le32(header + 8, block_size);
+    put_le32(header + 12, 0);
+}
+
+static void write_entry(unsigned char *p, const archive_entry *e) {
+    put_le64(p, e->uoff);
+    put_le64(p + 8, e->coff);
+    put_le32(p + 16, e->ulen);
+    put_le32(p + 20, e->clen);
+    put_le32(p + 24, e->check);
+    p[28] = e->codec;
+    p[29] = p[30] = p[31] = 0;
+    memcpy(p + 32, e->hash, 32);
+}
+
+// Makes the blocks written so far durable, then journals them
+static int checkpoint_sync(checkpoint *cp, FILE *dest, const archive_entry *entries, uint64_t nentries) {
+    unsigned char rec[JOURNAL_RECORD_SIZE];
+
+    if (fflush(dest) != 0 || fdatasync(fileno(dest)) != 0) return -1;
+    for (; cp->journalled < nentries; cp->journalled++) {
+        write_entry(rec, &entries[cp->journalled]);
+        put_le32(rec + ARCHIVE_ENTRY_SIZE, crc32c(0, rec, ARCHIVE_ENTRY_SIZE));
+        if (fwrite(rec, 1, JOURNAL_RECORD_SIZE, cp->file) != JOURNAL_RECORD_SIZE) return -1;
+    }
+    if (fflush(cp->file) != 0 || fdatasync(fileno(cp->file)) != 0) return -1;
+    cp->since = 0;
+    cp->checkpoints++;
+    return 0;
+}
+
+// Blocks of block_size bytes are compressed on threads workers and
+// written in order, followed by the index; blocks found in prev are
+// copied instead. With cp, the build continues after cp's entries, with
+// dest and source positioned after them, and is checkpointed as it goes.
+static int build_archive(FILE *source, FILE *dest, int codec, int level, size_t block_size, int threads,
+                         const manifest *prev, archive_update_report *report, checkpoint *cp) {
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    unsigned long long seq_read = 0, seq_written = 0;
+    archive_entry *entries = NULL;
+    size_t entries_cap = 0;
+    uint64_t nentries = 0, uoff = 0, coff = ARCHIVE_HEADER_SIZE;
+    unsigned char header[ARCHIVE_HEADER_SIZE];
+    int last_read = 0, failed = 0;
+    input_t in;
+
+    if (block_size == 0) block_size = ARCHIVE_BLOCK;
+
+    pool_t *pool = pool_create(threads);
+    if (!pool) return -1;
+    int nslots = pool_threads(pool) * 2;
+    ablock *slots = calloc(nslots, sizeof(ablock));
+    if (!slots) {
+        pool_destroy(pool);
+        return -1;
+    }
+
+    if (cp && cp->nentries > 0) {
+        const archive_entry *last = &cp->entries[cp->nentries - 1];
+        entries = cp->entries;
+        entries_cap = nentries = cp->nentries;
+        uoff = last->uoff + last->ulen;
+        coff = last->coff + last->clen;
+        cp->entries = NULL;
+    }
+
+    input_open(&in, source);
+    for (int i = 0; i < nslots; i++) {
+        slots[i].lock = &lock;
+        slots[i].cond = &cond;
+        if (input_mapped(&in)) continue;
+        slots[i].in = malloc(block_size);
+        if (!slots[i].in) failed = 1;
+    }
+
+    make_header(header, codec, level, block_size);
+    if (nentries == 0 && fwrite(header, 1, ARCHIVE_HEADER_SIZE, dest) != ARCHIVE_HEADER_SIZE) failed = 1;
+
+    while (!failed && !(last_read && seq_written == seq_read)) {
+        while (!last_read && seq_read - seq_written < (unsigned long long)nslots) {
+            ablock *blk = &slots[seq_read % nslots];
+
+            if (input_mapped(&in)) {
+                blk->in_len = input_next(&in, &blk->data, block_size);
+            } else {
+                blk->in_len = fread(blk->in, 1, block_size, source);
+                blk->data = blk->in;
+            }
+            if (ferror(source)) {
+                failed = 1;
+                break;
+            }
+            if (blk->in_len < block_size || input_eof(&in)) last_read = 1;
+            if (blk->in_len == 0) break;
+
+            blk->codec = codec;
+            blk->level = level;
+            blk->prev = prev;
+            blk->done = blk->failed = 0;
+            pool_submit(pool, ablock_compress, blk);
+            seq_read++;
+        }
+        if (failed || seq_written == seq_read) break;
+
+        ablock *blk = &slots[seq_written % nslots];
+        pthread_mutex_lock(&lock);
+        while (!blk->done)
+            pthread_cond_wait(&cond, &lock);
+        pthread_mutex_unlock(&lock);
+
+        if (blk->failed) {
+            failed = 1;
+            break;
+        }
+        if (nentries == entries_cap) {
+            size_t cap = entries_cap ? entries_cap * 2 : 64;
+            archive_entry *grown = realloc(entries, cap * sizeof(archive_entry));
+            if (!grown) {
+                failed = 1;
+                break;
+            }
+            entries = grown;
+            entries_cap = cap;
+        }
+
+        const unsigned char *payload = blk->codec == FC_STORE ? blk->data : blk->out;
+        if (fwrite(payload, 1, blk->out_len, dest) != blk->out_len) {
+            failed = 1;
+            break;
+        }
+        archive_entry *e = &entries[nentries++];
+        e->uoff = uoff;
+        e->coff = coff;
+        e->ulen = blk->in_len;
+        e->clen = blk->out_len;
+        e->check = blk->check;
+        e->codec = blk->codec;
+        memcpy(e->hash, blk->hash, 32);
+        if (report) {
+            report->blocks++;
+            if (blk->reused) {
+                report->reused_blocks++;
+                report->reused_bytes += blk->in_len;
+            } else {
+                report->compressed_bytes += blk->in_len;
+            }
+        }
+        uoff += blk->in_len;
+        coff += blk->out_len;
+        seq_written++;
+        if (cp && (cp->since += blk->in_len) >= ARCHIVE_CHECKPOINT &&
+            checkpoint_sync(cp, dest, entries, nentries) != 0) {
+            failed = 1;
+            break;
+        }
+    }
+
+    pool_wait(pool);
+    pool_destroy(pool);
+    input_close(&in, 0);
+
+    // Index and footer
+    if (!failed) {
+        unsigned char rec[ARCHIVE_ENTRY_SIZE], footer[ARCHIVE_FOOTER_SIZE];
+        uLong index_crc = crc32(0L, Z_NULL, 0);
+
+        for (uint64_t i = 0; i < nentries && !failed; i++) {
+            write_entry(rec, &entries[i]);
+            index_crc = crc32(index_crc, rec, ARCHIVE_ENTRY_SIZE);
+            if (fwrite(rec, 1, ARCHIVE_ENTRY_SIZE, dest) != ARCHIVE_ENTRY_SIZE) failed = 1;
+        }
+        put_le64(footer, coff);
+        put_le64(footer + 8, nentries);
+        put_le32(footer + 16, index_crc);
+        memcpy(footer + 20, ARCHIVE_INDEX_MAGIC, 4);
+        if (fwrite(footer, 1, ARCHIVE_FOOTER_SIZE, dest) != ARCHIVE_FOOTER_SIZE) failed = 1;
+    }
+    if (failed) fprintf(stderr, "Error: archive creation failed\n");
+
+    for (int i = 0; i < nslots; i++) {
+        free(slots[i].in);
+        free(slots[i].out);
+    }
+    free(slots);
+    free(entries);
+    return failed ? -1 : 0;
+}
+
+// Function to build a seekable archive from source. Blocks of block_size
+// bytes (0 = 1 MB) are compressed on threads workers (0 = one per CPU)
+// and written in order, followed by the index. Returns 0 on success.
+int archive_create(FILE *source, FILE *dest, int codec, int level, size_t block_size, int threads) {
+    return build_archive(source, dest, codec, level, block_size, threads, NULL, NULL, NULL);
+}
+
+// Function to archive a new version of the data in prev. The input is cut
+// at prev's block size, and every block whose SHA-256 is in prev's
+// manifest has its compressed bytes copied from prev instead of being
+// compressed again, so for in-place edits and appends the work done
+// follows the size of the change. Blocks are only reused when prev was
+// written with the same codec and level and has a manifest (version 2);
+// otherwise everything is compressed (and with the current check type,
+// CRC-32C). prev must not be dest. Returns 0
+// on success; report may be NULL.
+int archive_update(FILE *source, const archive_t *prev, FILE *dest, int codec, int level, int threads,
+                   archive_update_report *report) {
+    manifest m = { prev, NULL, 0 };
+    archive_update_report r;
+    int ret;
+
+    memset(&r, 0, sizeof(r));
+    if (prev->version >= 2 && prev->codec == codec && prev->level == level &&
+        prev->check_type == ARCHIVE_CHECK_CRC32C && prev->nblocks > 0) {
+        m.entries = malloc(prev->nblocks * sizeof(manifest_entry));
+        if (!m.entries) return -1;
+        for (uint64_t i = 0; i < prev->nblocks; i++) {
+            memcpy(m.entries[i].hash, prev->entries[i].hash, 32);
+            m.entries[i].index = i;
+        }
+        m.count = prev->nblocks;
+        qsort(m.entries, m.count, sizeof(manifest_entry), compare_manifest);
+    }
+
+    ret = build_archive(source, dest, codec, level, prev->block_size, threads, m.entries ? &m : NULL, &r, NULL);
+    free(m.entries);
+    if (report) *report = r;
+    return ret;
+}
+
+// Function to open an archive and load its index
+archive_t *archive_open(const char *filename) {
+    unsigned char header[ARCHIVE_HEADER_SIZE], footer[ARCHIVE_FOOTER_SIZE];
+    unsigned char *raw = NULL;
+    archive_t *ar;
+    FILE *file;
+    long end;
+    size_t entry_size;
+
+    file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot open file %s\n", filename);
+        return NULL;
+    }
+    ar = calloc(1, sizeof(*ar));
+    if (!ar) {
+        fclose(file);
+        return NULL;
+    }
+    ar->file = file;
+
+    if (fread(header, 1, ARCHIVE_HEADER_SIZE, file) != ARCHIVE_HEADER_SIZE ||
+        memcmp(header, ARCHIVE_MAGIC, 4) != 0 || header[4] < 1 || header[4] > ARCHIVE_VERSION)
+        goto bad;
+    ar->version = header[4];
+    entry_size = ar->version == 1 ? ARCHIVE_ENTRY_SIZE_V1 : ARCHIVE_ENTRY_SIZE;
+    ar->codec = header[5];
+    ar->level = header[6];
+    ar->check_type = header[7];
+    if (ar->check_type != ARCHIVE_CHECK_CRC32 && ar->check_type != ARCHIVE_CHECK_CRC32C)
+        goto bad;
+    ar->block_size = get_le32(header + 8);
+
+    if (fseek(file, 0, SEEK_END) != 0 || (end = ftell(file)) < ARCHIVE_HEADER_SIZE + ARCHIVE_FOOTER_SIZE)
+        goto bad;
+    if (pread(fileno(file), footer, ARCHIVE_FOOTER_SIZE, end - ARCHIVE_FOOTER_SIZE) != ARCHIVE_FOOTER_SIZE ||
+        memcmp(footer + 20, ARCHIVE_INDEX_MAGIC, 4) != 0)
+        goto bad;
+
+    uint64_t index_offset = get_le64(footer);
+    ar->nblocks = get_le64(footer + 8);
+    if (ar->nblocks > (uint64_t)end / entry_size || index_offset < ARCHIVE_HEADER_SIZE ||
+        index_offset + ar->nblocks * entry_size != (uint64_t)(end - ARCHIVE_FOOTER_SIZE))
+        goto bad;
+
+    size_t raw_len = ar->nblocks * entry_size;
+    raw = malloc(raw_len ? raw_len : 1);
+    ar->entries = calloc(ar->nblocks ? ar->nblocks : 1, sizeof(archive_entry));
+    if (!raw || !ar->entries ||
+        pread(fileno(file), raw, raw_len, index_offset) != (ssize_t)raw_len ||
+        crc32(crc32(0L, Z_NULL, 0), raw, raw_len) != get_le32(footer + 16))
+        goto bad;
+
+    // The index CRC only catches accidents: entries must also tile the
+    // data in order, within a block each, and point inside the blocks
+    // region, or a crafted index could make the readers allocate up to
+    // 4 GB per block or break the binary search
+    for (uint64_t i = 0; i < ar->nblocks; i++) {
+        archive_entry *e = &ar->entries[i];
+        read_entry(raw + i * entry_size, e, ar->version);
+        if (e->uoff != ar->size || e->ulen == 0 || e->ulen > ar->block_size ||
+            e->coff < ARCHIVE_HEADER_SIZE || e->clen > index_offset || e->coff > index_offset - e->clen)
+            goto bad;
+        ar->size = e->uoff + e->ulen;
+    }
+    free(raw);
+    return ar;
+
+bad:
+    fprintf(stderr, "Error: %s is not a valid seekable archive\n", filename);
+    free(raw);
+    archive_close(ar);
+    return NULL;
+}
+
+void archive_close(archive_t *ar) {
+    if (!ar) return;
+    fclose(ar->file);
+    free(ar->entries);
+    free(ar);
+}
+
+// Index of the block holding uncompressed offset (binary search)
+static uint64_t find_block(const archive_t *ar, uint64_t offset) {
+    uint64_t lo = 0, hi = ar->nblocks;
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (ar->entries[mid].uoff <= offset) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Reads, decodes and checks one block into out (e->ulen bytes)
+static int decode_block(const archive_t *ar, const archive_entry *e, unsigned char *payload,
+                        unsigned char *out) {
+    if (pread(fileno(ar->file), payload, e->clen, e->coff) != (ssize_t)e->clen) return -1;
+    if (decompress_buffer(e->codec, payload, e->clen, out, e->ulen) != 0) return -1;
+    if (block_check(ar->check_type, out, e->ulen) != e->check) return -1;
+    return 0;
+}
+
+// Function to decompress length bytes starting at uncompressed offset,
+// decoding only the blocks that overlap the range. Returns the number of
+// bytes copied to out (short at end of data) or -1 on a corrupt block.
+long long archive_read_range(archive_t *ar, uint64_t offset, size_t length, unsigned char *out) {
+    unsigned char *payload = NULL, *block = NULL;
+    size_t payload_cap = 0, block_cap = 0;
+    long long copied = 0;
+
+    if (offset >= ar->size || length == 0) return 0;
+    if (length > ar->size - offset) length = ar->size - offset;
+
+    for (uint64_t i = find_block(ar, offset); i < ar->nblocks && (size_t)copied < length; i++) {
+        const archive_entry *e = &ar->entries[i];
+
+        if (payload_cap < e->clen) {
+            free(payload);
+            payload_cap = e->clen;
+            payload = malloc(payload_cap);
+        }
+        if (block_cap < e->ulen) {
+            free(block);
+            block_cap = e->ulen;
+            block = malloc(block_cap);
+        }
+        if (!payload || !block || decode_block(ar, e, payload, block) != 0) {
+            fprintf(stderr, "Error: corrupt block %llu at archive offset %llu\n",
+                   (unsigned long long)i, (unsigned long long)e->coff);
+            copied = -1;
+            break;
+        }
+
+        size_t skip = offset + copied - e->uoff;
+        size_t n = e->ulen - skip;
+        if (n > length - copied) n = length - copied;
+        memcpy(out + copied, block + skip, n);
+        copied += n;
+    }
+
+    free(payload);
+    free(block);
+    return copied;
+}
+
+// One block of archive_extract on its way through the worker pool
+typedef struct xblock {
+    const archive_t *ar;
+    const archive_entry *e;
+    unsigned char *payload, *out;
+    size_t payload_cap, out_cap;
+    int done, failed;
+    pthread_mutex_t *lock;
+    pthread_cond_t *cond;
+} xblock;
+
+// Worker job: read, decode and check one block
+static void xblock_decode(void *arg) {
+    xblock *blk = (xblock *)arg;
+    const archive_entry *e = blk->e;
+    int failed = 0;
+
+    if (blk->payload_cap < e->clen) {
+        free(blk->payload);
+        blk->payload = malloc(e->clen);
+        blk->payload_cap = blk->payload ? e->clen : 0;
+    }
+    if (blk->out_cap < e->ulen) {
+        free(blk->out);
+        blk->out = malloc(e->ulen);
+        blk->out_cap = blk->out ? e->ulen : 0;
+    }
+    if (!blk->payload || !blk->out || decode_block(blk->ar, e, blk->payload, blk->out) != 0)
+        failed = 1;
+
+    pthread_mutex_lock(blk->lock);
+    blk->failed = failed;
+    blk->done = 1;
+    pthread_cond_broadcast(blk->cond);
+    pthread_mutex_unlock(blk->lock);
+}
+
+// Function to decompress a whole archive to dest. Returns 0 on success.
+int archive_extract(archive_t *ar, FILE *dest) {
+    return archive_extract_threads(ar, dest, 0);
+}
+
+// Same, decoding blocks on threads workers (0 = one per CPU) while the
+// calling thread writes the finished ones out in order. At most two
+// blocks per worker are in memory at once.
+int archive_extract_threads(archive_t *ar, FILE *dest, int threads) {
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    uint64_t submitted = 0, written = 0;
+    xblock *slots;
+    int nslots, ret = 0;
+
+    pool_t *pool = pool_create(threads);
+    if (!pool) return -1;
+    nslots = pool_threads(pool) * 2;
+    slots = calloc(nslots, sizeof(xblock));
+    if (!slots) {
+        pool_destroy(pool);
+        return -1;
+    }
+
+    posix_fadvise(fileno(ar->file), 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (written < ar->nblocks) {
+        while (submitted < ar->nblocks && submitted - written < (uint64_t)nslots) {
+            xblock *blk = &slots[submitted % nslots];
+            blk->ar = ar;
+            blk->e = &ar->entries[submitted];
+            blk->lock = &lock;
+            blk->cond = &cond;
+            blk->done = blk->failed = 0;
+            pool_submit(pool, xblock_decode, blk);
+            submitted++;
+        }
+
+        xblock *blk = &slots[written % nslots];
+        pthread_mutex_lock(&lock);
+        while (!blk->done)
+            pthread_cond_wait(&cond, &lock);
+        pthread_mutex_unlock(&lock);
+
+        if (blk->failed) {
+            fprintf(stderr, "Error: corrupt block %llu at archive offset %llu\n",
+                    (unsigned long long)written, (unsigned long long)blk->e->coff);
+            ret = -1;
+            break;
+        }
+        if (fwrite(blk->out, 1, blk->e->ulen, dest) != blk->e->ulen) {
+            ret = -1;
+            break;
+        }
+        written++;
+    }
+
+    pool_wait(pool);
+    pool_destroy(pool);
+    for (int i = 0; i < nslots; i++) {
+        free(slots[i].payload);
+        free(slots[i].out);
+    }
+    free(slots);
+    return ret;
+}
+
+// Shared state of archive_verify. Workers claim blocks in order from
+// next, so reads stay close to sequential.
+typedef struct {
+    archive_t *ar;
+    uint64_t next;
+    unsigned char *bad;             // Per-block corrupt flag
+    unsigned long long bytes_in, bytes_out;
+} verifier;
+
+// Worker job: decode and check blocks into its own scratch buffers until
+// none are left
+static void verify_blocks(void *arg) {
+    verifier *v = (verifier *)arg;
+    unsigned char *payload = NULL, *block = NULL;
+    size_t payload_cap = 0, block_cap = 0;
+    uint64_t i;
+
+    while ((i = __atomic_fetch_add(&v->next, 1, __ATOMIC_RELAXED)) < v->ar->nblocks) {
+        const archive_entry *e = &v->ar->entries[i];
+
+        if (payload_cap < e->clen) {
+            free(payload);
+            payload_cap = e->clen;
+            payload = malloc(payload_cap);
+        }
+        if (block_cap < e->ulen) {
+            free(block);
+            block_cap = e->ulen;
+            block = malloc(block_cap);
+        }
+        if (!payload || !block) {
+            payload_cap = block_cap = 0;
+            v->bad[i] = 1;
+            continue;
+        }
+        if (decode_block(v->ar, e, payload, block) != 0) v->bad[i] = 1;
+
+        // A sweep reads each block once; keep it from evicting the page cache
+        posix_fadvise(fileno(v->ar->file), e->coff, e->clen, POSIX_FADV_DONTNEED);
+        __atomic_add_fetch(&v->bytes_in, e->clen, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&v->bytes_out, e->ulen, __ATOMIC_RELAXED);
+    }
+    free(payload);
+    free(block);
+}
+
+// Function to check every block of an archive without writing anything:
+// blocks are decoded in parallel on threads workers (0 = one per CPU)
+// into scratch buffers and compared with their checksums. Corrupt blocks
+// are listed on stderr. Returns 0 if all are intact, -1 otherwise;
+// report may be NULL.
+int archive_verify(archive_t *ar, int threads, archive_verify_report *report) {
+    verifier v;
+    archive_verify_report r;
+    struct timespec start, end;
+    pool_t *pool;
+
+    memset(&v, 0, sizeof(v));
+    memset(&r, 0, sizeof(r));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    v.ar = ar;
+    v.bad = calloc(ar->nblocks ? ar->nblocks : 1, 1);
+    pool = v.bad ? pool_create(threads) : NULL;
+    if (!pool) {
+        free(v.bad);
+        return -1;
+    }
+
+    posix_fadvise(fileno(ar->file), 0, 0, POSIX_FADV_SEQUENTIAL);
+    for (int i = 0; i < pool_threads(pool); i++)
+        pool_submit(pool, verify_blocks, &v);
+    pool_wait(pool);
+    pool_destroy(pool);
+
+    r.blocks = ar->nblocks;
+    r.bytes_in = v.bytes_in;
+    r.bytes_out = v.bytes_out;
+    for (uint64_t i = 0; i < ar->nblocks; i++) {
+        if (!v.bad[i]) continue;
+        if (r.corrupt++ == 0) r.first_corrupt = ar->entries[i].coff;
+        fprintf(stderr, "Error: corrupt block %llu at archive offset %llu (data offset %llu)\n",
+                (unsigned long long)i, (unsigned long long)ar->entries[i].coff,
+                (unsigned long long)ar->entries[i].uoff);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    r.seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    r.mbps = r.seconds > 0 ? r.bytes_out / r.seconds / 1e6 : 0;
+    if (report) *report = r;
+    free(v.bad);
+    return r.corrupt ? -1 : 0;
+}
+
+// Journal header for building an archive with header ar_header from the
+// file at path; returns its length
+static size_t journal_header(unsigned char *buf, const unsigned char *ar_header, const char *path,
+                             const struct stat *st) {
+    size_t path_len = strlen(path);
+
+    memcpy(buf, JOURNAL_MAGIC, 4);
+    buf[4] = JOURNAL_VERSION;
+    buf[5] = buf[6] = buf[7] = 0;
+    memcpy(buf + 8, ar_header, ARCHIVE_HEADER_SIZE);
+    put_le64(buf + 24, st->st_size);
+    put_le64(buf + 32, st->st_mtim.tv_sec);
+    put_le32(buf + 40, st->st_mtim.tv_nsec);
+    put_le32(buf + 44, path_len);
+    memcpy(buf + JOURNAL_FIXED_SIZE, path, path_len);
+    put_le32(buf + JOURNAL_FIXED_SIZE + path_len, crc32c(0, buf, JOURNAL_FIXED_SIZE + path_len));
+    return JOURNAL_FIXED_SIZE + path_len + 4;
+}
+
+// Whether block e of tmp decodes intact to the bytes the source now holds
+static int block_matches(FILE *tmp, FILE *source, const archive_entry *e) {
+    archive_t view = { .file = tmp, .check_type = ARCHIVE_CHECK_CRC32C };
+    unsigned char *payload = malloc(e->clen ? e->clen : 1);
+    unsigned char *out = malloc(e->ulen), *src = malloc(e->ulen);
+    int ok = payload && out && src && decode_block(&view, e, payload, out) == 0 &&
+             pread(fileno(source), src, e->ulen, e->uoff) == (ssize_t)e->ulen &&
+             memcmp(src, out, e->ulen) == 0;
+
+    free(payload);
+    free(out);
+    free(src);
+    return ok;
+}
+
+// Reads the blocks an interrupted run journalled, if its journal header
+// is header: records must be intact and follow on from each other, and
+// the last block kept must decode from tmp to what the source holds
+// there; blocks are dropped from the end until one does. Returns the
+// number kept, 0 to start over.
+static uint64_t load_journal(FILE *journal, const unsigned char *header, size_t header_len, FILE *tmp,
+                             FILE *source, uint32_t block_size, archive_entry **entries) {
+    unsigned char buf[JOURNAL_HEADER_MAX], rec[JOURNAL_RECORD_SIZE];
+    uint64_t n = 0, cap = 0, uoff = 0, coff = ARCHIVE_HEADER_SIZE;
+    struct stat st;
+    archive_entry *list = NULL;
+
+    *entries = NULL;
+    rewind(journal);
+    if (fread(buf, 1, header_len, journal) != header_len || memcmp(buf, header, header_len) != 0 ||
+        pread(fileno(tmp), buf, ARCHIVE_HEADER_SIZE, 0) != ARCHIVE_HEADER_SIZE ||
+        memcmp(buf, header + 8, ARCHIVE_HEADER_SIZE) != 0 || fstat(fileno(tmp), &st) != 0)
+        return 0;
+
+    while (fread(rec, 1, JOURNAL_RECORD_SIZE, journal) == JOURNAL_RECORD_SIZE &&
+           crc32c(0, rec, ARCHIVE_ENTRY_SIZE) == get_le32(rec + ARCHIVE_ENTRY_SIZE)) {
+        archive_entry e;
+        read_entry(rec, &e, ARCHIVE_VERSION);
+        // Only the last block of the input may be short
+        if (e.uoff != uoff || e.coff != coff || e.ulen == 0 || e.ulen > block_size ||
+            (n > 0 && list[n - 1].ulen != block_size) || e.coff + e.clen > (uint64_t)st.st_size)
+            break;
+        if (n == cap) {
+            archive_entry *grown = realloc(list, (cap = cap ? cap * 2 : 1024) * sizeof(archive_entry));
+            if (!grown) break;
+            list = grown;
+        }
+        list[n++] = e;
+        uoff += e.ulen;
+        coff += e.clen;
+    }
+    while (n > 0 && !block_matches(tmp, source, &list[n - 1]))
+        n--;
+    if (n == 0) free(list);
+    else *entries = list;
+    return n;
+}
+
+// Function to build a seekable archive of the file in_name as out_name,
+// resumably. The archive is written to out_name.tmp, and every
+// ARCHIVE_CHECKPOINT input bytes the blocks written so far are flushed to
+// disk and recorded in out_name.tmp.journal. If a run is interrupted, the
+// next one with the same input (path, size and mtime) and settings checks
+// the blocks journalled and carries on after the last good one. When the
+// archive is complete it is renamed to out_name and the journal removed.
+// Orphaned temp files in out_name's directory are cleaned up first
+// (archive_clean_orphans). report may be NULL. Returns 0 on success.
+int archive_create_file(const char *in_name, const char *out_name, int codec, int level, size_t block_size,
+                        int threads, archive_resume_report *report) {
+    char tmp_name[PATH_MAX], journal_name[PATH_MAX], path[PATH_MAX], dir[PATH_MAX];
+    const char *out_dir;
+    unsigned char ar_header[ARCHIVE_HEADER_SIZE], jheader[JOURNAL_HEADER_MAX];
+    archive_resume_report r;
+    archive_update_report built;
+    checkpoint cp;
+    struct stat st;
+    FILE *source, *tmp = NULL;
+    size_t jlen;
+    int fd, failed = 1, renamed = 0;
+
+    memset(&r, 0, sizeof(r));
+    memset(&cp, 0, sizeof(cp));
+    memset(&built, 0, sizeof(built));
+    if (report) *report = r;
+    if (block_size == 0) block_size = ARCHIVE_BLOCK;
+    if (level < 0) level = codec_by_id(codec) ? codec_by_id(codec)->default_level : 0;
+    if (snprintf(tmp_name, sizeof(tmp_name), "%s%s", out_name, ARCHIVE_TMP_SUFFIX) >= (int)sizeof(tmp_name) ||
+        snprintf(journal_name, sizeof(journal_name), "%s%s", tmp_name, ARCHIVE_JOURNAL_SUFFIX) >=
+            (int)sizeof(journal_name) ||
+        snprintf(dir, sizeof(dir), "%s", out_name) >= (int)sizeof(dir)) {
+        fprintf(stderr, "Error: Output name too long\n");
+        return -1;
+    }
+    // dirname() may return a static "." rather than edit dir in place
+    out_dir = dirname(dir);
+    r.orphans = archive_clean_orphans(out_dir);
+
+    source = fopen(in_name, "rb");
+    if (!source || fstat(fileno(source), &st) != 0 || !S_ISREG(st.st_mode) || !realpath(in_name, path)) {
+        fprintf(stderr, "Error: Cannot open file %s as a regular file\n", in_name);
+        if (source) fclose(source);
+        return -1;
+    }
+    make_header(ar_header, codec, level, block_size);
+    jlen = journal_header(jheader, ar_header, path, &st);
+
+    // The journal's lock marks the run as live for other runs and cleanups
+    fd = open(journal_name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) != 0 || !(cp.file = fdopen(fd, "r+b"))) {
+        fprintf(stderr, "Error: Cannot lock %s%s\n", journal_name,
+                fd >= 0 ? ": another run is writing it" : "");
+        if (fd >= 0) close(fd);
+        fclose(source);
+        return -1;
+    }
+
+    tmp = fopen(tmp_name, "r+b");
+    if (tmp) cp.nentries = load_journal(cp.file, jheader, jlen, tmp, source, block_size, &cp.entries);
+    if (cp.nentries > 0) {
+        const archive_entry *last = &cp.entries[cp.nentries - 1];
+        off_t end = last->coff + last->clen;
+
+        r.resumed_blocks = cp.nentries;
+        r.resumed_bytes = last->uoff + last->ulen;
+        cp.journalled = cp.nentries;
+        // Drop whatever was written after the last good block
+        if (ftruncate(fileno(tmp), end) != 0 || fseeko(tmp, end, SEEK_SET) != 0 ||
+            ftruncate(fd, jlen + cp.nentries * JOURNAL_RECORD_SIZE) != 0 ||
+            fseeko(cp.file, 0, SEEK_END) != 0 || fseeko(source, r.resumed_bytes, SEEK_SET) != 0)
+            goto done;
+    } else {
+        if (tmp) fclose(tmp);
+        tmp = fopen(tmp_name, "w+b");
+        if (!tmp) {
+            fprintf(stderr, "Error: Cannot create file %s\n", tmp_name);
+            goto done;
+        }
+        rewind(cp.file);
+        if (ftruncate(fd, 0) != 0 || fwrite(jheader, 1, jlen, cp.file) != jlen ||
+            fflush(cp.file) != 0 || fdatasync(fd) != 0)
+            goto done;
+    }
+
+    if (build_archive(source, tmp, codec, level, block_size, threads, NULL, &built, &cp) != 0 ||
+        fflush(tmp) != 0 || fsync(fileno(tmp)) != 0)
+        goto done;
+    fclose(tmp);
+    tmp = NULL;
+    if (rename(tmp_name, out_name) != 0) {
+        fprintf(stderr, "Error: Cannot rename %s to %s\n", tmp_name, out_name);
+        goto done;
+    }
+    renamed = 1;
+    // The rename must reach the disk before the journal goes; if it
+    // cannot, the journal stays, and the next run starts afresh
+    if ((fd = open(out_dir, O_RDONLY | O_DIRECTORY)) < 0 || fsync(fd) != 0) {
+        fprintf(stderr, "Error: Cannot sync directory %s: %s\n", out_dir, strerror(errno));
+        if (fd >= 0) close(fd);
+        goto done;
+    }
+    close(fd);
+    unlink(journal_name);
+    failed = 0;
+
+done:
+    if (failed && !renamed && r.resumed_blocks + built.blocks > 0)
+        fprintf(stderr, "Error: Archive of %s interrupted; run again to resume it\n", in_name);
+    r.blocks = r.resumed_blocks + built.blocks;
+    r.checkpoints = cp.checkpoints;
+    if (tmp) fclose(tmp);
+    fclose(cp.file);
+    fclose(source);
+    free(cp.entries);
+    if (report) *report = r;
+    return failed ? -1 : 0;
+}
+
+// What journal_live makes of a file named like a journal
+enum { JOURNAL_FOREIGN, JOURNAL_STALE, JOURNAL_LIVE };
+
+// Whether a file begins with the archive magic
+static int is_archive(const char *name) {
+    char magic[4];
+    FILE *f = fopen(name, "rb");
+    int ours;
+
+    if (!f) return 0;
+    ours = fread(magic, 1, 4, f) == 4 && memcmp(magic, ARCHIVE_MAGIC, 4) == 0;
+    fclose(f);
+    return ours;
+}
+
+// Whether a journal can be resumed (JOURNAL_LIVE: somebody holds its
+// lock, or its temp file exists and its input is unchanged), is one of
+// ours that never can (JOURNAL_STALE), or is not a journal at all
+static int journal_live(const char *journal_name, const char *tmp_name) {
+    unsigned char buf[JOURNAL_HEADER_MAX];
+    char path[PATH_MAX];
+    struct stat st;
+    uint32_t path_len;
+    int fd = open(journal_name, O_RDONLY), live = JOURNAL_FOREIGN;
+
+    if (fd < 0) return JOURNAL_FOREIGN;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        close(fd);
+        return JOURNAL_LIVE;
+    }
+    if (read(fd, buf, JOURNAL_FIXED_SIZE) == JOURNAL_FIXED_SIZE && memcmp(buf, JOURNAL_MAGIC, 4) == 0 &&
+        (path_len = get_le32(buf + 44)) < PATH_MAX &&
+        read(fd, buf + JOURNAL_FIXED_SIZE, path_len + 4) == (ssize_t)path_len + 4 &&
+        crc32c(0, buf, JOURNAL_FIXED_SIZE + path_len) == get_le32(buf + JOURNAL_FIXED_SIZE + path_len)) {
+        memcpy(path, buf + JOURNAL_FIXED_SIZE, path_len);
+        path[path_len] = '\0';
+        live = access(tmp_name, F_OK) == 0 && stat(path, &st) == 0 &&
+               (uint64_t)st.st_size == get_le64(buf + 24) && (uint64_t)st.st_mtim.tv_sec == get_le64(buf + 32) &&
+               (uint32_t)st.st_mtim.tv_nsec == get_le32(buf + 40) ? JOURNAL_LIVE : JOURNAL_STALE;
+    }
+    close(fd);
+    return live;
+}
+
+// Function to remove the temp files of archive builds that can never
+// finish: journals whose input has changed or gone, with their temp
+// files, and temp archives without a journal (from archive_update, or
+// killed before they had one) untouched for ARCHIVE_ORPHAN_AGE seconds.
+// Runs in progress, and files that only share the names, are left alone.
+// Returns the number of files removed.
+int archive_clean_orphans(const char *dir) {
+    size_t tlen = strlen(ARCHIVE_TMP_SUFFIX), jlen = strlen(ARCHIVE_JOURNAL_SUFFIX);
+    char name[PATH_MAX], other[PATH_MAX];
+    struct dirent *d;
+    struct stat st;
+    int removed = 0;
+    DIR *dp = opendir(dir);
+
+    if (!dp) return 0;
+    while ((d = readdir(dp)) != NULL) {
+        size_t len = strlen(d->d_name);
+
+        if (snprintf(name, sizeof(name), "%s/%s", dir, d->d_name) >= (int)sizeof(name)) continue;
+        if (len > tlen + jlen && strcmp(d->d_name + len - jlen, ARCHIVE_JOURNAL_SUFFIX) == 0 &&
+            strncmp(d->d_name + len - jlen - tlen, ARCHIVE_TMP_SUFFIX, tlen) == 0) {
+            // name minus the journal suffix is its temp file
+            snprintf(other, sizeof(other), "%.*s", (int)(strlen(name) - jlen), name);
+            if (journal_live(name, other) != JOURNAL_STALE) continue;
+            // A temp file that is not an archive is somebody else's
+            if (access(other, F_OK) == 0) {
+                if (!is_archive(other)) continue;
+                if (unlink(other) == 0) removed++;
+            }
+            if (unlink(name) == 0) removed++;
+        } else if (len > tlen && strcmp(d->d_name + len - tlen, ARCHIVE_TMP_SUFFIX) == 0) {
+            if (snprintf(other, sizeof(other), "%s%s", name, ARCHIVE_JOURNAL_SUFFIX) >= (int)sizeof(other) ||
+                access(other, F_OK) == 0 || stat(name, &st) != 0 || !S_ISREG(st.st_mode) ||
+                time(NULL) - st.st_mtime < ARCHIVE_ORPHAN_AGE || !is_archive(name))
+                continue;
+            if (unlink(name) == 0) removed++;
+        }
+    }
+    closedir(dp);
+    return removed;
+}
+
+// Function to read a byte range from an archive file in one call
+long long decompress_range(const char *filename, uint64_t offset, size_t length, unsigned char *out) {
+    archive_t *ar = archive_open(filename);
+    long long n;
+
+    if (!ar) return -1;
+    n = archive_read_range(ar, offset, length, out);
+    archive_close(ar);
+    return n;
+}
@@ -0,0 +1,103 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Seekable container: independently compressed blocks followed by an
+// index of their uncompressed and compressed offsets, so any byte range
+// can be served by decoding only the blocks that cover it.
+//
+//   header  "FCSK" version codec level check_type block_size(4) reserved(4)
+//   blocks  compressed payloads, back to back
+//   index   one ARCHIVE_ENTRY_SIZE record per block
+//   footer  index_offset(8) block_count(8) index_crc32(4) "FCIX"
+//
+// All integers are little-endian. Version 2 index records end with the
+// SHA-256 of the uncompressed block; together they are the manifest that
+// archive_update matches a changed file against. Version 1 archives,
+// whose records lack it, are still read.
+#define ARCHIVE_MAGIC "FCSK"
+#define ARCHIVE_INDEX_MAGIC "FCIX"
+#define ARCHIVE_VERSION 2
+#define ARCHIVE_HEADER_SIZE 16
+#define ARCHIVE_ENTRY_SIZE 64
+#define ARCHIVE_ENTRY_SIZE_V1 32
+#define ARCHIVE_FOOTER_SIZE 24
+#define ARCHIVE_BLOCK (1024 * 1024)   // Default uncompressed block size
+
+// Resumable builds (archive_create_file)
+#define ARCHIVE_CHECKPOINT (64 << 20)   // Input bytes between durable checkpoints
+#define ARCHIVE_TMP_SUFFIX ".tmp"       // Archive being written: <out>.tmp
+#define ARCHIVE_JOURNAL_SUFFIX ".journal"   // and its journal: <out>.tmp.journal
+#define ARCHIVE_ORPHAN_AGE 3600         // Seconds before a temp file without a journal is stale
+
+// Per-block checksum of the uncompressed data. New archives use CRC-32C,
+// which CPUs compute in hardware (crc32c.h).
+enum archive_check {
+    ARCHIVE_CHECK_CRC32 = 1,
+    ARCHIVE_CHECK_CRC32C = 2
+};
+
+// Index record for one block
+typedef struct {
+    uint64_t uoff;          // Offset of the block in the uncompressed data
+    uint64_t coff;          // Offset of the payload in the archive file
+    uint32_t ulen, clen;
+    uint32_t check;         // Checksum of the uncompressed block
+    int codec;              // Blocks that do not shrink are stored
+    unsigned char hash[32]; // SHA-256 of the uncompressed block (version 2)
+} archive_entry;
+
+// An open archive. Range reads use pread(), so one handle can serve
+// concurrent readers.
+typedef struct {
+    FILE *file;
+    int version, codec, level, check_type;
+    uint32_t block_size;
+    uint64_t nblocks;
+    uint64_t size;          // Total uncompressed size
+    archive_entry *entries;
+} archive_t;
+
+// Result of archive_update
+typedef struct {
+    unsigned long long blocks;
+    unsigned long long reused_blocks;       // Copied from the previous archive
+    unsigned long long reused_bytes;        // Uncompressed bytes they cover
+    unsigned long long compressed_bytes;    // Uncompressed bytes compressed anew
+} archive_update_report;
+
+// Result of archive_create_file
+typedef struct {
+    unsigned long long blocks;
+    unsigned long long resumed_blocks;      // Kept from an interrupted run
+    unsigned long long resumed_bytes;       // Uncompressed bytes they cover
+    unsigned long long checkpoints;         // Checkpoints made by this run
+    int orphans;                            // Stale temp files removed
+} archive_resume_report;
+
+// Result of archive_verify
+typedef struct {
+    unsigned long long blocks, corrupt;
+    unsigned long long bytes_in, bytes_out; // Compressed bytes read, bytes decoded
+    uint64_t first_corrupt;                 // Archive offset of the first corrupt block
+    double seconds;
+    double mbps;                            // Decoded bytes per second
+} archive_verify_report;
+
+int archive_create(FILE *source, FILE *dest, int codec, int level, size_t block_size, int threads);
+int archive_update(FILE *source, const archive_t *prev, FILE *dest, int codec, int level, int threads,
+                   archive_update_report *report);
+int archive_create_file(const char *in_name, const char *out_name, int codec, int level, size_t block_size,
+                        int threads, archive_resume_report *report);
+int archive_clean_orphans(const char *dir);
+archive_t *archive_open(const char *filename);
+void archive_close(archive_t *ar);
+long long archive_read_range(archive_t *ar, uint64_t offset, size_t length, unsigned char *out);
+int archive_extract(archive_t *ar, FILE *dest);
+int archive_extract_threads(archive_t *ar, FILE *dest, int threads);
+int archive_verify(archive_t *ar, int threads, archive_verify_report *report);
+long long decompress_range(const char *filename, uint64_t offset, size_t length, unsigned char *out);
+
+#endif // ARCHIVE_H
@@ -0,0 +1,159 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+// Every block starts with a header holding its usable size, so a block
+// can be freed on any thread and without knowing its size
+#define HEADER 16
+
+typedef struct {
+    void *blocks[ARENA_SLOTS];      // Header addresses
+    size_t sizes[ARENA_SLOTS];
+    int count;
+    size_t cached;
+    unsigned long long hits, misses;
+} cache;
+
+static pthread_key_t cache_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static void release(void *arg) {
+    cache *c = (cache *)arg;
+
+    for (int i = 0; i < c->count; i++)
+        free(c->blocks[i]);
+    free(c);
+}
+
+static void make_key(void) {
+    pthread_key_create(&cache_key, release);
+}
+
+static cache *thread_cache(int create) {
+    cache *c;
+
+    pthread_once(&key_once, make_key);
+    c = pthread_getspecific(cache_key);
+    if (!c && create) {
+        c = calloc(1, sizeof(*c));
+        if (c) pthread_setspecific(cache_key, c);
+    }
+    return c;
+}
+
+// Function to allocate size bytes, from the calling thread's cache when
+// it holds a block of at least size and at most half as large again
+void *arena_alloc(size_t size) {
+    cache *c = size >= ARENA_MIN ? thread_cache(1) : NULL;
+    unsigned char *block = NULL;
+
+    if (c) {
+        int best = -1;
+        for (int i = 0; i < c->count; i++)
+            if (c->sizes[i] >= size && c->sizes[i] <= size + size / 2 &&
+                (best < 0 || c->sizes[i] < c->sizes[best]))
+                best = i;
+        if (best >= 0) {
+            block = c->blocks[best];
+            c->cached -= c->sizes[best];
+            c->count--;
+            c->blocks[best] = c->blocks[c->count];
+            c->sizes[best] = c->sizes[c->count];
+            c->hits++;
+            return block + HEADER;
+        }
+        c->misses++;
+    }
+    block = malloc(size + HEADER);
+    if (!block) return NULL;
+    memcpy(block, &size, sizeof(size));
+    return block + HEADER;
+}
+
+// Function to return a block to the calling thread's cache, or to the
+// system when the cache is full
+void arena_free(void *ptr) {
+    unsigned char *block;
+    size_t size;
+    cache *c;
+
+    if (!ptr) return;
+    block = (unsigned char *)ptr - HEADER;
+    memcpy(&size, block, sizeof(size));
+    c = size >= ARENA_MIN ? thread_cache(1) : NULL;
+    if (c && c->count < ARENA_SLOTS && c->cached + size <= ARENA_MAX_CACHED) {
+        c->blocks[c->count] = block;
+        c->sizes[c->count] = size;
+        c->count++;
+        c->cached += size;
+        return;
+    }
+    free(block);
+}
+
+// Function to free the calling thread's cached blocks now, e.g. when a
+// long-lived thread finishes a batch
+void arena_thread_release(void) {
+    cache *c = thread_cache(0);
+
+    if (!c) return;
+    for (int i = 0; i < c->count; i++)
+        free(c->blocks[i]);
+    c->count = 0;
+    c->cached = 0;
+}
+
+void arena_thread_report(arena_report *report) {
+    cache *c = thread_cache(0);
+
+    memset(report, 0, sizeof(*report));
+    if (!c) return;
+    report->hits = c->hits;
+    report->misses = c->misses;
+    report->cached = c->cached;
+}
+
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size) {
+    (void)opaque;
+    return arena_alloc((size_t)items * size);
+}
+
+static void zlib_free(voidpf opaque, voidpf ptr) {
+    (void)opaque;
+    arena_free(ptr);
+}
+
+static void *bz_alloc(void *opaque, int items, int size) {
+    (void)opaque;
+    return arena_alloc((size_t)items * size);
+}
+
+static void bz_free(void *opaque, void *ptr) {
+    (void)opaque;
+    arena_free(ptr);
+}
+
+static void *xz_alloc(void *opaque, size_t items, size_t size) {
+    (void)opaque;
+    return arena_alloc(items * size);
+}
+
+static void xz_free(void *opaque, void *ptr) {
+    (void)opaque;
+    arena_free(ptr);
+}
+
+void arena_zstream(z_stream *strm) {
+    strm->zalloc = zlib_alloc;
+    strm->zfree = zlib_free;
+    strm->opaque = Z_NULL;
+}
+
+void arena_bzstream(bz_stream *strm) {
+    strm->bzalloc = bz_alloc;
+    strm->bzfree = bz_free;
+    strm->opaque = NULL;
+}
+
+const lzma_allocator arena_lzma = { xz_alloc, xz_free, NULL };
@@ -0,0 +1,37 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <bzlib.h>
+#include <lzma.h>
+#include <zlib.h>
+
+// Pooled allocator for codec state. The encoders allocate the same large
+// tables for every stream (LZMA preset 9 about 700 MB of match finder,
+// bzip2 -9 about 7.5 MB, deflate about 256 KB), so a batch of small files
+// spends its time in malloc, mmap and page faults. Blocks freed through
+// the arena are kept in a cache of the freeing thread and handed to the
+// next stream that asks for a similar size, already faulted in; in steady
+// state a worker makes no large allocations. Blocks under ARENA_MIN go
+// straight to malloc. Each thread's cache is freed when it exits, or
+// earlier by arena_thread_release().
+#define ARENA_MIN (64 * 1024)
+#define ARENA_SLOTS 32                          // Blocks cached per thread
+#define ARENA_MAX_CACHED ((size_t)1 << 30)      // Bytes cached per thread
+
+typedef struct {
+    unsigned long long hits, misses;    // Large allocations served from / not from the cache
+    size_t cached;                      // Bytes held in the cache now
+} arena_report;
+
+void *arena_alloc(size_t size);
+void arena_free(void *ptr);
+void arena_thread_release(void);
+void arena_thread_report(arena_report *report);
+
+// Hooks for the codec libraries: call before the stream's init function
+void arena_zstream(z_stream *strm);
+void arena_bzstream(bz_stream *strm);
+extern const lzma_allocator arena_lzma;     // strm.allocator = &arena_lzma
+
+#endif // ARENA_H
@@ -0,0 +1,287 @@
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "batch.h"
+#include "budget.h"
+#include "compress.h"
+#include "pool.h"
+
+typedef struct {
+    char *path;
+    unsigned long long size;
+} batch_file;
+
+// A run of consecutive files: one large file, or a group of small ones
+typedef struct {
+    size_t first, count;
+    unsigned long long bytes;
+} batch_job;
+
+// Per-worker deque of job indices. The owner takes from the head, where
+// the largest jobs were dealt; thieves take from the tail, so they split
+// off the small jobs left at the end of a busy queue.
+typedef struct worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    size_t *items;
+    size_t head, tail;
+    unsigned int seed;
+    struct batch *batch;
+    unsigned long long files, failed, steals, bytes_in, bytes_out;
+} worker;
+
+typedef struct batch {
+    batch_file *files;
+    size_t nfiles, files_cap;
+    batch_job *jobs;
+    size_t njobs;
+    worker *workers;
+    int nworkers;
+    const fc_dict *dict;
+    unsigned long long unreadable;      // Directories walk() could not open
+} batch;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int ends_with(const char *s, const char *suffix) {
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+static int add_file(batch *b, const char *path, unsigned long long size) {
+    if (b->nfiles == b->files_cap) {
+        size_t cap = b->files_cap ? b->files_cap * 2 : 1024;
+        batch_file *grown = realloc(b->files, cap * sizeof(batch_file));
+        if (!grown) return -1;
+        b->files = grown;
+        b->files_cap = cap;
+    }
+    b->files[b->nfiles].path = strdup(path);
+    if (!b->files[b->nfiles].path) return -1;
+    b->files[b->nfiles].size = size;
+    b->nfiles++;
+    return 0;
+}
+
+// Collects the regular files under dir. Symlinks are not followed and
+// existing .fc outputs are skipped, so a rerun does not compress them.
+static int walk(batch *b, const char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *ent;
+    struct stat st;
+    char path[4096];
+    int ret = 0;
+
+    if (!d) {
+        fprintf(stderr, "Error: Cannot open directory %s\n", dir);
+        b->unreadable++;
+        return 0;
+    }
+    while (ret == 0 && (ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        if (snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name) >= (int)sizeof(path)) continue;
+        if (lstat(path, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode))
+            ret = walk(b, path);
+        else if (S_ISREG(st.st_mode) && !ends_with(ent->d_name, ".fc"))
+            ret = add_file(b, path, st.st_size);
+    }
+    closedir(d);
+    return ret;
+}
+
+// Each large file is its own job; runs of small files share one
+static int make_jobs(batch *b) {
+    size_t i = 0;
+
+    b->jobs = malloc((b->nfiles ? b->nfiles : 1) * sizeof(batch_job));
+    if (!b->jobs) return -1;
+    while (i < b->nfiles) {
+        batch_job *job = &b->jobs[b->njobs++];
+        job->first = i;
+        job->count = 0;
+        job->bytes = 0;
+        do {
+            job->bytes += b->files[i].size;
+            job->count++;
+            i++;
+        } while (b->files[job->first].size < BATCH_SMALL && i < b->nfiles &&
+                 b->files[i].size < BATCH_SMALL && job->bytes < BATCH_GROUP &&
+                 job->count < BATCH_GROUP_FILES);
+    }
+    return 0;
+}
+
+static int compare_jobs(const void *a, const void *b) {
+    const batch_job *x = a, *y = b;
+    return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+static void compress_one(worker *w, const batch_file *f) {
+    char out_name[4096 + 4];
+    FILE *source, *dest;
+
+    snprintf(out_name, sizeof(out_name), "%s.fc", f->path);
+    source = fopen(f->path, "rb");
+    if (!source) {
+        fprintf(stderr, "Error: Cannot open file %s\n", f->path);
+        w->failed++;
+        return;
+    }
+    dest = fopen(out_name, "wb");
+    if (!dest) {
+        fprintf(stderr, "Error: Cannot create file %s\n", out_name);
+        fclose(source);
+        w->failed++;
+        return;
+    }
+
+    // The pool already keeps every core busy, so each file stays on its worker
+    if (w->batch->dict && f->size < BATCH_SMALL)
+        compress_with_dict(source, dest, FC_ZLIB, 9, w->batch->dict);
+    else
+        compress_auto_threads(source, dest, 1);
+
+    int failed = ferror(source) || fflush(dest) != 0 || ferror(dest);
+    long out_len = ftell(dest);
+    fclose(source);
+    if (fclose(dest) != 0) failed = 1;
+    if (failed) {
+        fprintf(stderr, "Error: Cannot compress file %s\n", f->path);
+        remove(out_name);
+        w->failed++;
+        return;
+    }
+    w->files++;
+    w->bytes_in += f->size;
+    w->bytes_out += out_len > 0 ? out_len : 0;
+}
+
+// Takes the next job from the worker's own queue, or steals one from the
+// tail of another worker's. Jobs are all dealt up front, so once every
+// queue is empty the worker is done.
+static int next_job(worker *w, size_t *job) {
+    batch *b = w->batch;
+    int found = 0;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->head < w->tail) {
+        *job = w->items[w->head++];
+        found = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (found) return 1;
+
+    int start = rand_r(&w->seed) % b->nworkers;
+    for (int i = 0; i < b->nworkers && !found; i++) {
+        worker *victim = &b->workers[(start + i) % b->nworkers];
+        if (victim == w) continue;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) {
+            *job = victim->items[--victim->tail];
+            found = 1;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    if (found) w->steals++;
+    return found;
+}
+
+static void *worker_main(void *arg) {
+    worker *w = (worker *)arg;
+    batch *b = w->batch;
+    size_t j;
+
+    while (next_job(w, &j)) {
+        const batch_job *job = &b->jobs[j];
+        for (size_t i = 0; i < job->count; i++)
+            compress_one(w, &b->files[job->first + i]);
+    }
+    return NULL;
+}
+
+// Function to compress every file under root on threads workers (0 = one
+// per CPU). dict may be NULL. Returns 0 if every file was compressed,
+// -1 otherwise; report may be NULL.
+int batch_compress(const char *root, int threads, const fc_dict *dict, batch_report *report) {
+    batch b;
+    int failed = 0, started;
+    double start = now_seconds();
+    batch_report r;
+
+    memset(&b, 0, sizeof(b));
+    memset(&r, 0, sizeof(r));
+    b.dict = dict;
+    if (threads <= 0) threads = pool_default_threads();
+
+    if (walk(&b, root) != 0 || make_jobs(&b) != 0) {
+        fprintf(stderr, "Error: Out of memory listing %s\n", root);
+        failed = 1;
+        goto done;
+    }
+    if ((size_t)threads > b.njobs) threads = b.njobs ? b.njobs : 1;
+
+    // Largest jobs first, dealt round-robin so every queue starts with
+    // a similar amount of work
+    qsort(b.jobs, b.njobs, sizeof(batch_job), compare_jobs);
+    b.workers = calloc(threads, sizeof(worker));
+    if (!b.workers) {
+        failed = 1;
+        goto done;
+    }
+    b.nworkers = threads;
+    for (int i = 0; i < threads; i++) {
+        worker *w = &b.workers[i];
+        w->batch = &b;
+        w->seed = i + 1;
+        pthread_mutex_init(&w->lock, NULL);
+        w->items = malloc((b.njobs / threads + 1) * sizeof(size_t));
+        if (!w->items) failed = 1;
+    }
+    for (size_t j = 0; j < b.njobs && !failed; j++) {
+        worker *w = &b.workers[j % threads];
+        w->items[w->tail++] = j;
+    }
+
+    // The calling thread works as worker 0
+    for (started = 1; started < threads && !failed; started++)
+        if (pthread_create(&b.workers[started].thread, NULL, worker_main, &b.workers[started]) != 0)
+            break;
+    if (!failed) worker_main(&b.workers[0]);
+    for (int i = 1; i < started; i++)
+        pthread_join(b.workers[i].thread, NULL);
+    // The other workers' codec caches went with their threads
+    budget_thread_release();
+
+    for (int i = 0; i < threads; i++) {
+        worker *w = &b.workers[i];
+        r.files += w->files;
+        r.failed += w->failed;
+        r.steals += w->steals;
+        r.bytes_in += w->bytes_in;
+        r.bytes_out += w->bytes_out;
+        pthread_mutex_destroy(&w->lock);
+        free(w->items);
+    }
+    r.jobs = b.njobs;
+    r.failed += b.unreadable;
+
+done:
+    r.seconds = now_seconds() - start;
+    r.mbps = r.seconds > 0 ? r.bytes_in / r.seconds / 1e6 : 0;
+    if (report) *report = r;
+    for (size_t i = 0; i < b.nfiles; i++)
+        free(b.files[i].path);
+    free(b.files);
+    free(b.jobs);
+    free(b.workers);
+    return failed || r.failed ? -1 : 0;
+}
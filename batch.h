@@ -0,0 +1,28 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "dict.h"
+
+// Batch compression of a directory tree. Every regular file gets a
+// <name>.fc next to it, as compress_file("auto") writes. Files are
+// scheduled on a work-stealing pool; small files are grouped so one job
+// covers many of them. With a dictionary, small files are written with
+// zlib at level 9 primed by it.
+#define BATCH_SMALL (256 * 1024)        // Files below this are grouped
+#define BATCH_GROUP (4 * 1024 * 1024)   // Bytes per group job
+#define BATCH_GROUP_FILES 256           // Files per group job
+
+typedef struct {
+    unsigned long long files;           // Files compressed
+    unsigned long long failed;          // Files that could not be compressed,
+                                        // and directories that could not be read
+    unsigned long long jobs;            // Scheduled jobs (single files and groups)
+    unsigned long long steals;          // Jobs taken from another worker's queue
+    unsigned long long bytes_in, bytes_out;
+    double seconds;
+    double mbps;                        // Input MB/s over the whole run
+} batch_report;
+
+int batch_compress(const char *root, int threads, const fc_dict *dict, batch_report *report);
+
+#endif // BATCH_H
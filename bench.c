@@ -0,0 +1,398 @@
+// Codec benchmark: runs every codec, the compress_file cascade and the
+// decompress paths over a corpus and reports MB/s, ratio and peak RSS.
+//
+//   bench [-s MB] [-r repeats] [-f table|csv|json] [-t tmpdir] [file...]
+//
+// Rows named cascade/<stage> time each stage of compress_file on the
+// input that stage sees, to show where the cascade spends its time.
+// With no files, synthetic text, binary, random and zero corpora of -s MB
+// are generated. Every measurement runs in a forked child, so the peak
+// RSS reported by wait4() belongs to that codec run alone.
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "archive.h"
+#include "compress.h"
+
+#define MAX_CORPUS 64
+#define MAX_REPEATS 100
+
+typedef struct {
+    const char *name;
+    void (*compress)(const char *in, const char *out);
+    void (*decompress)(const char *in, const char *out);
+    int stage;              // Cascade stage: input is the zlib stage's output
+} bench_codec;
+
+typedef struct {
+    char name[256];
+    char path[512];
+    long long size;
+    char stage_path[512];   // Corpus after the cascade's zlib stage
+    long long stage_size;
+} corpus_file;
+
+// One measured run: wall seconds and peak RSS of the child
+typedef struct {
+    double seconds;
+    long rss_kb;
+    int ok;
+} run_result;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Opens both files and runs a FILE* codec function between them
+static void run_stream(void (*fn)(FILE *, FILE *), const char *in, const char *out) {
+    FILE *source = fopen(in, "rb");
+    FILE *dest = fopen(out, "wb");
+    if (source && dest) fn(source, dest);
+    if (source) fclose(source);
+    if (dest) fclose(dest);
+}
+
+static void zlib_c(const char *in, const char *out) { run_stream(compress_zlib, in, out); }
+static void zlib_d(const char *in, const char *out) { run_stream(decompress_zlib, in, out); }
+static void bz2_c(const char *in, const char *out) { run_stream(compress_bz2, in, out); }
+static void bz2_d(const char *in, const char *out) { run_stream(decompress_bz2, in, out); }
+static void lzma_c(const char *in, const char *out) { run_stream(compress_lzma, in, out); }
+static void lzma_d(const char *in, const char *out) { run_stream(decompress_lzma, in, out); }
+static void auto_c(const char *in, const char *out) { run_stream(compress_auto, in, out); }
+static void auto_d(const char *in, const char *out) { run_stream(decompress_auto, in, out); }
+
+static void pzlib(FILE *source, FILE *dest) { compress_zlib_parallel(source, dest, 0, 0); }
+static void pzlib_c(const char *in, const char *out) { run_stream(pzlib, in, out); }
+
+static void mtlzma(FILE *source, FILE *dest) { compress_lzma_mt(source, dest, 0, 0); }
+static void unmtlzma(FILE *source, FILE *dest) { decompress_lzma_mt(source, dest, 0); }
+static void mtlzma_c(const char *in, const char *out) { run_stream(mtlzma, in, out); }
+static void mtlzma_d(const char *in, const char *out) { run_stream(unmtlzma, in, out); }
+
+static void archive_c(const char *in, const char *out) {
+    FILE *source = fopen(in, "rb");
+    FILE *dest = fopen(out, "wb");
+    if (source && dest) archive_create(source, dest, FC_ZLIB, 6, 0, 0);
+    if (source) fclose(source);
+    if (dest) fclose(dest);
+}
+
+static void archive_d(const char *in, const char *out) {
+    archive_t *ar = archive_open(in);
+    FILE *dest = fopen(out, "wb");
+    if (ar && dest) archive_extract(ar, dest);
+    if (dest) fclose(dest);
+    archive_close(ar);
+}
+
+// The full compress_file cascade. It writes <in>.bz2 and <in>.lzma next to
+// its input and decompresses into the working directory, so the corpus
+// file is linked into the temp dir first and the child chdirs there.
+static void cascade_c(const char *in, const char *out) {
+    char path[600];
+    compress_file("compress", in);
+    snprintf(path, sizeof(path), "%s.lzma", in);
+    rename(path, out);
+    snprintf(path, sizeof(path), "%s.bz2", in);
+    remove(path);
+}
+
+static void cascade_d(const char *in, const char *out) {
+    char base[600], lzma_path[610], *dot;
+    snprintf(base, sizeof(base), "%s", in);
+    dot = strrchr(base, '.');
+    if (dot) *dot = '\0';
+    snprintf(lzma_path, sizeof(lzma_path), "%s.lzma", base);
+    rename(in, lzma_path);
+    compress_file("decompress", base);
+    rename(lzma_path, in);
+    rename("decompressed_final.txt", out);
+}
+
+// The cascade/ rows time each stage of compress_file on its own input:
+// the zlib stage on the corpus, the bz2 and LZMA stages on its output
+static const bench_codec codecs[] = {
+    { "zlib", zlib_c, zlib_d, 0 },
+    { "zlib-parallel", pzlib_c, zlib_d, 0 },
+    { "bz2", bz2_c, bz2_d, 0 },
+    { "lzma", lzma_c, lzma_d, 0 },
+    { "lzma-mt", mtlzma_c, mtlzma_d, 0 },
+    { "auto", auto_c, auto_d, 0 },
+    { "archive", archive_c, archive_d, 0 },
+    { "cascade", cascade_c, cascade_d, 0 },
+    { "cascade/zlib", pzlib_c, zlib_d, 0 },
+    { "cascade/bz2", bz2_c, bz2_d, 1 },
+    { "cascade/lzma", mtlzma_c, mtlzma_d, 1 },
+};
+
+// Runs fn(in, out) in a forked child; returns its wall time and peak RSS
+static run_result measure(void (*fn)(const char *, const char *), const char *in, const char *out,
+                          const char *workdir) {
+    run_result r = { 0, 0, 0 };
+    struct rusage ru;
+    int fds[2], status;
+    pid_t pid;
+
+    if (pipe(fds) != 0) return r;
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return r;
+    }
+    if (pid == 0) {
+        double start, seconds;
+        close(fds[0]);
+        if (chdir(workdir) != 0) _exit(1);
+        // Keep codec chatter off the report
+        if (!freopen("/dev/null", "w", stdout)) _exit(1);
+        start = now_seconds();
+        fn(in, out);
+        seconds = now_seconds() - start;
+        if (write(fds[1], &seconds, sizeof(seconds)) != sizeof(seconds)) _exit(1);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    if (read(fds[0], &r.seconds, sizeof(r.seconds)) == sizeof(r.seconds)) r.ok = 1;
+    close(fds[0]);
+    if (wait4(pid, &status, 0, &ru) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        r.ok = 0;
+    r.rss_kb = ru.ru_maxrss;
+    return r;
+}
+
+static long long file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long long)st.st_size : -1;
+}
+
+// Byte-for-byte comparison of the round trip
+static int same_file(const char *a, const char *b) {
+    FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+    unsigned char ba[65536], bb[65536];
+    size_t na, nb;
+    int same = fa && fb;
+
+    while (same) {
+        na = fread(ba, 1, sizeof(ba), fa);
+        nb = fread(bb, 1, sizeof(bb), fb);
+        if (na != nb || memcmp(ba, bb, na) != 0) same = 0;
+        if (na == 0) break;
+    }
+    if (fa) fclose(fa);
+    if (fb) fclose(fb);
+    return same;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double median(double *v, int n) {
+    qsort(v, n, sizeof(double), compare_doubles);
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+// Synthetic corpora: English-like text, fixed-width binary records,
+// random bytes (stands in for already-compressed data) and zeros
+static int generate_corpus(const char *path, const char *kind, long long size) {
+    static const char *words[] = {
+        "the", "of", "and", "compression", "block", "stream", "error", "request", "user", "file",
+        "server", "time", "level", "data", "index", "log", "GET", "POST", "200", "404",
+    };
+    FILE *f = fopen(path, "wb");
+    unsigned long long x = 88172645463325252ULL;
+    long long written = 0;
+
+    if (!f) return -1;
+    while (written < size) {
+        unsigned char rec[64];
+        int n;
+
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        if (strcmp(kind, "text") == 0) {
+            n = snprintf((char *)rec, sizeof(rec), "%s%s", words[x % 20], (x >> 8) % 12 ? " " : ".\n");
+        } else if (strcmp(kind, "binary") == 0) {
+            unsigned int id = written / 16, value = 1000 + (x % 64);
+            memcpy(rec, &id, 4);
+            memcpy(rec + 4, &value, 4);
+            memcpy(rec + 8, &x, 8);
+            rec[12] = rec[13] = rec[14] = rec[15] = 0;
+            n = 16;
+        } else if (strcmp(kind, "random") == 0) {
+            memcpy(rec, &x, 8);
+            n = 8;
+        } else {
+            memset(rec, 0, sizeof(rec));
+            n = sizeof(rec);
+        }
+        if (n > size - written) n = size - written;
+        fwrite(rec, 1, n, f);
+        written += n;
+    }
+    fclose(f);
+    return 0;
+}
+
+// Prints s as a JSON string: corpus names come from file names, which
+// may hold quotes, backslashes or control characters
+static void print_json_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        unsigned char ch = (unsigned char)*s;
+        if (ch == '"' || ch == '\\') printf("\\%c", ch);
+        else if (ch < 0x20) printf("\\u%04x", ch);
+        else putchar(ch);
+    }
+    putchar('"');
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-s MB] [-r repeats] [-f table|csv|json] [-t tmpdir] [file...]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    corpus_file corpus[MAX_CORPUS];
+    int ncorpus = 0, repeats = 3, opt, first = 1;
+    long long synthetic_mb = 16;
+    const char *format = "table", *tmpbase = "/tmp";
+    char workdir[400];
+
+    while ((opt = getopt(argc, argv, "s:r:f:t:h")) != -1) {
+        switch (opt) {
+        case 's': synthetic_mb = atoll(optarg); break;
+        case 'r': repeats = atoi(optarg); break;
+        case 'f': format = optarg; break;
+        case 't': tmpbase = optarg; break;
+        default: usage(argv[0]); return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (repeats < 1) repeats = 1;
+    if (repeats > MAX_REPEATS) repeats = MAX_REPEATS;
+
+    snprintf(workdir, sizeof(workdir), "%s/fcbench-XXXXXX", tmpbase);
+    if (!mkdtemp(workdir)) {
+        fprintf(stderr, "Error: cannot create %s: %s\n", workdir, strerror(errno));
+        return 1;
+    }
+
+    // Corpus files are linked (or generated) into the work dir, so every
+    // codec reads and writes on the same filesystem
+    for (int i = optind; i < argc && ncorpus < MAX_CORPUS; i++) {
+        corpus_file *c = &corpus[ncorpus];
+        const char *base = strrchr(argv[i], '/');
+        char *target = realpath(argv[i], NULL);
+        snprintf(c->name, sizeof(c->name), "%s", base ? base + 1 : argv[i]);
+        snprintf(c->path, sizeof(c->path), "%s/c%d", workdir, ncorpus);
+        if (!target || symlink(target, c->path) != 0 || (c->size = file_size(c->path)) < 0) {
+            fprintf(stderr, "Error: cannot read %s\n", argv[i]);
+            free(target);
+            continue;
+        }
+        free(target);
+        ncorpus++;
+    }
+    if (ncorpus == 0) {
+        static const char *kinds[] = { "text", "binary", "random", "zeros" };
+        for (int i = 0; i < 4; i++) {
+            corpus_file *c = &corpus[ncorpus];
+            snprintf(c->name, sizeof(c->name), "synthetic-%s", kinds[i]);
+            snprintf(c->path, sizeof(c->path), "%s/c%d", workdir, ncorpus);
+            if (generate_corpus(c->path, kinds[i], synthetic_mb << 20) != 0) continue;
+            c->size = file_size(c->path);
+            ncorpus++;
+        }
+    }
+
+    for (int c = 0; c < ncorpus; c++) {
+        snprintf(corpus[c].stage_path, sizeof(corpus[c].stage_path), "%s/c%d.zlib", workdir, c);
+        pzlib_c(corpus[c].path, corpus[c].stage_path);
+        corpus[c].stage_size = file_size(corpus[c].stage_path);
+    }
+
+    if (strcmp(format, "csv") == 0)
+        printf("corpus,codec,size,compressed,ratio,compress_mbps,decompress_mbps,"
+               "compress_rss_kb,decompress_rss_kb,repeats,ok\n");
+    else if (strcmp(format, "json") == 0)
+        printf("[\n");
+    else
+        printf("%-20s %-14s %12s %8s %10s %10s %10s %10s %s\n", "corpus", "codec", "size", "ratio",
+               "comp MB/s", "dec MB/s", "comp RSS", "dec RSS", "ok");
+
+    for (int c = 0; c < ncorpus; c++) {
+        for (size_t k = 0; k < sizeof(codecs) / sizeof(codecs[0]); k++) {
+            const bench_codec *codec = &codecs[k];
+            const char *input = codec->stage ? corpus[c].stage_path : corpus[c].path;
+            long long size = codec->stage ? corpus[c].stage_size : corpus[c].size;
+            double comp_s[MAX_REPEATS], dec_s[MAX_REPEATS];
+            long comp_rss = 0, dec_rss = 0;
+            long long compressed = 0;
+            char packed[600], unpacked[600];
+            int ok = 1;
+
+            snprintf(packed, sizeof(packed), "%s/c%d.%zu.pack", workdir, c, k);
+            snprintf(unpacked, sizeof(unpacked), "%s/c%d.%zu.out", workdir, c, k);
+
+            for (int r = 0; r < repeats; r++) {
+                run_result rc = measure(codec->compress, input, packed, workdir);
+                run_result rd = measure(codec->decompress, packed, unpacked, workdir);
+                ok = ok && rc.ok && rd.ok;
+                comp_s[r] = rc.seconds;
+                dec_s[r] = rd.seconds;
+                if (rc.rss_kb > comp_rss) comp_rss = rc.rss_kb;
+                if (rd.rss_kb > dec_rss) dec_rss = rd.rss_kb;
+            }
+            compressed = file_size(packed);
+            ok = ok && same_file(input, unpacked);
+
+            double mb = size / 1e6;
+            double cm = median(comp_s, repeats), dm = median(dec_s, repeats);
+            double comp_mbps = cm > 0 ? mb / cm : 0, dec_mbps = dm > 0 ? mb / dm : 0;
+            double ratio = compressed > 0 ? (double)size / compressed : 0;
+
+            if (strcmp(format, "csv") == 0) {
+                printf("%s,%s,%lld,%lld,%.4f,%.2f,%.2f,%ld,%ld,%d,%d\n", corpus[c].name, codec->name,
+                       size, compressed, ratio, comp_mbps, dec_mbps, comp_rss, dec_rss, repeats, ok);
+            } else if (strcmp(format, "json") == 0) {
+                printf("%s  {\"corpus\": ", first ? "" : ",\n");
+                print_json_string(corpus[c].name);
+                printf(", \"codec\": ");
+                print_json_string(codec->name);
+                printf(", \"size\": %lld, \"compressed\": %lld, "
+                       "\"ratio\": %.4f, \"compress_mbps\": %.2f, \"decompress_mbps\": %.2f, "
+                       "\"compress_rss_kb\": %ld, \"decompress_rss_kb\": %ld, \"repeats\": %d, \"ok\": %s}",
+                       size, compressed, ratio, comp_mbps, dec_mbps, comp_rss, dec_rss, repeats,
+                       ok ? "true" : "false");
+            } else {
+                printf("%-20s %-14s %12lld %8.3f %10.2f %10.2f %8ldkB %8ldkB %s\n", corpus[c].name,
+                       codec->name, size, ratio, comp_mbps, dec_mbps, comp_rss, dec_rss,
+                       ok ? "yes" : "NO");
+            }
+            first = 0;
+            fflush(stdout);
+            remove(packed);
+            remove(unpacked);
+        }
+    }
+    if (strcmp(format, "json") == 0) printf("\n]\n");
+
+    for (int c = 0; c < ncorpus; c++) {
+        remove(corpus[c].path);
+        remove(corpus[c].stage_path);
+    }
+    rmdir(workdir);
+    return 0;
+}
@@ -0,0 +1,208 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lzma.h>
+#include "arena.h"
+#include "budget.h"
+#include "codec.h"
+#include "compress.h"
+#include "pool.h"
+
+// The arena cache a thread's last run left behind
+typedef struct {
+    size_t held;                    // Bytes of it charged to the budget
+    int codec, level, threads;      // Settings of that run
+} thread_state;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t freed = PTHREAD_COND_INITIALIZER;
+static size_t limit, used;
+static int running;
+static budget_report totals;
+
+static pthread_key_t state_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+// Thread exit: its arena cache is freed, so stop charging for it
+static void thread_exit(void *arg) {
+    thread_state *ts = (thread_state *)arg;
+
+    pthread_mutex_lock(&lock);
+    used -= ts->held;
+    pthread_cond_broadcast(&freed);
+    pthread_mutex_unlock(&lock);
+    free(ts);
+}
+
+static void make_key(void) {
+    pthread_key_create(&state_key, thread_exit);
+}
+
+static thread_state *get_state(void) {
+    thread_state *ts;
+
+    pthread_once(&key_once, make_key);
+    ts = pthread_getspecific(state_key);
+    if (!ts) {
+        ts = calloc(1, sizeof(*ts));
+        if (ts) pthread_setspecific(state_key, ts);
+    }
+    return ts;
+}
+
+// Frees the calling thread's cache and its charge. Called with lock held.
+static void drop_cache(thread_state *ts) {
+    arena_thread_release();
+    if (ts && ts->held) {
+        used -= ts->held;
+        ts->held = 0;
+        pthread_cond_broadcast(&freed);
+    }
+}
+
+static int threaded(int codec) {
+    const codec_t *c = codec_by_id(codec);
+    return codec == FC_ZLIB || (c && c->threaded);
+}
+
+// Highest settings that fit in avail, lowering threads before level
+static int fit(int codec, int max_level, int max_threads, size_t extra, size_t avail,
+               int *level, int *threads) {
+    int min_level = max_level < BUDGET_MIN_LEVEL ? max_level : BUDGET_MIN_LEVEL;
+
+    for (int l = max_level; l >= min_level; l--) {
+        for (int t = max_threads; t >= 1; t--) {
+            if (codec_memusage(codec, l, t) + extra <= avail) {
+                *level = l;
+                *threads = t;
+                return 1;
+            }
+        }
+    }
+    *level = min_level;
+    *threads = 1;
+    return 0;
+}
+
+// Function to set the budget in bytes; 0 = no limit. Set it before
+// starting work: runs in progress keep what they reserved.
+void budget_set(size_t bytes) {
+    pthread_mutex_lock(&lock);
+    limit = bytes;
+    pthread_cond_broadcast(&freed);
+    pthread_mutex_unlock(&lock);
+}
+
+// Function to suggest a limit: half of physical memory
+size_t budget_default_limit(void) {
+    return (size_t)(lzma_physmem() / 2);
+}
+
+// Function to reserve memory for an encoder run of codec at level (-1 =
+// default) on threads (0 = one per CPU), plus extra bytes of buffers.
+// Blocks until the run fits; grant then holds the settings to use, which
+// may be lower than asked. Every grant must be given to budget_release.
+void budget_acquire(budget_grant *grant, int codec, int level, int threads, size_t extra) {
+    const codec_t *c = codec_by_id(codec);
+    int max_threads = 1, waited = 0;
+    thread_state *ts;
+
+    if (level < 0) level = c ? c->default_level : 0;
+    memset(grant, 0, sizeof(*grant));
+    grant->codec = codec;
+    grant->level = level;
+    grant->threads = threads;
+
+    pthread_mutex_lock(&lock);
+    if (!limit) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    if (threaded(codec)) max_threads = threads > 0 ? threads : pool_default_threads();
+    ts = get_state();
+
+    for (;;) {
+        // This thread's own cache is either reused or dropped, so it counts as free
+        size_t held = ts ? ts->held : 0;
+        size_t avail = limit + held > used ? limit + held - used : 0;
+
+        if (fit(codec, level, max_threads, extra, avail, &grant->level, &grant->threads))
+            break;
+        if (running == 0) {
+            totals.over++;
+            break;
+        }
+        drop_cache(ts);
+        if (!waited) totals.waits++;
+        waited = 1;
+        pthread_cond_wait(&freed, &lock);
+    }
+
+    // A cache left by other settings holds blocks of the wrong sizes
+    if (ts && (ts->codec != codec || ts->level != grant->level || ts->threads != grant->threads))
+        drop_cache(ts);
+    if (ts) {
+        used -= ts->held;
+        ts->held = 0;
+    }
+    grant->downgraded = grant->level < level || grant->threads < max_threads;
+    if (!threaded(codec)) grant->threads = threads;
+    grant->bytes = codec_memusage(codec, grant->level, max_threads > 1 ? grant->threads : 1) + extra;
+    grant->reserved = 1;
+
+    used += grant->bytes;
+    running++;
+    totals.runs++;
+    if (grant->downgraded) totals.downgraded++;
+    if (used > totals.peak) totals.peak = used;
+    pthread_mutex_unlock(&lock);
+}
+
+// Function to end a run begun with budget_acquire. What the run left in
+// the thread's arena cache, up to what it reserved, stays charged.
+void budget_release(budget_grant *grant) {
+    arena_report cache;
+    thread_state *ts;
+    size_t keep;
+
+    if (!grant->reserved) return;
+    arena_thread_report(&cache);
+    keep = cache.cached < grant->bytes ? cache.cached : grant->bytes;
+
+    pthread_mutex_lock(&lock);
+    used -= grant->bytes;
+    running--;
+    ts = get_state();
+    if (ts) {
+        ts->held += keep;
+        ts->codec = grant->codec;
+        ts->level = grant->level;
+        ts->threads = threaded(grant->codec) ? grant->threads : 1;
+        used += keep;
+    } else {
+        arena_thread_release();
+    }
+    pthread_cond_broadcast(&freed);
+    pthread_mutex_unlock(&lock);
+    grant->reserved = 0;
+}
+
+// Function to free the calling thread's arena cache and stop charging for
+// it, for a thread that is done compressing but does not exit yet
+void budget_thread_release(void) {
+    thread_state *ts;
+
+    pthread_once(&key_once, make_key);
+    ts = pthread_getspecific(state_key);
+    pthread_mutex_lock(&lock);
+    drop_cache(ts);
+    pthread_mutex_unlock(&lock);
+}
+
+void budget_stats(budget_report *report) {
+    pthread_mutex_lock(&lock);
+    *report = totals;
+    report->limit = limit;
+    report->used = used;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,42 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stddef.h>
+
+// Process-wide memory budget for concurrent compression. Each encoder
+// run reserves its estimated footprint (codec_memusage) before it starts
+// and returns it when it ends. With no limit set, the default, a
+// reservation changes nothing. Under a limit, a run that does not fit in
+// what is left gets fewer threads, then a lower level (for LZMA, a
+// smaller dictionary), and only waits when one thread at level 1 does not
+// fit either. A run too large for the whole limit goes ahead at its
+// smallest settings once nothing else is running.
+//
+// The arena cache (arena.h) a run leaves on its thread stays charged, as
+// the next run there with the same settings reuses it. A thread drops its
+// cache when it has to wait or switches settings, and on exit.
+#define BUDGET_MIN_LEVEL 1
+
+typedef struct {
+    int codec, level, threads;      // Settings to run with
+    size_t bytes;                   // Reserved
+    int downgraded;                 // level or threads were lowered to fit
+    int reserved;                   // Private: counted as running
+} budget_grant;
+
+typedef struct {
+    size_t limit, used, peak;       // peak: most bytes reserved at once
+    unsigned long long runs;        // Reservations made under the limit
+    unsigned long long downgraded;  // Runs given fewer threads or a lower level
+    unsigned long long waits;       // Runs that had to wait for memory
+    unsigned long long over;        // Runs larger than the limit, run alone
+} budget_report;
+
+void budget_set(size_t limit);
+size_t budget_default_limit(void);
+void budget_acquire(budget_grant *grant, int codec, int level, int threads, size_t extra);
+void budget_release(budget_grant *grant);
+void budget_thread_release(void);
+void budget_stats(budget_report *report);
+
+#endif // BUDGET_H
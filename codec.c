@@ -0,0 +1,644 @@
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <bzlib.h>
+#include <lzma.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#include "arena.h"
+#include "codec.h"
+#include "compress.h"
+#include "input.h"
+#include "pool.h"
+#include "stats.h"
+
+#define CODEC_OUT (256 * 1024)   // Output buffer of the stream drivers
+
+// ---- store ----
+
+static void *store_init(int level, int threads, int decode) {
+    (void)level;
+    (void)threads;
+    (void)decode;
+    return malloc(1);
+}
+
+static int store_process(void *ctx, codec_io *io) {
+    size_t n = io->avail_in < io->avail_out ? io->avail_in : io->avail_out;
+
+    (void)ctx;
+    memcpy(io->next_out, io->next_in, n);
+    io->next_in += n;
+    io->avail_in -= n;
+    io->next_out += n;
+    io->avail_out -= n;
+    return CODEC_OK;
+}
+
+static int store_finish(void *ctx, codec_io *io) {
+    (void)ctx;
+    (void)io;
+    return CODEC_END;
+}
+
+static size_t store_memusage(int level, int threads) {
+    (void)level;
+    (void)threads;
+    return CODEC_OUT;
+}
+
+// ---- zlib ----
+
+typedef struct {
+    z_stream strm;
+    int decode;
+} zlib_ctx;
+
+static void *zlib_init(int level, int threads, int decode) {
+    zlib_ctx *z = calloc(1, sizeof(*z));
+
+    (void)threads;
+    if (!z) return NULL;
+    z->decode = decode;
+    arena_zstream(&z->strm);
+    if ((decode ? inflateInit(&z->strm) : deflateInit(&z->strm, level)) != Z_OK) {
+        free(z);
+        return NULL;
+    }
+    return z;
+}
+
+static int zlib_step(zlib_ctx *z, codec_io *io, int flush) {
+    int ret;
+
+    z->strm.next_in = (Bytef *)io->next_in;
+    z->strm.avail_in = io->avail_in;
+    z->strm.next_out = io->next_out;
+    z->strm.avail_out = io->avail_out;
+    ret = z->decode ? inflate(&z->strm, flush) : deflate(&z->strm, flush);
+    io->next_in = z->strm.next_in;
+    io->avail_in = z->strm.avail_in;
+    io->next_out = z->strm.next_out;
+    io->avail_out = z->strm.avail_out;
+
+    if (ret == Z_STREAM_END) return CODEC_END;
+    return ret == Z_OK || ret == Z_BUF_ERROR ? CODEC_OK : CODEC_ERROR;
+}
+
+static int zlib_process(void *ctx, codec_io *io) {
+    return zlib_step(ctx, io, Z_NO_FLUSH);
+}
+
+static int zlib_finish(void *ctx, codec_io *io) {
+    zlib_ctx *z = ctx;
+    size_t room = io->avail_out;
+    int ret = zlib_step(z, io, z->decode ? Z_NO_FLUSH : Z_FINISH);
+
+    // A decoder that makes no progress without input is truncated
+    if (z->decode && ret == CODEC_OK && io->avail_out == room) return CODEC_ERROR;
+    return ret;
+}
+
+static void zlib_free(void *ctx) {
+    zlib_ctx *z = ctx;
+
+    if (z->decode) inflateEnd(&z->strm);
+    else deflateEnd(&z->strm);
+    free(z);
+}
+
+// Deflate state is 256 KB plus the window whatever the level. Several
+// threads are compress.c's block-parallel engine: a deflate state and two
+// 128 KB blocks in and out per worker.
+static size_t zlib_memusage(int level, int threads) {
+    size_t state = (1 << (MAX_WBITS + 2)) + (1 << (MAX_MEM_LEVEL + 9)) + 8192;
+
+    (void)level;
+    if (threads <= 1) return state + CODEC_OUT;
+    return (size_t)threads * (state + 4 * 128 * 1024);
+}
+
+// ---- bz2 ----
+
+typedef struct {
+    bz_stream strm;
+    int decode;
+} bz2_ctx;
+
+static void *bz2_init(int level, int threads, int decode) {
+    bz2_ctx *b = calloc(1, sizeof(*b));
+
+    (void)threads;
+    if (!b) return NULL;
+    b->decode = decode;
+    arena_bzstream(&b->strm);
+    if ((decode ? BZ2_bzDecompressInit(&b->strm, 0, 0) : BZ2_bzCompressInit(&b->strm, level, 0, 0)) != BZ_OK) {
+        free(b);
+        return NULL;
+    }
+    return b;
+}
+
+static int bz2_step(bz2_ctx *b, codec_io *io, int action) {
+    int ret;
+
+    b->strm.next_in = (char *)io->next_in;
+    b->strm.avail_in = io->avail_in;
+    b->strm.next_out = (char *)io->next_out;
+    b->strm.avail_out = io->avail_out;
+    ret = b->decode ? BZ2_bzDecompress(&b->strm) : BZ2_bzCompress(&b->strm, action);
+    io->next_in = (const unsigned char *)b->strm.next_in;
+    io->avail_in = b->strm.avail_in;
+    io->next_out = (unsigned char *)b->strm.next_out;
+    io->avail_out = b->strm.avail_out;
+
+    if (ret == BZ_STREAM_END) return CODEC_END;
+    return ret == BZ_OK || ret == BZ_RUN_OK || ret == BZ_FINISH_OK ? CODEC_OK : CODEC_ERROR;
+}
+
+static int bz2_process(void *ctx, codec_io *io) {
+    return bz2_step(ctx, io, BZ_RUN);
+}
+
+static int bz2_finish(void *ctx, codec_io *io) {
+    bz2_ctx *b = ctx;
+    size_t room = io->avail_out;
+    int ret = bz2_step(b, io, BZ_FINISH);
+
+    if (b->decode && ret == CODEC_OK && io->avail_out == room) return CODEC_ERROR;
+    return ret;
+}
+
+static void bz2_free(void *ctx) {
+    bz2_ctx *b = ctx;
+
+    if (b->decode) BZ2_bzDecompressEnd(&b->strm);
+    else BZ2_bzCompressEnd(&b->strm);
+    free(b);
+}
+
+// From the bzip2 manual: 400k plus eight times the block size
+static size_t bz2_memusage(int level, int threads) {
+    (void)threads;
+    return 400000 + (size_t)level * 800000 + CODEC_OUT;
+}
+
+// ---- LZMA (.xz) ----
+
+static void *xz_init(int level, int threads, int decode) {
+    lzma_stream *strm = malloc(sizeof(*strm));
+    lzma_stream init = LZMA_STREAM_INIT;
+    lzma_mt mt;
+    lzma_ret ret;
+
+    if (!strm) return NULL;
+    *strm = init;
+    strm->allocator = &arena_lzma;
+    memset(&mt, 0, sizeof(mt));
+    mt.threads = threads > 0 ? (uint32_t)threads : lzma_cputhreads();
+    if (mt.threads == 0) mt.threads = 1;
+    mt.preset = level;
+    mt.check = LZMA_CHECK_CRC64;
+    mt.memlimit_stop = UINT64_MAX;
+    mt.memlimit_threading = lzma_physmem() / 4;
+
+    if (decode)
+        ret = mt.threads > 1 ? lzma_stream_decoder_mt(strm, &mt) : lzma_stream_decoder(strm, UINT64_MAX, 0);
+    else
+        ret = mt.threads > 1 ? lzma_stream_encoder_mt(strm, &mt) : lzma_easy_encoder(strm, level, LZMA_CHECK_CRC64);
+    if (ret != LZMA_OK) {
+        free(strm);
+        return NULL;
+    }
+    return strm;
+}
+
+static int xz_step(lzma_stream *strm, codec_io *io, lzma_action action) {
+    lzma_ret ret;
+
+    strm->next_in = io->next_in;
+    strm->avail_in = io->avail_in;
+    strm->next_out = io->next_out;
+    strm->avail_out = io->avail_out;
+    ret = lzma_code(strm, action);
+    io->next_in = strm->next_in;
+    io->avail_in = strm->avail_in;
+    io->next_out = strm->next_out;
+    io->avail_out = strm->avail_out;
+
+    if (ret == LZMA_STREAM_END) return CODEC_END;
+    return ret == LZMA_OK ? CODEC_OK : CODEC_ERROR;
+}
+
+static int xz_process(void *ctx, codec_io *io) {
+    return xz_step(ctx, io, LZMA_RUN);
+}
+
+static int xz_finish(void *ctx, codec_io *io) {
+    return xz_step(ctx, io, LZMA_FINISH);
+}
+
+static void xz_free(void *ctx) {
+    lzma_end(ctx);
+    free(ctx);
+}
+
+static size_t xz_memusage(int level, int threads) {
+    lzma_mt mt;
+    uint64_t n;
+
+    if (threads <= 1) {
+        n = lzma_easy_encoder_memusage(level);
+    } else {
+        memset(&mt, 0, sizeof(mt));
+        mt.threads = threads;
+        mt.preset = level;
+        mt.check = LZMA_CHECK_CRC64;
+        n = lzma_stream_encoder_mt_memusage(&mt);
+    }
+    return n == UINT64_MAX ? 0 : (size_t)n + CODEC_OUT;
+}
+
+#ifdef HAVE_ZSTD
+// ---- zstd ----
+
+typedef struct {
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    size_t last;            // Last decoder return: 0 at a frame boundary
+} zstd_ctx;
+
+static void *zstd_init(int level, int threads, int decode) {
+    zstd_ctx *z = calloc(1, sizeof(*z));
+
+    if (!z) return NULL;
+    if (decode) {
+        z->dctx = ZSTD_createDCtx();
+        if (!z->dctx) goto fail;
+        return z;
+    }
+    z->cctx = ZSTD_createCCtx();
+    if (!z->cctx) goto fail;
+    ZSTD_CCtx_setParameter(z->cctx, ZSTD_c_compressionLevel, level);
+    // Workers need a libzstd built with multithreading; without it the
+    // call fails and compression stays on the calling thread
+    if (threads != 1)
+        ZSTD_CCtx_setParameter(z->cctx, ZSTD_c_nbWorkers, threads > 0 ? threads : pool_default_threads());
+    return z;
+
+fail:
+    free(z);
+    return NULL;
+}
+
+static int zstd_step(zstd_ctx *z, codec_io *io, ZSTD_EndDirective end) {
+    ZSTD_inBuffer in = { io->next_in, io->avail_in, 0 };
+    ZSTD_outBuffer out = { io->next_out, io->avail_out, 0 };
+    size_t ret;
+
+    if (z->dctx) ret = z->last = ZSTD_decompressStream(z->dctx, &out, &in);
+    else ret = ZSTD_compressStream2(z->cctx, &out, &in, end);
+    io->next_in += in.pos;
+    io->avail_in -= in.pos;
+    io->next_out += out.pos;
+    io->avail_out -= out.pos;
+
+    if (ZSTD_isError(ret)) return CODEC_ERROR;
+    if (ret == 0 && (z->dctx || end == ZSTD_e_end)) return CODEC_END;
+    return CODEC_OK;
+}
+
+static int zstd_process(void *ctx, codec_io *io) {
+    return zstd_step(ctx, io, ZSTD_e_continue);
+}
+
+static int zstd_finish(void *ctx, codec_io *io) {
+    zstd_ctx *z = ctx;
+    size_t room = io->avail_out;
+    int ret;
+
+    if (z->dctx && z->last == 0) return CODEC_END;
+    ret = zstd_step(z, io, ZSTD_e_end);
+    if (z->dctx && ret == CODEC_OK && io->avail_out == room) return CODEC_ERROR;
+    return ret;
+}
+
+static void zstd_free(void *ctx) {
+    zstd_ctx *z = ctx;
+
+    ZSTD_freeCCtx(z->cctx);
+    ZSTD_freeDCtx(z->dctx);
+    free(z);
+}
+
+// Rough: the window and match tables grow with the level, about 2 MB at
+// the fast levels up to 128 MB at 16 and above, per worker
+static size_t zstd_memusage(int level, int threads) {
+    int log = level <= 3 ? 21 : level <= 9 ? 24 : level <= 15 ? 26 : 27;
+
+    return ((size_t)1 << log) * (threads > 1 ? threads : 1) + CODEC_OUT;
+}
+#endif
+
+#ifdef HAVE_LZ4
+// ---- lz4 (frame format) ----
+
+#define LZ4_STEP 65536      // Input fed to one LZ4F_compressUpdate call
+
+typedef struct {
+    LZ4F_cctx *cctx;
+    LZ4F_dctx *dctx;
+    LZ4F_preferences_t prefs;
+    int started;
+    size_t last;            // Last decoder hint: 0 at the end of a frame
+} lz4_ctx;
+
+static void *lz4_init(int level, int threads, int decode) {
+    lz4_ctx *l = calloc(1, sizeof(*l));
+
+    (void)threads;
+    if (!l) return NULL;
+    if (decode ? LZ4F_isError(LZ4F_createDecompressionContext(&l->dctx, LZ4F_VERSION))
+               : LZ4F_isError(LZ4F_createCompressionContext(&l->cctx, LZ4F_VERSION))) {
+        free(l);
+        return NULL;
+    }
+    l->prefs.compressionLevel = level;
+    l->prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+    l->last = 1;
+    return l;
+}
+
+// The frame API wants room for a whole compressed step, so input is fed
+// only as far as the output buffer is sure to hold
+static int lz4_begin(lz4_ctx *l, codec_io *io) {
+    size_t n;
+
+    if (l->started) return CODEC_OK;
+    if (io->avail_out < LZ4F_HEADER_SIZE_MAX) return CODEC_OK;
+    n = LZ4F_compressBegin(l->cctx, io->next_out, io->avail_out, &l->prefs);
+    if (LZ4F_isError(n)) return CODEC_ERROR;
+    io->next_out += n;
+    io->avail_out -= n;
+    l->started = 1;
+    return CODEC_OK;
+}
+
+static int lz4_process(void *ctx, codec_io *io) {
+    lz4_ctx *l = ctx;
+    size_t n;
+
+    if (l->dctx) {
+        size_t in_len = io->avail_in, out_len = io->avail_out;
+        n = LZ4F_decompress(l->dctx, io->next_out, &out_len, io->next_in, &in_len, NULL);
+        if (LZ4F_isError(n)) return CODEC_ERROR;
+        l->last = n;
+        io->next_in += in_len;
+        io->avail_in -= in_len;
+        io->next_out += out_len;
+        io->avail_out -= out_len;
+        return n == 0 ? CODEC_END : CODEC_OK;
+    }
+
+    if (lz4_begin(l, io) != CODEC_OK) return CODEC_ERROR;
+    while (l->started && io->avail_in > 0) {
+        size_t step = io->avail_in < LZ4_STEP ? io->avail_in : LZ4_STEP;
+        if (LZ4F_compressBound(step, &l->prefs) > io->avail_out) break;
+        n = LZ4F_compressUpdate(l->cctx, io->next_out, io->avail_out, io->next_in, step, NULL);
+        if (LZ4F_isError(n)) return CODEC_ERROR;
+        io->next_in += step;
+        io->avail_in -= step;
+        io->next_out += n;
+        io->avail_out -= n;
+    }
+    return CODEC_OK;
+}
+
+static int lz4_finish(void *ctx, codec_io *io) {
+    lz4_ctx *l = ctx;
+    size_t n;
+
+    if (l->dctx) {
+        size_t room = io->avail_out;
+        int ret;
+        if (l->last == 0) return CODEC_END;
+        ret = lz4_process(l, io);
+        return ret == CODEC_OK && io->avail_out == room ? CODEC_ERROR : ret;
+    }
+    if (lz4_begin(l, io) != CODEC_OK) return CODEC_ERROR;
+    if (!l->started || LZ4F_compressBound(0, &l->prefs) > io->avail_out) return CODEC_OK;
+    n = LZ4F_compressEnd(l->cctx, io->next_out, io->avail_out, NULL);
+    if (LZ4F_isError(n)) return CODEC_ERROR;
+    io->next_out += n;
+    io->avail_out -= n;
+    return CODEC_END;
+}
+
+static void lz4_free(void *ctx) {
+    lz4_ctx *l = ctx;
+
+    if (l->cctx) LZ4F_freeCompressionContext(l->cctx);
+    if (l->dctx) LZ4F_freeDecompressionContext(l->dctx);
+    free(l);
+}
+
+// LZ4F state and a 64 KB block in and out; the HC levels add 256 KB
+static size_t lz4_memusage(int level, int threads) {
+    (void)threads;
+    return (level >= 3 ? 512 : 256) * 1024 + CODEC_OUT;
+}
+#endif
+
+// ---- Registry ----
+
+static const codec_t builtin_codecs[] = {
+    { "store", FC_STORE, 0, 0, 0, store_init, store_process, store_finish, free, store_memusage },
+    { "zlib", FC_ZLIB, 6, 9, 0, zlib_init, zlib_process, zlib_finish, zlib_free, zlib_memusage },
+    { "bz2", FC_BZ2, 9, 9, 0, bz2_init, bz2_process, bz2_finish, bz2_free, bz2_memusage },
+    { "lzma", FC_LZMA, 6, 9, 1, xz_init, xz_process, xz_finish, xz_free, xz_memusage },
+#ifdef HAVE_ZSTD
+    { "zstd", FC_ZSTD, 3, 19, 1, zstd_init, zstd_process, zstd_finish, zstd_free, zstd_memusage },
+#endif
+#ifdef HAVE_LZ4
+    { "lz4", FC_LZ4, 0, 12, 0, lz4_init, lz4_process, lz4_finish, lz4_free, lz4_memusage },
+#endif
+};
+
+#define BUILTIN_COUNT (int)(sizeof(builtin_codecs) / sizeof(builtin_codecs[0]))
+
+static const codec_t *registered[CODEC_MAX];
+static int registered_count;
+
+// Function to add a backend. Returns -1 if the table is full or the name
+// or header ID is already taken.
+int codec_register(const codec_t *codec) {
+    if (registered_count >= CODEC_MAX || codec_find(codec->name) || codec_by_id(codec->id))
+        return -1;
+    registered[registered_count++] = codec;
+    return 0;
+}
+
+// Function to list the codecs: index 0 up to the first NULL
+const codec_t *codec_at(int index) {
+    if (index < 0) return NULL;
+    if (index < BUILTIN_COUNT) return &builtin_codecs[index];
+    index -= BUILTIN_COUNT;
+    return index < registered_count ? registered[index] : NULL;
+}
+
+const codec_t *codec_find(const char *name) {
+    const codec_t *c;
+
+    for (int i = 0; (c = codec_at(i)) != NULL; i++)
+        if (strcmp(c->name, name) == 0) return c;
+    return NULL;
+}
+
+const codec_t *codec_by_id(int id) {
+    const codec_t *c;
+
+    for (int i = 0; (c = codec_at(i)) != NULL; i++)
+        if (c->id == id) return c;
+    return NULL;
+}
+
+// Function to estimate an encoder's memory in bytes; 0 if unknown
+size_t codec_memusage(int codec, int level, int threads) {
+    const codec_t *c = codec_by_id(codec);
+
+    if (!c || !c->memusage) return 0;
+    return c->memusage(level < 0 ? c->default_level : level, threads);
+}
+
+// ---- Drivers ----
+
+// Function to compress a stream with a backend; level -1 = its default.
+// Returns 0 on success.
+int codec_compress(const codec_t *codec, FILE *source, FILE *dest, int level, int threads) {
+    unsigned char *out = malloc(CODEC_OUT);
+    void *ctx = codec->init(level < 0 ? codec->default_level : level, threads, 0);
+    codec_io io;
+    input_t in;
+    int ret = CODEC_OK;
+
+    if (!out || !ctx) {
+        fprintf(stderr, "Error: Cannot start %s encoder\n", codec->name);
+        free(out);
+        if (ctx) codec->free(ctx);
+        return -1;
+    }
+
+    input_open(&in, source);
+    while (ret == CODEC_OK && (io.avail_in = input_next(&in, &io.next_in, INPUT_WINDOW)) > 0) {
+        while (ret == CODEC_OK && io.avail_in > 0) {
+            io.next_out = out;
+            io.avail_out = CODEC_OUT;
+            ret = codec->process(ctx, &io);
+            fwrite(out, 1, CODEC_OUT - io.avail_out, dest);
+        }
+    }
+    if (ferror(source)) ret = CODEC_ERROR;
+    while (ret == CODEC_OK) {
+        io.next_in = NULL;
+        io.avail_in = 0;
+        io.next_out = out;
+        io.avail_out = CODEC_OUT;
+        ret = codec->finish(ctx, &io);
+        fwrite(out, 1, CODEC_OUT - io.avail_out, dest);
+    }
+    input_close(&in, 0);
+
+    codec->free(ctx);
+    free(out);
+    if (ret != CODEC_END) {
+        fprintf(stderr, "Error: %s compression failed\n", codec->name);
+        stats_fail();
+    }
+    return ret == CODEC_END ? 0 : -1;
+}
+
+// Function to decompress one stream with a backend. Input after the end
+// of the stream is left unread. Returns 0 on success.
+int codec_decompress(const codec_t *codec, FILE *source, FILE *dest, int threads) {
+    unsigned char *out = malloc(CODEC_OUT);
+    void *ctx = codec->init(0, threads, 1);
+    codec_io io;
+    input_t in;
+    int ret = CODEC_OK;
+
+    if (!out || !ctx) {
+        fprintf(stderr, "Error: Cannot start %s decoder\n", codec->name);
+        free(out);
+        if (ctx) codec->free(ctx);
+        return -1;
+    }
+
+    io.avail_in = 0;
+    input_open(&in, source);
+    while (ret == CODEC_OK && (io.avail_in = input_next(&in, &io.next_in, INPUT_WINDOW)) > 0) {
+        while (ret == CODEC_OK && io.avail_in > 0) {
+            io.next_out = out;
+            io.avail_out = CODEC_OUT;
+            ret = codec->process(ctx, &io);
+            fwrite(out, 1, CODEC_OUT - io.avail_out, dest);
+        }
+    }
+    if (ferror(source)) ret = CODEC_ERROR;
+    while (ret == CODEC_OK) {
+        io.next_in = NULL;
+        io.avail_in = 0;
+        io.next_out = out;
+        io.avail_out = CODEC_OUT;
+        ret = codec->finish(ctx, &io);
+        fwrite(out, 1, CODEC_OUT - io.avail_out, dest);
+    }
+    input_close(&in, ret == CODEC_END ? io.avail_in : 0);
+
+    codec->free(ctx);
+    free(out);
+    if (ret != CODEC_END) {
+        fprintf(stderr, "Error: Corrupt or truncated %s stream\n", codec->name);
+        stats_fail();
+    }
+    return ret == CODEC_END ? 0 : -1;
+}
+
+// Function to compress a block in one call. Returns the compressed size,
+// or 0 if it does not fit in out_cap.
+size_t codec_encode_buffer(const codec_t *codec, int level, const unsigned char *in, size_t in_len,
+                           unsigned char *out, size_t out_cap) {
+    void *ctx = codec->init(level < 0 ? codec->default_level : level, 1, 0);
+    codec_io io = { in, in_len, out, out_cap };
+    int ret = CODEC_OK;
+
+    if (!ctx) return 0;
+    while (ret == CODEC_OK && io.avail_in > 0 && io.avail_out > 0)
+        ret = codec->process(ctx, &io);
+    while (ret == CODEC_OK && io.avail_in == 0 && io.avail_out > 0)
+        ret = codec->finish(ctx, &io);
+    codec->free(ctx);
+    return ret == CODEC_END ? out_cap - io.avail_out : 0;
+}
+
+// Function to decompress a block whose uncompressed size is known.
+// Returns 0 on success, -1 on corrupt input or a size mismatch.
+int codec_decode_buffer(const codec_t *codec, const unsigned char *in, size_t in_len,
+                        unsigned char *out, size_t out_len) {
+    void *ctx = codec->init(0, 1, 1);
+    codec_io io = { in, in_len, out, out_len };
+    int ret = CODEC_OK;
+
+    if (!ctx) return -1;
+    while (ret == CODEC_OK && io.avail_in > 0) {
+        size_t before = io.avail_in + io.avail_out;
+        ret = codec->process(ctx, &io);
+        if (io.avail_in + io.avail_out == before) break;
+    }
+    if (ret == CODEC_OK) ret = codec->finish(ctx, &io);
+    codec->free(ctx);
+    return ret == CODEC_END && io.avail_out == 0 ? 0 : -1;
+}
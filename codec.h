@@ -0,0 +1,58 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Pluggable streaming codecs. A backend works like zlib's deflate():
+// process() consumes what it can of the input and fills what it can of
+// the output, and after the last input finish() is called until it
+// returns CODEC_END. Decoders return CODEC_END from either call once the
+// stream is complete; finish() fails on a truncated stream.
+// memusage() estimates what an encoder at level on threads workers
+// allocates; the memory budget (budget.h) schedules by it.
+//
+// zlib, bz2, LZMA and store are always registered; zstd and lz4 when
+// built with -DHAVE_ZSTD / -DHAVE_LZ4 (and -lzstd / -llz4).
+enum codec_status {
+    CODEC_ERROR = -1,
+    CODEC_OK = 0,
+    CODEC_END = 1
+};
+
+typedef struct {
+    const unsigned char *next_in;
+    size_t avail_in;
+    unsigned char *next_out;
+    size_t avail_out;
+} codec_io;
+
+typedef struct codec {
+    const char *name;
+    int id;                         // Codec byte in the FCMP header
+    int default_level, max_level;
+    int threaded;                   // Honours the threads option
+    void *(*init)(int level, int threads, int decode);
+    int (*process)(void *ctx, codec_io *io);
+    int (*finish)(void *ctx, codec_io *io);
+    void (*free)(void *ctx);
+    size_t (*memusage)(int level, int threads);    // Encoder bytes, or NULL if unknown
+} codec_t;
+
+#define CODEC_MAX 32
+
+// Registration is not locked; register backends before starting threads
+int codec_register(const codec_t *codec);
+const codec_t *codec_find(const char *name);
+const codec_t *codec_by_id(int id);
+const codec_t *codec_at(int index);
+size_t codec_memusage(int codec, int level, int threads);
+
+int codec_compress(const codec_t *codec, FILE *source, FILE *dest, int level, int threads);
+int codec_decompress(const codec_t *codec, FILE *source, FILE *dest, int threads);
+size_t codec_encode_buffer(const codec_t *codec, int level, const unsigned char *in, size_t in_len,
+                           unsigned char *out, size_t out_cap);
+int codec_decode_buffer(const codec_t *codec, const unsigned char *in, size_t in_len,
+                        unsigned char *out, size_t out_len);
+
+#endif // CODEC_H
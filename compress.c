@@ -4,112 +4,530 @@
 #include <zlib.h>
 #include <bzlib.h>
 #include <lzma.h>
+#include <pthread.h>
+#include <time.h>
 #include "compress.h"
+#include "pool.h"
+#include "pipeline.h"
+#include "archive.h"
+#include "arena.h"
+#include "budget.h"
+#include "entropy.h"
+#include "input.h"
+#include "dedup.h"
+#include "codec.h"
+#include "race.h"
 
 #define CHUNK 16384
+#define PAR_BLOCK (128 * 1024)   // Default input block for the parallel zlib engine
+#define PAR_DICT 32768           // Deflate window primed from the previous block
+#define PIPE_MEMORY (640 * 1024) // A stream pipe's queued buffers, for the memory budget
 
 // Function to compress using zlib
 void compress_zlib(FILE *source, FILE *dest) {
-    int ret;
-    z_stream strm;
-    unsigned char in[CHUNK];
-    unsigned char out[CHUNK];
+    compress_zlib_level(source, dest, Z_BEST_COMPRESSION);
+}
 
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    ret = deflateInit(&strm, Z_BEST_COMPRESSION);
-    if (ret != Z_OK) return;
+// Runs an initialized deflate stream over source to Z_FINISH
+static void deflate_stream(z_stream *strm, FILE *source, FILE *dest) {
+    int flush;
+    input_t in;
+    const unsigned char *data;
+    unsigned char out[CHUNK];
 
+    input_open(&in, source);
     do {
-        strm.avail_in = fread(in, 1, CHUNK, source);
-        if (ferror(source)) break;
-        strm.next_in = in;
+        strm->avail_in = input_next(&in, &data, INPUT_WINDOW);
+        if (input_error(&in)) {
+            fprintf(stderr, "Error: Cannot read zlib input\n");
+            stats_fail();
+            break;
+        }
+        flush = input_eof(&in) ? Z_FINISH : Z_NO_FLUSH;
+        strm->next_in = (Bytef *)data;
 
         do {
-            strm.avail_out = CHUNK;
-            strm.next_out = out;
-            ret = deflate(&strm, Z_FINISH);
-            fwrite(out, 1, CHUNK - strm.avail_out, dest);
-        } while (strm.avail_out == 0);
-    } while (ret != Z_STREAM_END);
+            strm->avail_out = CHUNK;
+            strm->next_out = out;
+            deflate(strm, flush);
+            fwrite(out, 1, CHUNK - strm->avail_out, dest);
+        } while (strm->avail_out == 0);
+    } while (flush != Z_FINISH);
+
+    input_close(&in, 0);
+}
+
+// Function to compress using zlib at the given level (0-9)
+void compress_zlib_level(FILE *source, FILE *dest, int level) {
+    z_stream strm;
 
+    arena_zstream(&strm);
+    if (deflateInit(&strm, level) != Z_OK) return;
+
+    deflate_stream(&strm, source, dest);
     deflateEnd(&strm);
 }
 
-// Function to decompress using zlib
-void decompress_zlib(FILE *source, FILE *dest) {
+// Inflates a zlib stream, supplying dict if the stream asks for one
+static void inflate_stream(FILE *source, FILE *dest, const unsigned char *dict, size_t dict_len) {
     int ret;
     z_stream strm;
-    unsigned char in[CHUNK];
+    input_t in;
+    const unsigned char *data;
     unsigned char out[CHUNK];
 
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
+    arena_zstream(&strm);
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
     ret = inflateInit(&strm);
     if (ret != Z_OK) return;
 
+    input_open(&in, source);
     do {
-        strm.avail_in = fread(in, 1, CHUNK, source);
-        if (ferror(source)) break;
-        strm.next_in = in;
+        strm.avail_in = input_next(&in, &data, INPUT_WINDOW);
+        if (ferror(source) || strm.avail_in == 0) break;
+        strm.next_in = (Bytef *)data;
 
         do {
             strm.avail_out = CHUNK;
             strm.next_out = out;
             ret = inflate(&strm, Z_NO_FLUSH);
+            if (ret == Z_NEED_DICT && dict && inflateSetDictionary(&strm, dict, dict_len) == Z_OK)
+                ret = inflate(&strm, Z_NO_FLUSH);
+            if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
+                fprintf(stderr, ret == Z_NEED_DICT ? "Error: zlib stream needs a dictionary\n"
+                                                   : "Error: Corrupt zlib stream\n");
+                stats_fail();
+                input_close(&in, 0);
+                inflateEnd(&strm);
+                return;
+            }
             fwrite(out, 1, CHUNK - strm.avail_out, dest);
         } while (strm.avail_out == 0);
     } while (ret != Z_STREAM_END);
 
+    if (ret != Z_STREAM_END) {
+        fprintf(stderr, "Error: Truncated zlib stream\n");
+        stats_fail();
+    }
+    input_close(&in, strm.avail_in);
     inflateEnd(&strm);
 }
 
+// Function to decompress using zlib
+void decompress_zlib(FILE *source, FILE *dest) {
+    inflate_stream(source, dest, NULL, 0);
+}
+
+// Monotonic clock in seconds, for throughput measurements
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// One input block of the parallel zlib engine and its deflated output
+typedef struct zblock {
+    unsigned char *in;           // Read buffer, unused when the input is mapped
+    const unsigned char *data;   // Block input: in, or a window of the mapping
+    size_t in_len;
+    const unsigned char *dict;   // Tail of the previous block's input
+    size_t dict_len;
+    unsigned char dict_buf[PAR_DICT];
+    unsigned char *out;
+    size_t out_len, out_cap;
+    uLong check;                 // adler32 of this block's input
+    double seconds;              // Time spent deflating this block
+    int level;
+    int last;
+    int done, failed;
+    pthread_mutex_t *lock;
+    pthread_cond_t *cond;
+} zblock;
+
+// Worker job: raw-deflate one block, primed with the tail of the previous one
+static void zblock_deflate(void *arg) {
+    zblock *blk = (zblock *)arg;
+    z_stream strm;
+    int flush = blk->last ? Z_FINISH : Z_SYNC_FLUSH;
+    int ret, failed = 0;
+
+    double start = now_seconds();
+
+    memset(&strm, 0, sizeof(strm));
+    arena_zstream(&strm);
+    blk->out_len = 0;
+    blk->check = adler32(adler32(0L, Z_NULL, 0), blk->data, blk->in_len);
+
+    ret = deflateInit2(&strm, blk->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        failed = 1;
+    } else {
+        if (blk->dict_len > 0)
+            deflateSetDictionary(&strm, blk->dict, blk->dict_len);
+
+        strm.next_in = (Bytef *)blk->data;
+        strm.avail_in = blk->in_len;
+        do {
+            if (blk->out_len == blk->out_cap) {
+                size_t cap = blk->out_cap ? blk->out_cap * 2 : deflateBound(&strm, blk->in_len) + 64;
+                unsigned char *out = realloc(blk->out, cap);
+                if (!out) {
+                    failed = 1;
+                    break;
+                }
+                blk->out = out;
+                blk->out_cap = cap;
+            }
+            strm.next_out = blk->out + blk->out_len;
+            strm.avail_out = blk->out_cap - blk->out_len;
+            ret = deflate(&strm, flush);
+            blk->out_len = blk->out_cap - strm.avail_out;
+        } while (strm.avail_out == 0 || (flush == Z_FINISH && ret == Z_OK));
+        if (ret == Z_STREAM_ERROR) failed = 1;
+        deflateEnd(&strm);
+    }
+
+    blk->seconds = now_seconds() - start;
+
+    pthread_mutex_lock(blk->lock);
+    blk->failed = failed;
+    blk->done = 1;
+    pthread_cond_broadcast(blk->cond);
+    pthread_mutex_unlock(blk->lock);
+}
+
+// Reads up to len bytes, looping over short reads from pipes
+static size_t read_full(FILE *source, unsigned char *buf, size_t len) {
+    size_t got = 0, n;
+    while (got < len && (n = fread(buf + got, 1, len - got, source)) > 0)
+        got += n;
+    return got;
+}
+
+// Returns 1 when the next read from source would hit end of file
+static int at_eof(FILE *source) {
+    int c = getc(source);
+    if (c == EOF) return 1;
+    ungetc(c, source);
+    return 0;
+}
+
+// Copies source to dest unchanged (the "store" codec)
+static void copy_stream(FILE *source, FILE *dest) {
+    input_t in;
+    const unsigned char *data;
+    size_t n;
+
+    input_open(&in, source);
+    while ((n = input_next(&in, &data, INPUT_WINDOW)) > 0)
+        fwrite(data, 1, n, dest);
+    if (input_error(&in)) {
+        fprintf(stderr, "Error: Cannot read input\n");
+        stats_fail();
+    }
+    input_close(&in, 0);
+}
+
+// Throughput controller for the adaptive mode. Keeps a smoothed per-worker
+// MB/s for every level it has seen and, once per round of blocks, moves
+// one level down when the pool cannot keep up with the target, or one
+// level up when the next level is known (or, untried, likely) to keep up.
+typedef struct level_ctl {
+    double target_mbps;
+    int level, min_level, max_level;
+    int workers;
+    int since_change;
+    double speed[10];            // Smoothed single-worker MB/s per level
+} level_ctl;
+
+static void level_ctl_update(level_ctl *ctl, const zblock *blk) {
+    if (blk->seconds <= 0 || blk->in_len == 0) return;
+
+    double mbps = blk->in_len / 1e6 / blk->seconds;
+    double *speed = &ctl->speed[blk->level];
+    *speed = *speed > 0 ? 0.7 * *speed + 0.3 * mbps : mbps;
+
+    if (++ctl->since_change < ctl->workers) return;
+
+    double capacity = ctl->speed[ctl->level] * ctl->workers;
+    if (capacity < ctl->target_mbps && ctl->level > ctl->min_level) {
+        ctl->level--;
+        ctl->since_change = 0;
+    } else if (ctl->level < ctl->max_level) {
+        double next = ctl->speed[ctl->level + 1] * ctl->workers;
+        if ((next == 0 && capacity > ctl->target_mbps * 1.5) || next > ctl->target_mbps * 1.1) {
+            ctl->level++;
+            ctl->since_change = 0;
+        }
+    }
+}
+
+// Block-parallel deflate engine (pigz-style). Blocks are compressed
+// independently on a worker pool and written in order as a single zlib
+// stream: a zlib header, one raw deflate segment per block ending on a
+// byte-aligned sync flush, and the adler32 of the whole input combined
+// from the per-block checksums. Any inflate() can decode the result.
+// With a level controller each block may use a different level; the
+// blocks are independent deflate segments, so the stream stays valid.
+static void zlib_parallel(FILE *source, FILE *dest, int threads, size_t block_size, int level,
+                          level_ctl *ctl, zlib_adaptive_stats *stats) {
+    double start = now_seconds();
+    unsigned long long bytes_in = 0, bytes_out = 2;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    unsigned long long seq_read = 0, seq_written = 0;
+    unsigned char prev_tail[PAR_DICT];
+    size_t prev_tail_len = 0;
+    uLong check = adler32(0L, Z_NULL, 0);
+    int last_read = 0, failed = 0;
+    unsigned char header[2], trailer[4];
+    input_t in;
+
+    pool_t *pool = pool_create(threads);
+    if (!pool) {
+        compress_zlib_level(source, dest, level);
+        return;
+    }
+
+    int nslots = pool_threads(pool) * 2;
+    if (ctl) {
+        ctl->workers = pool_threads(pool);
+        level = ctl->level;
+    }
+    zblock *slots = calloc(nslots, sizeof(zblock));
+    if (!slots) {
+        pool_destroy(pool);
+        compress_zlib_level(source, dest, level);
+        return;
+    }
+    // A mapped input is handed to the workers in place; otherwise each
+    // slot needs its own read buffer
+    input_open(&in, source);
+    for (int i = 0; i < nslots; i++) {
+        slots[i].lock = &lock;
+        slots[i].cond = &cond;
+        if (input_mapped(&in)) continue;
+        slots[i].in = malloc(block_size);
+        if (!slots[i].in) failed = 1;
+    }
+
+    // zlib header: deflate with a 32K window, FLEVEL derived from the level
+    int flevel = level == Z_DEFAULT_COMPRESSION ? 2 : level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    header[0] = 0x78;
+    header[1] = flevel << 6;
+    header[1] += 31 - ((header[0] << 8) + header[1]) % 31;
+    if (!failed) fwrite(header, 1, 2, dest);
+
+    while (!failed && !(last_read && seq_written == seq_read)) {
+        // Keep every slot busy while input remains
+        while (!last_read && seq_read - seq_written < (unsigned long long)nslots) {
+            zblock *blk = &slots[seq_read % nslots];
+
+            if (input_mapped(&in)) {
+                blk->in_len = input_next(&in, &blk->data, block_size);
+                blk->last = last_read = input_eof(&in);
+                blk->dict = blk->data - prev_tail_len;
+            } else {
+                blk->in_len = read_full(source, blk->in, block_size);
+                if (ferror(source)) {
+                    failed = 1;
+                    break;
+                }
+                blk->last = last_read = blk->in_len < block_size || at_eof(source);
+                blk->data = blk->in;
+                memcpy(blk->dict_buf, prev_tail, prev_tail_len);
+                blk->dict = blk->dict_buf;
+            }
+            blk->dict_len = prev_tail_len;
+            prev_tail_len = blk->in_len < PAR_DICT ? blk->in_len : PAR_DICT;
+            if (!input_mapped(&in))
+                memcpy(prev_tail, blk->data + blk->in_len - prev_tail_len, prev_tail_len);
+
+            blk->level = ctl ? ctl->level : level;
+            blk->done = blk->failed = 0;
+            pool_submit(pool, zblock_deflate, blk);
+            seq_read++;
+        }
+        if (failed || seq_written == seq_read) break;
+
+        // Write the oldest block as soon as it is ready
+        zblock *blk = &slots[seq_written % nslots];
+        pthread_mutex_lock(&lock);
+        while (!blk->done)
+            pthread_cond_wait(&cond, &lock);
+        pthread_mutex_unlock(&lock);
+
+        if (blk->failed) {
+            failed = 1;
+            break;
+        }
+        fwrite(blk->out, 1, blk->out_len, dest);
+        check = adler32_combine(check, blk->check, blk->in_len);
+        bytes_in += blk->in_len;
+        bytes_out += blk->out_len;
+        if (stats) stats->level_blocks[blk->level]++;
+        if (ctl) level_ctl_update(ctl, blk);
+        seq_written++;
+    }
+
+    pool_wait(pool);
+    pool_destroy(pool);
+    input_close(&in, 0);
+
+    if (failed) {
+        fprintf(stderr, "Error: parallel zlib compression failed\n");
+        stats_fail();
+    } else {
+        trailer[0] = check >> 24;
+        trailer[1] = check >> 16;
+        trailer[2] = check >> 8;
+        trailer[3] = check;
+        fwrite(trailer, 1, 4, dest);
+        bytes_out += 4;
+    }
+
+    if (stats) {
+        stats->bytes_in = bytes_in;
+        stats->bytes_out = bytes_out;
+        stats->seconds = now_seconds() - start;
+        stats->mbps = stats->seconds > 0 ? bytes_in / 1e6 / stats->seconds : 0;
+        stats->final_level = ctl ? ctl->level : level;
+    }
+
+    for (int i = 0; i < nslots; i++) {
+        free(slots[i].in);
+        free(slots[i].out);
+    }
+    free(slots);
+}
+
+// Function to compress using zlib on all cores; threads 0 = one per CPU,
+// block_size 0 = 128 KB blocks. Output is a standard zlib stream.
+void compress_zlib_parallel(FILE *source, FILE *dest, int threads, size_t block_size) {
+    zlib_parallel(source, dest, threads, block_size ? block_size : PAR_BLOCK, Z_BEST_COMPRESSION, NULL, NULL);
+}
+
+// Function to compress using zlib while steering the level (1-9) to keep
+// up with target_mbps of input. The levels used and the measured MB/s are
+// reported in stats, which may be NULL.
+void compress_zlib_adaptive(FILE *source, FILE *dest, int threads, double target_mbps,
+                            zlib_adaptive_stats *stats) {
+    level_ctl ctl;
+
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.target_mbps = target_mbps;
+    ctl.min_level = 1;
+    ctl.max_level = Z_BEST_COMPRESSION;
+    ctl.level = ADAPTIVE_START_LEVEL;
+    if (stats) memset(stats, 0, sizeof(*stats));
+    zlib_parallel(source, dest, threads, PAR_BLOCK, ctl.level, &ctl, stats);
+}
+
 // Function to compress using BZ2
 void compress_bz2(FILE *source, FILE *dest) {
-    int bzerror;
-    BZFILE *bzfile;
-    char buffer[CHUNK];
-    int n;
+    compress_bz2_level(source, dest, 9);
+}
+
+// Function to compress using BZ2 with the given block size (1-9, x100k)
+void compress_bz2_level(FILE *source, FILE *dest, int level) {
+    bz_stream strm;
+    input_t in;
+    const unsigned char *data;
+    char out[CHUNK];
+    size_t n;
+    int ret = BZ_RUN_OK;
 
-    bzfile = BZ2_bzWriteOpen(&bzerror, dest, 9, 0, 0);
-    if (bzerror != BZ_OK) return;
+    memset(&strm, 0, sizeof(strm));
+    arena_bzstream(&strm);
+    if (BZ2_bzCompressInit(&strm, level, 0, 0) != BZ_OK) return;
 
-    while ((n = fread(buffer, 1, CHUNK, source)) > 0) {
-        BZ2_bzWrite(&bzerror, bzfile, buffer, n);
+    input_open(&in, source);
+    while (ret == BZ_RUN_OK && (n = input_next(&in, &data, INPUT_WINDOW)) > 0) {
+        strm.next_in = (char *)data;
+        strm.avail_in = n;
+        while (ret == BZ_RUN_OK && strm.avail_in > 0) {
+            strm.next_out = out;
+            strm.avail_out = CHUNK;
+            ret = BZ2_bzCompress(&strm, BZ_RUN);
+            fwrite(out, 1, CHUNK - strm.avail_out, dest);
+        }
+    }
+    if (input_error(&in)) {
+        fprintf(stderr, "Error: Cannot read bz2 input\n");
+        ret = BZ_IO_ERROR;
+    }
+    input_close(&in, 0);
+
+    if (ret == BZ_RUN_OK) {
+        do {
+            strm.next_out = out;
+            strm.avail_out = CHUNK;
+            ret = BZ2_bzCompress(&strm, BZ_FINISH);
+            fwrite(out, 1, CHUNK - strm.avail_out, dest);
+        } while (ret == BZ_FINISH_OK);
+    }
+    if (ret != BZ_STREAM_END) {
+        fprintf(stderr, "Error: bz2 compression failed\n");
+        stats_fail();
     }
 
-    BZ2_bzWriteClose(&bzerror, bzfile, 0, NULL, NULL);
+    BZ2_bzCompressEnd(&strm);
 }
 
 // Function to decompress using BZ2
 void decompress_bz2(FILE *source, FILE *dest) {
-    int bzerror;
-    BZFILE *bzfile;
-    char buffer[CHUNK];
-    int n;
+    bz_stream strm;
+    input_t in;
+    const unsigned char *data;
+    char out[CHUNK];
+    int ret = BZ_OK;
+
+    memset(&strm, 0, sizeof(strm));
+    arena_bzstream(&strm);
+    if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) return;
 
-    bzfile = BZ2_bzReadOpen(&bzerror, source, 0, 0, NULL, 0);
-    while (bzerror == BZ_OK) {
-        n = BZ2_bzRead(&bzerror, bzfile, buffer, CHUNK);
-        fwrite(buffer, 1, n, dest);
+    input_open(&in, source);
+    do {
+        if (strm.avail_in == 0) {
+            strm.avail_in = input_next(&in, &data, INPUT_WINDOW);
+            if (strm.avail_in == 0) break;
+            strm.next_in = (char *)data;
+        }
+        strm.next_out = out;
+        strm.avail_out = CHUNK;
+        ret = BZ2_bzDecompress(&strm);
+        fwrite(out, 1, CHUNK - strm.avail_out, dest);
+    } while (ret == BZ_OK);
+    if (ret != BZ_STREAM_END) {
+        fprintf(stderr, "Error: Corrupt or truncated bz2 stream\n");
+        stats_fail();
     }
-    BZ2_bzReadClose(&bzerror, bzfile);
+    input_close(&in, strm.avail_in);
+
+    BZ2_bzDecompressEnd(&strm);
 }
 
 // Function to compress using LZMA
 void compress_lzma(FILE *source, FILE *dest) {
-    unsigned char inbuf[CHUNK];
+    compress_lzma_level(source, dest, 9);
+}
+
+// Function to compress using LZMA at the given preset (0-9)
+void compress_lzma_level(FILE *source, FILE *dest, int preset) {
+    input_t in;
+    const unsigned char *inbuf;
     unsigned char outbuf[CHUNK];
     size_t in_len, out_len;
     lzma_stream strm = LZMA_STREAM_INIT;
     lzma_ret ret;
+    strm.allocator = &arena_lzma;
 
-    ret = lzma_easy_encoder(&strm, 9, LZMA_CHECK_CRC64);
+    ret = lzma_easy_encoder(&strm, preset, LZMA_CHECK_CRC64);
     if (ret != LZMA_OK) return;
 
-    while ((in_len = fread(inbuf, 1, CHUNK, source)) > 0) {
+    input_open(&in, source);
+    while ((in_len = input_next(&in, &inbuf, INPUT_WINDOW)) > 0) {
         strm.next_in = inbuf;
         strm.avail_in = in_len;
 
@@ -121,6 +539,13 @@ void compress_lzma(FILE *source, FILE *dest) {
             fwrite(outbuf, 1, out_len, dest);
         } while (strm.avail_out == 0);
     }
+    if (input_error(&in)) {
+        fprintf(stderr, "Error: Cannot read LZMA input\n");
+        stats_fail();
+        input_close(&in, 0);
+        lzma_end(&strm);
+        return;
+    }
 
     do {
         strm.next_out = outbuf;
@@ -130,21 +555,25 @@ void compress_lzma(FILE *source, FILE *dest) {
         fwrite(outbuf, 1, out_len, dest);
     } while (ret == LZMA_OK);
 
+    input_close(&in, 0);
     lzma_end(&strm);
 }
 
 // Function to decompress using LZMA
 void decompress_lzma(FILE *source, FILE *dest) {
-    unsigned char inbuf[CHUNK];
+    input_t in;
+    const unsigned char *inbuf;
     unsigned char outbuf[CHUNK];
     size_t in_len, out_len;
     lzma_stream strm = LZMA_STREAM_INIT;
     lzma_ret ret;
+    strm.allocator = &arena_lzma;
 
     ret = lzma_stream_decoder(&strm, UINT64_MAX, 0);
     if (ret != LZMA_OK) return;
 
-    while ((in_len = fread(inbuf, 1, CHUNK, source)) > 0) {
+    input_open(&in, source);
+    while ((in_len = input_next(&in, &inbuf, INPUT_WINDOW)) > 0) {
         strm.next_in = inbuf;
         strm.avail_in = in_len;
 
@@ -156,80 +585,856 @@ void decompress_lzma(FILE *source, FILE *dest) {
             fwrite(outbuf, 1, out_len, dest);
         } while (strm.avail_out == 0);
     }
+    if (input_error(&in)) {
+        fprintf(stderr, "Error: Cannot read LZMA input\n");
+        stats_fail();
+    }
+    input_close(&in, 0);
 
     lzma_end(&strm);
 }
 
-// New function to compress files
-void compress_file(const char *operation, const char *filename) {
-    FILE *source = fopen(filename, "rb");
-    if (!source) {
-        printf("Error: Cannot open file %s\n", filename);
+// Feeds source through an initialised lzma_stream into dest, finishing
+// the stream at end of input. Used by the multithreaded coders, which
+// only flush their last blocks on LZMA_FINISH.
+static void lzma_pump(lzma_stream *strm, FILE *source, FILE *dest) {
+    input_t in;
+    unsigned char outbuf[CHUNK];
+    lzma_action action = LZMA_RUN;
+    lzma_ret ret;
+
+    input_open(&in, source);
+    strm->next_in = NULL;
+    strm->avail_in = 0;
+    strm->next_out = outbuf;
+    strm->avail_out = CHUNK;
+
+    for (;;) {
+        if (strm->avail_in == 0 && action == LZMA_RUN) {
+            strm->avail_in = input_next(&in, &strm->next_in, INPUT_WINDOW);
+            if (input_error(&in)) {
+                fprintf(stderr, "Error: Cannot read LZMA input\n");
+                stats_fail();
+                input_close(&in, 0);
+                return;
+            }
+            if (input_eof(&in)) action = LZMA_FINISH;
+        }
+
+        ret = lzma_code(strm, action);
+
+        if (strm->avail_out == 0 || ret == LZMA_STREAM_END) {
+            fwrite(outbuf, 1, CHUNK - strm->avail_out, dest);
+            strm->next_out = outbuf;
+            strm->avail_out = CHUNK;
+        }
+        if (ret != LZMA_OK) break;
+    }
+    if (ret != LZMA_STREAM_END) {
+        fprintf(stderr, "Error: %s\n", ret == LZMA_DATA_ERROR || ret == LZMA_BUF_ERROR
+                                            ? "Corrupt or truncated LZMA stream" : "LZMA coding failed");
+        stats_fail();
+    }
+    input_close(&in, strm->avail_in);
+}
+
+// Multithreaded .xz encoder at the given preset, or with the given filter
+// chain if not NULL. threads 0 = one per CPU, capped so the encoders fit
+// in a quarter of RAM; block_size 0 = liblzma's default of three
+// dictionary sizes.
+static void lzma_mt_encode(FILE *source, FILE *dest, int threads, size_t block_size, int preset,
+                           const lzma_filter *filters) {
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_mt mt;
+    strm.allocator = &arena_lzma;
+
+    memset(&mt, 0, sizeof(mt));
+    mt.block_size = block_size;
+    mt.preset = preset;
+    mt.filters = filters;
+    mt.check = LZMA_CHECK_CRC64;
+    if (threads > 0) {
+        mt.threads = threads;
+    } else {
+        uint64_t budget = lzma_physmem() / 4;
+        mt.threads = lzma_cputhreads();
+        if (mt.threads == 0) mt.threads = 1;
+        while (mt.threads > 1 && lzma_stream_encoder_mt_memusage(&mt) > budget)
+            mt.threads--;
+    }
+
+    if (lzma_stream_encoder_mt(&strm, &mt) != LZMA_OK) {
+        compress_lzma_level(source, dest, preset);
         return;
     }
+    lzma_pump(&strm, source, dest);
+    lzma_end(&strm);
+}
 
-    char temp_filename[] = "temp_XXXXXX";
-    char final_filename[256];
-    FILE *temp1, *temp2, *dest;
+// Function to compress using liblzma's multithreaded block encoder at
+// preset 9. The output is a standard multi-block .xz stream.
+void compress_lzma_mt(FILE *source, FILE *dest, int threads, size_t block_size) {
+    lzma_mt_encode(source, dest, threads, block_size, 9, NULL);
+}
 
-    // Compressed file after zlib
-    mkstemp(temp_filename);
-    temp1 = fopen(temp_filename, "wb");
+// Filter chain of a pre-filter (entropy.h) and LZMA2 at preset. Returns
+// -1 for an unknown preset; a filter this liblzma lacks is left out.
+static int lzma_filter_chain(lzma_filter *filters, lzma_options_lzma *opt, lzma_options_delta *delta,
+                             int preset, int filter, int dist) {
+    int n = 0;
 
-    // Combine compressing with zlib, bzip2, and LZMA
-    if (strcmp(operation, "compress") == 0) {
-        // Step 1: Compress with zlib
-        compress_zlib(source, temp1);
-        fclose(temp1);
-
-        // Step 2: Compress with BZ2
-        sprintf(final_filename, "%s.bz2", filename);
-        temp1 = fopen(temp_filename, "rb");
-        dest = fopen(final_filename, "wb");
-        compress_bz2(temp1, dest);
-        fclose(temp1);
-        fclose(dest);
+    if (lzma_lzma_preset(opt, preset)) return -1;
+    filters[0].options = NULL;          // The BCJ filters take none
+    switch (filter) {
+    case FC_FILTER_X86:
+        filters[n++].id = LZMA_FILTER_X86;
+        break;
+    case FC_FILTER_ARM:
+        filters[n++].id = LZMA_FILTER_ARM;
+        break;
+#ifdef LZMA_FILTER_ARM64
+    case FC_FILTER_ARM64:
+        filters[n++].id = LZMA_FILTER_ARM64;
+        break;
+#endif
+    case FC_FILTER_DELTA:
+        memset(delta, 0, sizeof(*delta));
+        delta->type = LZMA_DELTA_TYPE_BYTE;
+        delta->dist = dist;
+        filters[n].id = LZMA_FILTER_DELTA;
+        filters[n++].options = delta;
+        break;
+    }
+    filters[n].id = LZMA_FILTER_LZMA2;
+    filters[n++].options = opt;
+    filters[n].id = LZMA_VLI_UNKNOWN;
+    return 0;
+}
 
-        // Step 3: Compress with LZMA
-        sprintf(final_filename, "%s.lzma", filename);
-        temp1 = fopen(temp_filename, "rb");
-        dest = fopen(final_filename, "wb");
-        compress_lzma(temp1, dest);
-        fclose(temp1);
-        fclose(dest);
+// .xz encoder at preset behind a pre-filter. The filters are recorded in
+// the block headers, so the plain .xz decoder undoes them.
+static void lzma_filtered_encode(FILE *source, FILE *dest, int preset, int threads, int filter, int dist) {
+    lzma_filter filters[3];
+    lzma_options_lzma opt;
+    lzma_options_delta delta;
+    lzma_stream strm = LZMA_STREAM_INIT;
+    strm.allocator = &arena_lzma;
+
+    if (lzma_filter_chain(filters, &opt, &delta, preset, filter, dist) != 0) {
+        compress_lzma_level(source, dest, preset);
+        return;
+    }
+    if (threads != 1) {
+        lzma_mt_encode(source, dest, threads, 0, preset, filters);
+        return;
+    }
+    if (lzma_stream_encoder(&strm, filters, LZMA_CHECK_CRC64) != LZMA_OK) {
+        compress_lzma_level(source, dest, preset);
+        return;
+    }
+    lzma_pump(&strm, source, dest);
+    lzma_end(&strm);
+}
+
+// Function to decompress .xz/.lzma streams on several threads. Blocks
+// written by compress_lzma_mt decode in parallel; single-block streams
+// decode on one thread as before. threads 0 = one per CPU.
+void decompress_lzma_mt(FILE *source, FILE *dest, int threads) {
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_mt mt;
+    strm.allocator = &arena_lzma;
+
+    memset(&mt, 0, sizeof(mt));
+    mt.threads = threads > 0 ? (uint32_t)threads : lzma_cputhreads();
+    if (mt.threads == 0) mt.threads = 1;
+    mt.memlimit_threading = lzma_physmem() / 4;
+    mt.memlimit_stop = UINT64_MAX;
+
+    if (lzma_stream_decoder_mt(&strm, &mt) != LZMA_OK) {
+        decompress_lzma(source, dest);
+        return;
+    }
+    lzma_pump(&strm, source, dest);
+    lzma_end(&strm);
+}
 
+// LZMA stages of the cascades, spread across all cores
+static void lzma_stage(FILE *source, FILE *dest) {
+    compress_lzma_mt(source, dest, 0, 0);
+}
+
+static void unlzma_stage(FILE *source, FILE *dest) {
+    decompress_lzma_mt(source, dest, 0);
+}
+
+// Worst-case size of len bytes compressed as one block with codec
+size_t compress_bound(int codec, size_t len) {
+    switch (codec) {
+    case FC_ZLIB:
+        return compressBound(len);
+    case FC_BZ2:
+        return len + len / 100 + 600;
+    case FC_LZMA:
+        return lzma_stream_buffer_bound(len);
+    case FC_STORE:
+        return len;
+    default:
+        return len + len / 8 + 4096;
+    }
+}
+
+// Function to compress a block held in memory. Returns the compressed
+// size, or 0 when the codec fails or the output does not fit in out_cap.
+size_t compress_buffer(int codec, int level, const unsigned char *in, size_t in_len,
+                       unsigned char *out, size_t out_cap) {
+    switch (codec) {
+    case FC_ZLIB: {
+        uLongf out_len = out_cap;
+        if (compress2(out, &out_len, in, in_len, level) != Z_OK) return 0;
+        return out_len;
+    }
+    case FC_BZ2: {
+        unsigned int out_len = out_cap;
+        if (BZ2_bzBuffToBuffCompress((char *)out, &out_len, (char *)in, in_len, level, 0, 0) != BZ_OK)
+            return 0;
+        return out_len;
+    }
+    case FC_LZMA: {
+        size_t out_pos = 0;
+        if (lzma_easy_buffer_encode(level, LZMA_CHECK_NONE, NULL, in, in_len, out, &out_pos, out_cap) != LZMA_OK)
+            return 0;
+        return out_pos;
+    }
+    case FC_STORE:
+        if (in_len > out_cap) return 0;
+        memcpy(out, in, in_len);
+        return in_len;
+    default: {
+        const codec_t *c = codec_by_id(codec);
+        return c ? codec_encode_buffer(c, level, in, in_len, out, out_cap) : 0;
+    }
+    }
+}
+
+// Function to decompress a block whose uncompressed size is known.
+// Returns 0 on success, -1 on corrupt input or a size mismatch.
+int decompress_buffer(int codec, const unsigned char *in, size_t in_len,
+                      unsigned char *out, size_t out_len) {
+    switch (codec) {
+    case FC_ZLIB: {
+        uLongf got = out_len;
+        if (uncompress(out, &got, in, in_len) != Z_OK || got != out_len) return -1;
+        return 0;
+    }
+    case FC_BZ2: {
+        unsigned int got = out_len;
+        if (BZ2_bzBuffToBuffDecompress((char *)out, &got, (char *)in, in_len, 0, 0) != BZ_OK ||
+            got != out_len)
+            return -1;
+        return 0;
+    }
+    case FC_LZMA: {
+        uint64_t memlimit = UINT64_MAX;
+        size_t in_pos = 0, out_pos = 0;
+        if (lzma_stream_buffer_decode(&memlimit, 0, NULL, in, &in_pos, in_len, out, &out_pos, out_len) != LZMA_OK ||
+            out_pos != out_len)
+            return -1;
+        return 0;
+    }
+    case FC_STORE:
+        if (in_len != out_len) return -1;
+        memcpy(out, in, in_len);
+        return 0;
+    default: {
+        const codec_t *c = codec_by_id(codec);
+        return c ? codec_decode_buffer(c, in, in_len, out, out_len) : -1;
+    }
+    }
+}
+
+static void write_header(FILE *dest, int codec, int level, int flags) {
+    unsigned char header[FC_HEADER_SIZE];
+
+    memcpy(header, FC_MAGIC, 4);
+    header[4] = FC_VERSION;
+    header[5] = codec;
+    header[6] = level;
+    header[7] = flags;
+    fwrite(header, 1, FC_HEADER_SIZE, dest);
+}
+
+// Compressed body of an FCMP stream. filter and dist: the LZMA pre-filter.
+static void encode_body(FILE *source, FILE *dest, int codec, int level, int threads,
+                        int filter, int dist) {
+    switch (codec) {
+    case FC_ZLIB:
+        if (threads == 1)
+            compress_zlib_level(source, dest, level);
+        else
+            zlib_parallel(source, dest, threads, PAR_BLOCK, level, NULL, NULL);
+        break;
+    case FC_BZ2:
+        compress_bz2_level(source, dest, level);
+        break;
+    case FC_LZMA:
+        if (filter != FC_FILTER_NONE)
+            lzma_filtered_encode(source, dest, level, threads, filter, dist);
+        else if (threads == 1)
+            compress_lzma_level(source, dest, level);
+        else
+            lzma_mt_encode(source, dest, threads, 0, level, NULL);
+        break;
+    case FC_STORE:
+        copy_stream(source, dest);
+        break;
+    default: {
+        // Registered backends (codec.h)
+        const codec_t *c = codec_by_id(codec);
+        if (c) codec_compress(c, source, dest, level, threads);
+        else fprintf(stderr, "Error: Unknown codec %d\n", codec);
+        break;
+    }
+    }
+}
+
+// Function to compress with exactly the codec, level and threads given,
+// behind an FCMP header, reserving no memory: for callers that reserved
+// it for a group of runs at once (race.h). filter and dist: the LZMA
+// pre-filter (entropy.h), or FC_FILTER_NONE.
+void compress_codec_reserved(FILE *source, FILE *dest, int codec, int level, int threads,
+                             int filter, int dist) {
+    const codec_t *c = codec_by_id(codec);
+
+    if (level < 0) level = c ? c->default_level : 0;
+    write_header(dest, codec, level, 0);
+    encode_body(source, dest, codec, level, threads, filter, dist);
+}
+
+// compress_codec with the LZMA pre-filter already chosen
+static void codec_filtered(FILE *source, FILE *dest, int codec, int level, int threads,
+                           int filter, int dist) {
+    budget_grant grant;
+
+    budget_acquire(&grant, codec, level, threads, 0);
+    compress_codec_reserved(source, dest, codec, grant.level, grant.threads, filter, dist);
+    budget_release(&grant);
+}
+
+// Function to compress with a given codec behind an FCMP header recording
+// the codec and level. level -1 = the codec's default; threads 0 = one
+// per CPU for the codecs that can use them, 1 = stay on the calling thread.
+// Under a memory budget (budget.h) the level and threads may be lowered;
+// the header records the level used. LZMA gets the pre-filter sampling
+// finds for a seekable source (entropy.h).
+void compress_codec(FILE *source, FILE *dest, int codec, int level, int threads) {
+    int filter = FC_FILTER_NONE, dist = 0;
+
+    if (codec == FC_LZMA) filter = sample_filter(source, &dist);
+    codec_filtered(source, dest, codec, level, threads, filter, dist);
+}
+
+// Function to compress with zlib behind an FCMP header, steering the
+// level to keep up with target_mbps of input (compress_zlib_adaptive).
+// The header records the level it starts at. stats may be NULL.
+void compress_codec_adaptive(FILE *source, FILE *dest, int threads, double target_mbps,
+                             zlib_adaptive_stats *stats) {
+    budget_grant grant;
+
+    budget_acquire(&grant, FC_ZLIB, Z_BEST_COMPRESSION, threads, 0);
+    write_header(dest, FC_ZLIB, ADAPTIVE_START_LEVEL, 0);
+    compress_zlib_adaptive(source, dest, grant.threads, target_mbps, stats);
+    budget_release(&grant);
+}
+
+static void unlzma_body(FILE *source, FILE *dest) {
+    decompress_lzma_mt(source, dest, 0);
+}
+
+// Decoder for the body of an FCMP stream with a built-in codec, or NULL
+static stage_fn body_decoder(int codec) {
+    switch (codec) {
+    case FC_STORE: return copy_stream;
+    case FC_ZLIB: return decompress_zlib;
+    case FC_BZ2: return decompress_bz2;
+    case FC_LZMA: return unlzma_body;
+    default: return NULL;
+    }
+}
+
+static void dedup_stage(FILE *source, FILE *dest) {
+    dedup_encode(source, dest, NULL);
+}
+
+// Function to compress with deduplication: repeated chunks are replaced by
+// references before the codec runs, so only unique data is compressed.
+// The dedup pass and the codec run concurrently over a stream pipe.
+void compress_dedup(FILE *source, FILE *dest, int codec, int level, int threads) {
+    FILE *pipe_in, *pipe_out;
+    stage_t *st;
+    budget_grant grant;
+
+    // The decoder runs the codec as a pipeline stage, which only the
+    // built-in codecs have
+    if (!body_decoder(codec)) {
+        fprintf(stderr, "Error: Deduplication needs zlib, bz2, LZMA or store\n");
+        return;
+    }
+    budget_acquire(&grant, codec, level, threads, PIPE_MEMORY);
+    if (stream_pipe(&pipe_in, &pipe_out) != 0 ||
+        !(st = stage_start_borrowed(dedup_stage, source, pipe_out))) {
+        fprintf(stderr, "Error: Cannot start deduplication stage\n");
+        budget_release(&grant);
+        return;
+    }
+    write_header(dest, codec, grant.level, FC_FLAG_DEDUP);
+    encode_body(pipe_in, dest, codec, grant.level, grant.threads, FC_FILTER_NONE, 0);
+    fclose(pipe_in);
+    stage_join(st);
+    budget_release(&grant);
+}
+
+// LZMA2 with a preset dictionary. The .xz container cannot carry one, so
+// this is a raw LZMA2 stream; the preset comes from the FCMP header.
+static int lzma_dict_filters(lzma_filter *filters, lzma_options_lzma *opt, int preset, const fc_dict *dict) {
+    if (lzma_lzma_preset(opt, preset)) return -1;
+    opt->preset_dict = dict->data;
+    opt->preset_dict_size = dict->len;
+    filters[0].id = LZMA_FILTER_LZMA2;
+    filters[0].options = opt;
+    filters[1].id = LZMA_VLI_UNKNOWN;
+    return 0;
+}
+
+// Function to compress with a preset dictionary (dict.h). zlib and LZMA
+// use it; other codecs are written as compress_codec would. The header
+// records the dictionary ID so decompression can check it was given the
+// same one.
+void compress_with_dict(FILE *source, FILE *dest, int codec, int level, const fc_dict *dict) {
+    unsigned char id[4];
+    budget_grant grant;
+
+    if (!dict || (codec != FC_ZLIB && codec != FC_LZMA)) {
+        compress_codec(source, dest, codec, level, 0);
+        return;
+    }
+    budget_acquire(&grant, codec, level, 1, dict->len);
+    level = grant.level;
+    write_header(dest, codec, level, FC_FLAG_DICT);
+    for (int i = 0; i < 4; i++) id[i] = dict->id >> (8 * i);
+    fwrite(id, 1, 4, dest);
+
+    if (codec == FC_ZLIB) {
+        z_stream strm;
+
+        arena_zstream(&strm);
+        if (deflateInit(&strm, level) == Z_OK) {
+            if (deflateSetDictionary(&strm, dict->data, dict->len) == Z_OK)
+                deflate_stream(&strm, source, dest);
+            deflateEnd(&strm);
+        }
+    } else {
+        lzma_stream strm = LZMA_STREAM_INIT;
+        lzma_options_lzma opt;
+        lzma_filter filters[2];
+        strm.allocator = &arena_lzma;
+
+        if (lzma_dict_filters(filters, &opt, level, dict) != 0 ||
+            lzma_raw_encoder(&strm, filters) != LZMA_OK) {
+            fprintf(stderr, "Error: Cannot start LZMA encoder\n");
+        } else {
+            lzma_pump(&strm, source, dest);
+        }
+        lzma_end(&strm);
+    }
+    budget_release(&grant);
+}
+
+// Function to compress with the codec picked by sampling the input.
+// Data that looks incompressible is stored as-is.
+void compress_auto(FILE *source, FILE *dest) {
+    compress_auto_threads(source, dest, 0);
+}
+
+// Same, with the thread count passed to compress_codec
+void compress_auto_threads(FILE *source, FILE *dest, int threads) {
+    unsigned char head[SAMPLE_WINDOW];
+    size_t head_len = 0;
+    sample_report report;
+    FILE *input = source;
+
+    sample_source(source, head, &head_len, &report);
+    choose_codec(&report);
+
+    // Non-seekable input: the sampled window must still be compressed
+    if (head_len > 0) {
+        input = stream_prefixed(head, head_len, source);
+        if (!input) {
+            fprintf(stderr, "Error: Cannot buffer sampled input\n");
+            return;
+        }
+    }
+
+    codec_filtered(input, dest, report.codec, report.level, threads, report.filter, report.delta_dist);
+
+    if (input != source) fclose(input);
+}
+
+// Function to decompress anything written by compress_auto, compress_codec
+// or compress_dedup
+void decompress_auto(FILE *source, FILE *dest) {
+    decompress_with_dict(source, dest, NULL);
+}
+
+// Same, with the dictionary for streams written by compress_with_dict
+void decompress_with_dict(FILE *source, FILE *dest, const fc_dict *dict) {
+    unsigned char header[FC_HEADER_SIZE], id[4];
+    stage_fn decode;
+
+    if (fread(header, 1, FC_HEADER_SIZE, source) != FC_HEADER_SIZE ||
+        memcmp(header, FC_MAGIC, 4) != 0 || header[4] != FC_VERSION) {
+        fprintf(stderr, "Error: Not an FCMP archive\n");
+        stats_fail();
+        return;
+    }
+    decode = body_decoder(header[5]);
+    if (!decode && header[7] == 0 && codec_by_id(header[5])) {
+        codec_decompress(codec_by_id(header[5]), source, dest, 0);
+        return;
+    }
+    if (!decode || (header[7] & ~(FC_FLAG_DEDUP | FC_FLAG_DICT)) ||
+        header[7] == (FC_FLAG_DEDUP | FC_FLAG_DICT)) {
+        fprintf(stderr, "Error: Unknown codec %d or flags %d in archive header\n", header[5], header[7]);
+        stats_fail();
+        return;
+    }
+
+    if (header[7] & FC_FLAG_DICT) {
+        uint32_t want;
+
+        if (fread(id, 1, 4, source) != 4) {
+            fprintf(stderr, "Error: Truncated archive header\n");
+            stats_fail();
+            return;
+        }
+        want = id[0] | id[1] << 8 | id[2] << 16 | (uint32_t)id[3] << 24;
+        if (!dict || dict->id != want) {
+            fprintf(stderr, "Error: Archive needs dictionary %08x\n", want);
+            stats_fail();
+            return;
+        }
+        if (header[5] == FC_ZLIB) {
+            inflate_stream(source, dest, dict->data, dict->len);
+        } else {
+            lzma_stream strm = LZMA_STREAM_INIT;
+            lzma_options_lzma opt;
+            lzma_filter filters[2];
+            strm.allocator = &arena_lzma;
+
+            if (lzma_dict_filters(filters, &opt, header[6], dict) != 0 ||
+                lzma_raw_decoder(&strm, filters) != LZMA_OK) {
+                fprintf(stderr, "Error: Cannot start LZMA decoder\n");
+                stats_fail();
+                return;
+            }
+            lzma_pump(&strm, source, dest);
+            lzma_end(&strm);
+        }
+    } else if (header[7] & FC_FLAG_DEDUP) {
+        FILE *pipe_in, *pipe_out;
+        stage_t *st;
+
+        if (stream_pipe(&pipe_in, &pipe_out) != 0 ||
+            !(st = stage_start_borrowed(decode, source, pipe_out))) {
+            fprintf(stderr, "Error: Cannot start decompression stage\n");
+            stats_fail();
+            return;
+        }
+        dedup_decode(pipe_in, dest);
+        fclose(pipe_in);
+        stage_join(st);
+    } else {
+        decode(source, dest);
+    }
+}
+
+// zlib stage of the compress cascade, spread across all cores
+static void zlib_stage(FILE *source, FILE *dest) {
+    compress_zlib_parallel(source, dest, 0, 0);
+}
+
+// LZMA stage of the compress cascade, at the preset and threads its
+// memory budget allows
+static void lzma_grant_stage(FILE *source, FILE *dest, void *arg) {
+    const budget_grant *grant = (const budget_grant *)arg;
+    lzma_mt_encode(source, dest, grant->threads, 0, grant->level, NULL);
+}
+
+// Compress cascade: source -> zlib -> fan-out -> { bz2 -> .bz2, LZMA -> .lzma }.
+// Every stage runs on its own thread. The zlib output is fanned out by
+// reference to both encoders, so the source is read once, each archive is
+// written once, and the wall time is that of the slower encoder. The
+// archives are written under temp names and only renamed into place once
+// both are complete, so a failed run leaves existing archives untouched.
+// Returns 0, or -1 if a stage failed to read, encode or write.
+static int compress_cascade(FILE *source, const char *filename) {
+    char bz2_filename[512], lzma_filename[512], bz2_tmp[520], lzma_tmp[520];
+    FILE *bz2_dest, *lzma_dest;
+    FILE *readers[2], *fanout;
+    stage_t *zlib_st, *bz2_st, *lzma_st;
+    budget_grant grant;
+    fc_stats stats;
+    stage_stats *zlib_stats, *bz2_stats, *lzma_stats;
+    int ret = -1;
+
+    snprintf(bz2_filename, sizeof(bz2_filename), "%s.bz2", filename);
+    snprintf(lzma_filename, sizeof(lzma_filename), "%s.lzma", filename);
+    snprintf(bz2_tmp, sizeof(bz2_tmp), "%s%s", bz2_filename, ARCHIVE_TMP_SUFFIX);
+    snprintf(lzma_tmp, sizeof(lzma_tmp), "%s%s", lzma_filename, ARCHIVE_TMP_SUFFIX);
+    bz2_dest = fopen(bz2_tmp, "wb");
+    lzma_dest = fopen(lzma_tmp, "wb");
+    fanout = bz2_dest && lzma_dest ? stream_fanout(readers, 2) : NULL;
+    if (!fanout) {
+        if (!bz2_dest || !lzma_dest) printf("Error: Cannot create output files for %s\n", filename);
+        if (bz2_dest) fclose(bz2_dest);
+        if (lzma_dest) fclose(lzma_dest);
+        if (bz2_dest) remove(bz2_tmp);
+        if (lzma_dest) remove(lzma_tmp);
+        fclose(source);
+        return -1;
+    }
+
+    // Stages only for their errors: the codecs mark their own stage failed
+    stats_init(&stats, NULL, NULL, 0);
+    zlib_stats = stats_stage(&stats, "zlib");
+    bz2_stats = stats_stage(&stats, "bz2");
+    lzma_stats = stats_stage(&stats, "lzma");
+
+    // The whole cascade is admitted at once: a stage waiting for memory
+    // would stall the fan-out and with it the stages already running
+    budget_acquire(&grant, FC_LZMA, 9, 0,
+                   codec_memusage(FC_BZ2, 9, 1) + codec_memusage(FC_ZLIB, 9, pool_default_threads()) +
+                   2 * PIPE_MEMORY);
+
+    // Consumers first, so the producer always has somewhere to write
+    bz2_st = stage_start_owned_stats(compress_bz2, readers[0], bz2_dest, bz2_stats);
+    lzma_st = stage_start_arg_stats(lzma_grant_stage, &grant, readers[1], lzma_dest, lzma_stats);
+    zlib_st = stage_start_owned_stats(zlib_stage, source, fanout, zlib_stats);
+
+    stage_join(zlib_st);
+    stage_join(bz2_st);
+    stage_join(lzma_st);
+    budget_release(&grant);
+
+    if (!zlib_st || !bz2_st || !lzma_st)
+        printf("Error: Cannot start compression stages for %s\n", filename);
+    else if (stats.error)
+        printf("Error: Compression of %s failed\n", filename);
+    else if (rename(bz2_tmp, bz2_filename) != 0 || rename(lzma_tmp, lzma_filename) != 0)
+        printf("Error: Cannot rename output files for %s\n", filename);
+    else
+        ret = 0;
+    if (ret == 0) {
         printf("File compressed successfully to: %s.lzma\n", filename);
+    } else {
+        remove(bz2_tmp);
+        remove(lzma_tmp);
+    }
+    stats_destroy(&stats);
+    return ret;
+}
+
+// Runs first(source) -> pipe -> second -> dest, with first on a stage
+// thread and second on the calling thread. The caller keeps both streams.
+// With stats, each side is recorded as a stage under its name.
+static int run_chain(FILE *source, FILE *dest, stage_fn first, stage_fn second, fc_stats *stats,
+                     const char *first_name, const char *second_name) {
+    stage_stats *first_st = stats ? stats_stage(stats, first_name) : NULL;
+    stage_stats *second_st = stats ? stats_stage(stats, second_name) : NULL;
+    FILE *pipe_in, *pipe_out, *in, *out;
+    stage_t *st;
+    int ret;
+
+    if (stream_pipe(&pipe_in, &pipe_out) != 0) return -1;
+    st = stage_start_stats(first, source, pipe_out, first_st);
+    if (!st) {
+        fclose(pipe_in);
+        return -1;
+    }
+    stats_stage_begin(second_st, pipe_in, dest, &in, &out);
+    second(in, out);
+    ret = stats_stage_end(second_st, in, out);
+    fclose(pipe_in);
+    stage_join(st);
+    return ret || (first_st && first_st->error) ? -1 : 0;
+}
+
+// Function to produce the cascade's .lzma artifact from a stream:
+// zlib and LZMA run concurrently, connected by an in-memory pipe
+void compress_chain(FILE *source, FILE *dest) {
+    compress_chain_stats(source, dest, NULL);
+}
+
+// Same, recording the zlib and LZMA stages in stats (which may be NULL).
+// Returns 0 on success.
+int compress_chain_stats(FILE *source, FILE *dest, fc_stats *stats) {
+    int ret = run_chain(source, dest, zlib_stage, lzma_stage, stats, "zlib", "lzma");
+
+    if (ret != 0) fprintf(stderr, "Error: Compression stages failed\n");
+    return ret;
+}
+
+// Function to decode a cascade .lzma stream: LZMA -> zlib, concurrently
+void decompress_chain(FILE *source, FILE *dest) {
+    decompress_chain_stats(source, dest, NULL);
+}
+
+int decompress_chain_stats(FILE *source, FILE *dest, fc_stats *stats) {
+    int ret = run_chain(source, dest, unlzma_stage, decompress_zlib, stats, "unlzma", "unzlib");
+
+    if (ret != 0) fprintf(stderr, "Error: Decompression stages failed\n");
+    return ret;
+}
+
+// Decompress cascade. Both archives hold the same zlib stream, so the
+// chain is .lzma -> LZMA -> zlib -> decompressed_final.txt (or the .bz2
+// archive through bz2 when the .lzma is missing), with both decoders
+// running concurrently over an in-memory pipe.
+static void decompress_cascade(const char *filename) {
+    char archive[512];
+    stage_fn outer = unlzma_stage;
+    FILE *source, *dest;
+    int ret;
+
+    snprintf(archive, sizeof(archive), "%s.lzma", filename);
+    source = fopen(archive, "rb");
+    if (!source) {
+        snprintf(archive, sizeof(archive), "%s.bz2", filename);
+        source = fopen(archive, "rb");
+        outer = decompress_bz2;
+    }
+    if (!source) {
+        printf("Error: Cannot open file %s.lzma\n", filename);
+        return;
+    }
+    dest = fopen("decompressed_final.txt", "wb");
+    if (!dest) {
+        printf("Error: Cannot create file decompressed_final.txt\n");
+        fclose(source);
+        return;
+    }
+
+    ret = run_chain(source, dest, outer, decompress_zlib, NULL, NULL, NULL);
+    fclose(source);
+    fclose(dest);
+
+    if (ret != 0)
+        printf("Error: Cannot start decompression stages for %s\n", archive);
+    else
+        printf("File decompressed successfully to: decompressed_final.txt\n");
+}
+
+// Function to run the compress cascade on an already open stream, such as
+// a counted one from stream_counted; the archives are named after
+// filename. Closes source. Returns 0, or -1 if a stage failed, in which
+// case no archive was written and existing ones are left as they were.
+int compress_file_stream(FILE *source, const char *filename) {
+    return compress_cascade(source, filename);
+}
+
+// New function to compress files
+void compress_file(const char *operation, const char *filename) {
+    // Combine compressing with zlib, bzip2, and LZMA
+    if (strcmp(operation, "compress") == 0) {
+        FILE *source = fopen(filename, "rb");
+        if (!source) {
+            printf("Error: Cannot open file %s\n", filename);
+            return;
+        }
+        compress_cascade(source, filename);
     }
     // Decompressing
     else if (strcmp(operation, "decompress") == 0) {
-        // Step 1: Decompress with LZMA
-        sprintf(final_filename, "%s.lzma", filename);
-        dest = fopen("decompressed_temp.bz2", "wb");
-        FILE *lzma_source = fopen(final_filename, "rb");
-        decompress_lzma(lzma_source, dest);
-        fclose(lzma_source);
+        decompress_cascade(filename);
+    }
+    // Single codec chosen by sampling the input, written to <name>.fc
+    else if (strcmp(operation, "auto") == 0) {
+        char archive[512];
+        FILE *source = fopen(filename, "rb");
+        if (!source) {
+            printf("Error: Cannot open file %s\n", filename);
+            return;
+        }
+        snprintf(archive, sizeof(archive), "%s.fc", filename);
+        FILE *dest = fopen(archive, "wb");
+        if (!dest) {
+            printf("Error: Cannot create file %s\n", archive);
+            fclose(source);
+            return;
+        }
+        compress_auto(source, dest);
+        fclose(source);
         fclose(dest);
-
-        // Step 2: Decompress with BZ2
-        temp1 = fopen("decompressed_temp.bz2", "rb");
-        sprintf(final_filename, "decompressed_%s", filename);
-        dest = fopen(final_filename, "wb");
-        decompress_bz2(temp1, dest);
-        fclose(temp1);
+        printf("File compressed successfully to: %s\n", archive);
+    }
+    // Seekable block archive, written to <name>.fcsk; an interrupted run
+    // resumes from its last checkpoint
+    else if (strcmp(operation, "archive") == 0) {
+        char archive[512];
+        archive_resume_report report;
+        snprintf(archive, sizeof(archive), "%s.fcsk", filename);
+        if (archive_create_file(filename, archive, FC_ZLIB, -1, 0, 0, &report) != 0)
+            return;
+        if (report.resumed_blocks > 0)
+            printf("Resumed after %llu blocks (%.1f MB)\n", report.resumed_blocks, report.resumed_bytes / 1e6);
+        printf("File compressed successfully to: %s\n", archive);
+    }
+    // Every codec at once, keeping the smallest, written to <name>.fc
+    else if (strcmp(operation, "race") == 0) {
+        char archive[512];
+        race_report report;
+        FILE *source = fopen(filename, "rb");
+        if (!source) {
+            printf("Error: Cannot open file %s\n", filename);
+            return;
+        }
+        snprintf(archive, sizeof(archive), "%s.fc", filename);
+        FILE *dest = fopen(archive, "wb");
+        if (!dest) {
+            printf("Error: Cannot create file %s\n", archive);
+            fclose(source);
+            return;
+        }
+        int ret = compress_race(source, dest, NULL, 0, 0, &report);
+        fclose(source);
         fclose(dest);
-
-        // Step 3: Decompress with zlib
-        temp1 = fopen(final_filename, "rb");
-        dest = fopen("decompressed_final.txt", "wb");
-        decompress_zlib(temp1, dest);
-        fclose(temp1);
+        for (int i = 0; i < report.count; i++)
+            printf("  %s -l %d: %s, %lld bytes, %.2f s CPU\n", codec_by_id(report.results[i].codec)->name,
+                   report.results[i].level, race_state_name(report.results[i].state),
+                   report.results[i].projected_out, report.results[i].projected_cpu);
+        if (ret == 0)
+            printf("File compressed successfully to: %s\n", archive);
+        else
+            remove(archive);
+    }
+    else if (strcmp(operation, "unpack") == 0) {
+        char archive[512];
+        snprintf(archive, sizeof(archive), "%s.fc", filename);
+        FILE *source = fopen(archive, "rb");
+        if (!source) {
+            printf("Error: Cannot open file %s\n", archive);
+            return;
+        }
+        FILE *dest = fopen("decompressed_final.txt", "wb");
+        if (!dest) {
+            printf("Error: Cannot create file decompressed_final.txt\n");
+            fclose(source);
+            return;
+        }
+        decompress_auto(source, dest);
+        fclose(source);
         fclose(dest);
-
         printf("File decompressed successfully to: decompressed_final.txt\n");
     } else {
         printf("Invalid operation: %s\n", operation);
     }
-
-    // Clean up temporary files
-    remove(temp_filename);
 }
@@ -2,13 +2,71 @@
 #define COMPRESS_H
 
 #include <stdio.h>
+#include "dict.h"
+#include "stats.h"
+
+// Header written by compress_auto: "FCMP", format version, codec, level, flags
+#define FC_MAGIC "FCMP"
+#define FC_VERSION 1
+#define FC_HEADER_SIZE 8
+#define FC_FLAG_DEDUP 0x01      // Body is a dedup record stream (dedup.h)
+#define FC_FLAG_DICT 0x02       // 4-byte dictionary ID follows (dict.h)
+
+enum fc_codec {
+    FC_STORE = 0,
+    FC_ZLIB = 1,
+    FC_BZ2 = 2,
+    FC_LZMA = 3,
+    FC_ZSTD = 4,            // Backends in codec.c, when built in
+    FC_LZ4 = 5
+};
+
+#define ADAPTIVE_START_LEVEL 6    // Level an adaptive zlib run starts at
+
+// Result of an adaptive zlib run
+typedef struct {
+    unsigned long long bytes_in, bytes_out;
+    double seconds;
+    double mbps;                          // Measured input throughput
+    int final_level;
+    unsigned long long level_blocks[10];  // Blocks compressed at each level
+} zlib_adaptive_stats;
 
 void compress_zlib(FILE *source, FILE *dest);
+void compress_zlib_level(FILE *source, FILE *dest, int level);
 void decompress_zlib(FILE *source, FILE *dest);
+void compress_zlib_parallel(FILE *source, FILE *dest, int threads, size_t block_size);
+void compress_zlib_adaptive(FILE *source, FILE *dest, int threads, double target_mbps,
+                            zlib_adaptive_stats *stats);
 void compress_bz2(FILE *source, FILE *dest);
+void compress_bz2_level(FILE *source, FILE *dest, int level);
 void decompress_bz2(FILE *source, FILE *dest);
 void compress_lzma(FILE *source, FILE *dest);
+void compress_lzma_level(FILE *source, FILE *dest, int preset);
 void decompress_lzma(FILE *source, FILE *dest);
+void compress_lzma_mt(FILE *source, FILE *dest, int threads, size_t block_size);
+void decompress_lzma_mt(FILE *source, FILE *dest, int threads);
+size_t compress_bound(int codec, size_t len);
+size_t compress_buffer(int codec, int level, const unsigned char *in, size_t in_len,
+                       unsigned char *out, size_t out_cap);
+int decompress_buffer(int codec, const unsigned char *in, size_t in_len,
+                      unsigned char *out, size_t out_len);
+void compress_codec(FILE *source, FILE *dest, int codec, int level, int threads);
+void compress_codec_adaptive(FILE *source, FILE *dest, int threads, double target_mbps,
+                             zlib_adaptive_stats *stats);
+void compress_codec_reserved(FILE *source, FILE *dest, int codec, int level, int threads,
+                             int filter, int dist);
+void compress_dedup(FILE *source, FILE *dest, int codec, int level, int threads);
+void compress_with_dict(FILE *source, FILE *dest, int codec, int level, const fc_dict *dict);
+void compress_auto(FILE *source, FILE *dest);
+void compress_auto_threads(FILE *source, FILE *dest, int threads);
+void decompress_auto(FILE *source, FILE *dest);
+void decompress_with_dict(FILE *source, FILE *dest, const fc_dict *dict);
+void compress_chain(FILE *source, FILE *dest);
+void decompress_chain(FILE *source, FILE *dest);
+int compress_chain_stats(FILE *source, FILE *dest, fc_stats *stats);
+int decompress_chain_stats(FILE *source, FILE *dest, fc_stats *stats);
+int compress_file_stream(FILE *source, const char *filename);
 void compress_file(const char *operation, const char *filename);
 
 #endif // COMPRESS_H
@@ -0,0 +1,104 @@
+#include <pthread.h>
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#endif
+
+#define POLY 0x82f63b78         // Reflected Castagnoli polynomial
+
+static uint32_t table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void table_init(void) {
+    for (int i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? c >> 1 ^ POLY : c >> 1;
+        table[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++)
+        for (int t = 1; t < 8; t++)
+            table[t][i] = table[t - 1][i] >> 8 ^ table[0][table[t - 1][i] & 0xff];
+}
+
+// Slicing-by-8: eight bytes per step through eight tables
+static uint32_t crc32c_table(uint32_t crc, const unsigned char *p, size_t len) {
+    pthread_once(&table_once, table_init);
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v ^= crc;   // Little-endian: the CRC meets the first four bytes
+        crc = table[7][v & 0xff] ^ table[6][v >> 8 & 0xff] ^ table[5][v >> 16 & 0xff] ^
+              table[4][v >> 24 & 0xff] ^ table[3][v >> 32 & 0xff] ^ table[2][v >> 40 & 0xff] ^
+              table[1][v >> 48 & 0xff] ^ table[0][v >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = crc >> 8 ^ table[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t c = crc;
+
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+
+int crc32c_hardware(void) {
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+
+int crc32c_hardware(void) {
+    return 1;
+}
+#else
+#define crc32c_hw crc32c_table
+
+int crc32c_hardware(void) {
+    return 0;
+}
+#endif
+
+static int hw;
+static pthread_once_t hw_once = PTHREAD_ONCE_INIT;
+
+static void hw_init(void) {
+    hw = crc32c_hardware();
+}
+
+// Function to extend a CRC-32C over len more bytes
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&hw_once, hw_init);
+    crc = ~crc;
+    crc = hw ? crc32c_hw(crc, data, len) : crc32c_table(crc, data, len);
+    return ~crc;
+}
@@ -0,0 +1,14 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32C (Castagnoli), the checksum of iSCSI and ext4. On x86-64 CPUs
+// with SSE4.2 and on ARMv8 CPUs with the CRC extension it is computed by
+// the crc32 instructions, several times faster than zlib's crc32();
+// elsewhere a slicing-by-8 table is used. Start with crc = 0.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+int crc32c_hardware(void);
+
+#endif // CRC32C_H
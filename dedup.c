@@ -0,0 +1,342 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dedup.h"
+#include "stats.h"
+
+#define DEDUP_BUFFER (4 * DEDUP_MAX_CHUNK)
+
+enum {
+    REC_END = 0,
+    REC_LITERAL = 1,
+    REC_REF = 2
+};
+
+// ---- SHA-256 (FIPS 180-4) ----
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t len;
+    unsigned char block[64];
+    size_t fill;
+} sha256_ctx;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void sha256_block(sha256_ctx *c, const unsigned char *p) {
+    uint32_t w[64], s[8];
+
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[4 * i] << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ w[i - 15] >> 3;
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ w[i - 2] >> 10;
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    memcpy(s, c->h, sizeof(s));
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = s[7] + (ROTR(s[4], 6) ^ ROTR(s[4], 11) ^ ROTR(s[4], 25)) +
+                      ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(s[0], 2) ^ ROTR(s[0], 13) ^ ROTR(s[0], 22)) +
+                      ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+        memmove(s + 1, s, 7 * sizeof(uint32_t));
+        s[4] += t1;
+        s[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; i++) c->h[i] += s[i];
+}
+
+// Function to compute the SHA-256 digest of a buffer
+void sha256(const unsigned char *data, size_t len, unsigned char digest[32]) {
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    sha256_ctx c;
+    unsigned char tail[128];
+    size_t rest, pad;
+
+    memcpy(c.h, init, sizeof(init));
+    for (c.len = 0; len - c.len >= 64; c.len += 64)
+        sha256_block(&c, data + c.len);
+
+    rest = len - c.len;
+    pad = rest < 56 ? 64 : 128;
+    memset(tail, 0, pad);
+    memcpy(tail, data + c.len, rest);
+    tail[rest] = 0x80;
+    for (int i = 0; i < 8; i++)
+        tail[pad - 1 - i] = (uint64_t)len * 8 >> (8 * i);
+    sha256_block(&c, tail);
+    if (pad == 128) sha256_block(&c, tail + 64);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = c.h[i] >> 24;
+        digest[4 * i + 1] = c.h[i] >> 16;
+        digest[4 * i + 2] = c.h[i] >> 8;
+        digest[4 * i + 3] = c.h[i];
+    }
+}
+
+// ---- Chunking and the fingerprint table ----
+
+typedef struct {
+    unsigned char digest[32];
+    uint64_t offset;
+    uint32_t len;
+    int used;
+} chunk_entry;
+
+typedef struct {
+    chunk_entry *slots;
+    size_t cap, count;
+} chunk_table;
+
+// Gear table from a fixed splitmix64 sequence, so cut points are stable
+static void gear_init(uint64_t gear[256]) {
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ z >> 30) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ z >> 27) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ z >> 31;
+    }
+}
+
+// Length of the next chunk. A boundary is where the top DEDUP_AVG_BITS
+// bits of the gear hash are zero; the high bits mix in the last 64 bytes.
+static size_t next_cut(const uint64_t gear[256], const unsigned char *p, size_t n) {
+    const uint64_t mask = ((1ULL << DEDUP_AVG_BITS) - 1) << (64 - DEDUP_AVG_BITS);
+    size_t limit = n < DEDUP_MAX_CHUNK ? n : DEDUP_MAX_CHUNK;
+    uint64_t h = 0;
+
+    if (limit <= DEDUP_MIN_CHUNK) return limit;
+    for (size_t i = DEDUP_MIN_CHUNK - 64; i < limit; i++) {
+        h = (h << 1) + gear[p[i]];
+        if (i >= DEDUP_MIN_CHUNK && !(h & mask)) return i + 1;
+    }
+    return limit;
+}
+
+static uint64_t digest_key(const unsigned char *digest) {
+    uint64_t key;
+    memcpy(&key, digest, sizeof(key));
+    return key;
+}
+
+static int table_grow(chunk_table *t) {
+    size_t cap = t->cap ? t->cap * 2 : 4096;
+    chunk_entry *slots = calloc(cap, sizeof(chunk_entry));
+
+    if (!slots) return -1;
+    for (size_t i = 0; i < t->cap; i++) {
+        if (!t->slots[i].used) continue;
+        size_t j = digest_key(t->slots[i].digest) & (cap - 1);
+        while (slots[j].used) j = (j + 1) & (cap - 1);
+        slots[j] = t->slots[i];
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->cap = cap;
+    return 0;
+}
+
+// Finds the chunk with this digest, or inserts it; returns the entry
+static chunk_entry *table_lookup(chunk_table *t, const unsigned char *digest, int *found) {
+    if ((t->count + 1) * 2 > t->cap && table_grow(t) != 0) return NULL;
+
+    size_t j = digest_key(digest) & (t->cap - 1);
+    while (t->slots[j].used) {
+        if (memcmp(t->slots[j].digest, digest, 32) == 0) {
+            *found = 1;
+            return &t->slots[j];
+        }
+        j = (j + 1) & (t->cap - 1);
+    }
+    *found = 0;
+    memcpy(t->slots[j].digest, digest, 32);
+    t->slots[j].used = 1;
+    t->count++;
+    return &t->slots[j];
+}
+
+static void put_varint(FILE *dest, uint64_t v) {
+    while (v >= 0x80) {
+        putc((v & 0x7f) | 0x80, dest);
+        v >>= 7;
+    }
+    putc(v, dest);
+}
+
+static int get_varint(FILE *source, uint64_t *v) {
+    int c, shift = 0;
+
+    *v = 0;
+    do {
+        if ((c = getc(source)) == EOF || shift > 63) return -1;
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 0;
+}
+
+// Function to deduplicate source into a record stream. Returns 0 on success.
+int dedup_encode(FILE *source, FILE *dest, dedup_stats *stats) {
+    uint64_t gear[256];
+    chunk_table table = { NULL, 0, 0 };
+    dedup_stats st = { 0, 0, 0, 0 };
+    unsigned char *buf = malloc(DEDUP_BUFFER);
+    unsigned char digest[32];
+    size_t len = 0, pos = 0;
+    int eof = 0, failed = 0;
+
+    if (!buf) return -1;
+    gear_init(gear);
+
+    for (;;) {
+        // Keep at least one maximum chunk ahead so cut points do not
+        // depend on how the input was read
+        if (!eof && len - pos < DEDUP_MAX_CHUNK) {
+            memmove(buf, buf + pos, len - pos);
+            len -= pos;
+            pos = 0;
+            while (!eof && len < DEDUP_BUFFER) {
+                size_t n = fread(buf + len, 1, DEDUP_BUFFER - len, source);
+                len += n;
+                if (n == 0) eof = 1;
+            }
+            if (ferror(source)) {
+                failed = 1;
+                break;
+            }
+        }
+        if (pos == len) break;
+
+        size_t cut = next_cut(gear, buf + pos, len - pos);
+        int found;
+        sha256(buf + pos, cut, digest);
+        chunk_entry *e = table_lookup(&table, digest, &found);
+        if (!e) {
+            failed = 1;
+            break;
+        }
+
+        // A copy that has left the decoder's window is written out again
+        // and referenced from there on
+        int stale = found && st.unique_bytes - e->offset > DEDUP_WINDOW;
+        if (found && !stale && e->len == cut) {
+            putc(REC_REF, dest);
+            put_varint(dest, e->offset);
+            put_varint(dest, cut);
+            st.duplicate_chunks++;
+        } else {
+            if (!found || stale) {
+                e->offset = st.unique_bytes;
+                e->len = cut;
+            }
+            putc(REC_LITERAL, dest);
+            put_varint(dest, cut);
+            fwrite(buf + pos, 1, cut, dest);
+            st.unique_bytes += cut;
+        }
+        st.chunks++;
+        st.bytes_in += cut;
+        pos += cut;
+    }
+    putc(REC_END, dest);
+
+    if (ferror(dest)) failed = 1;
+    if (failed) {
+        fprintf(stderr, "Error: deduplication failed\n");
+        stats_fail();
+    }
+    if (stats) *stats = st;
+    free(table.slots);
+    free(buf);
+    return failed ? -1 : 0;
+}
+
+// The last DEDUP_WINDOW literal bytes, which references are served from.
+// It grows with the data up to the window and then wraps around.
+typedef struct {
+    unsigned char *data;
+    size_t cap;
+    uint64_t total;             // Literal bytes seen so far
+} chunk_window;
+
+static int window_append(chunk_window *w, const unsigned char *p, size_t len) {
+    if (len == 0) return 0;
+    if (w->cap < DEDUP_WINDOW && w->total + len > w->cap) {
+        size_t cap = w->cap ? w->cap : DEDUP_BUFFER;
+        while (cap < w->total + len && cap < DEDUP_WINDOW) cap *= 2;
+        if (cap > DEDUP_WINDOW) cap = DEDUP_WINDOW;
+        unsigned char *data = realloc(w->data, cap);
+        if (!data) return -1;
+        w->data = data;
+        w->cap = cap;
+    }
+    size_t at = w->total % w->cap, first = len < w->cap - at ? len : w->cap - at;
+    memcpy(w->data + at, p, first);
+    memcpy(w->data, p + first, len - first);
+    w->total += len;
+    return 0;
+}
+
+// Copies out len bytes at a literal offset, or fails if they are not held
+static int window_read(const chunk_window *w, uint64_t offset, unsigned char *p, size_t len) {
+    if (len == 0) return 0;
+    if (offset > w->total || len > w->total - offset || w->total - offset > w->cap) return -1;
+    size_t at = offset % w->cap, first = len < w->cap - at ? len : w->cap - at;
+    memcpy(p, w->data + at, first);
+    memcpy(p + first, w->data, len - first);
+    return 0;
+}
+
+// Function to rebuild the original data from a record stream. Returns 0
+// on success.
+int dedup_decode(FILE *source, FILE *dest) {
+    unsigned char *buf = malloc(DEDUP_MAX_CHUNK);
+    chunk_window window = { NULL, 0, 0 };
+    uint64_t len, offset;
+    int tag, failed = 0;
+
+    if (!buf) return -1;
+    while (!failed && (tag = getc(source)) != REC_END) {
+        if (tag == REC_LITERAL) {
+            if (get_varint(source, &len) != 0 || len > DEDUP_MAX_CHUNK ||
+                fread(buf, 1, len, source) != len || window_append(&window, buf, len) != 0) {
+                failed = 1;
+                break;
+            }
+        } else if (tag == REC_REF) {
+            if (get_varint(source, &offset) != 0 || get_varint(source, &len) != 0 ||
+                len > DEDUP_MAX_CHUNK || window_read(&window, offset, buf, len) != 0) {
+                failed = 1;
+                break;
+            }
+        } else {
+            failed = 1;     // EOF before the end record, or an unknown tag
+            break;
+        }
+        if (fwrite(buf, 1, len, dest) != len) failed = 1;
+    }
+
+    if (failed) {
+        fprintf(stderr, "Error: Corrupt or truncated deduplicated stream\n");
+        stats_fail();
+    }
+    free(window.data);
+    free(buf);
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,36 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Deduplicating pre-stage. The input is cut into content-defined chunks
+// with a gear rolling hash, so an insertion only moves the chunk
+// boundaries near it, and each chunk is fingerprinted with SHA-256. The
+// first copy of a chunk is written as a literal, later copies as a
+// reference to the offset of that copy among the literal bytes. Only the
+// last DEDUP_WINDOW literal bytes are referenced, so the decoder keeps
+// just that much in memory; an older chunk is written as a literal again.
+//
+//   literal  0x01 len(varint) bytes
+//   ref      0x02 offset(varint) len(varint)
+//   end      0x00
+#define DEDUP_MIN_CHUNK 2048
+#define DEDUP_AVG_BITS 13           // 8 KB average chunk
+#define DEDUP_MAX_CHUNK 65536
+#define DEDUP_WINDOW (64 << 20)     // Literal bytes a reference may reach back
+
+typedef struct {
+    unsigned long long bytes_in;
+    unsigned long long unique_bytes;    // Bytes written as literals
+    unsigned long long chunks;
+    unsigned long long duplicate_chunks;
+} dedup_stats;
+
+int dedup_encode(FILE *source, FILE *dest, dedup_stats *stats);
+int dedup_decode(FILE *source, FILE *dest);
+
+// The chunk fingerprint, also used for archive block manifests (archive.h)
+void sha256(const unsigned char *data, size_t len, unsigned char digest[32]);
+
+#endif // DEDUP_H
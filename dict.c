@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "dict.h"
+
+#define TRAIN_K 8                       // Substring length that is counted
+#define TRAIN_SEGMENT 64                // Unit copied into the dictionary
+#define TRAIN_HASH_BITS 20
+#define TRAIN_SAMPLE_MAX (1024 * 1024)  // Bytes read from each sample
+#define TRAIN_TOTAL_MAX (64 * 1024 * 1024)
+
+typedef struct {
+    size_t pos;
+    unsigned long long score;
+} segment;
+
+static uint32_t kmer_hash(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 0x9e3779b97f4a7c15ULL) >> (64 - TRAIN_HASH_BITS);
+}
+
+// Sum of the sample counts of the substrings in a segment; substrings
+// seen in only one sample add nothing
+static unsigned long long segment_score(const uint32_t *counts, const unsigned char *p) {
+    unsigned long long score = 0;
+
+    for (int i = 0; i + TRAIN_K <= TRAIN_SEGMENT; i++) {
+        uint32_t c = counts[kmer_hash(p + i)];
+        if (c > 1) score += c;
+    }
+    return score;
+}
+
+static int compare_segments(const void *a, const void *b) {
+    const segment *x = a, *y = b;
+    return x->score < y->score ? 1 : x->score > y->score ? -1 : 0;
+}
+
+// Function to train a dictionary of up to size bytes from sample files.
+// Every 8-byte substring is counted once per sample it occurs in, and
+// 64-byte segments are picked greedily by the counts of their substrings;
+// a picked segment zeroes its substrings so near-copies are not picked
+// again, and any room left is filled with raw sample data. The best
+// segments go last, closest to the data, where deflate reaches them with
+// the shortest distances. Returns 0 on success, -1 if no sample could
+// be read.
+int dict_train(const char *const *files, int count, size_t size, FILE *dest) {
+    unsigned char *corpus = NULL, *dict = NULL;
+    size_t total = 0, *starts = NULL, nsegments = 0, used = 0;
+    uint32_t *counts = NULL;
+    int *last = NULL, ret = -1;
+    segment *segments = NULL;
+
+    if (size == 0) size = DICT_SIZE;
+    if (size > DICT_MAX) size = DICT_MAX;
+
+    corpus = malloc(TRAIN_TOTAL_MAX);
+    starts = malloc((count + 1) * sizeof(size_t));
+    counts = calloc(1 << TRAIN_HASH_BITS, sizeof(uint32_t));
+    last = malloc((1 << TRAIN_HASH_BITS) * sizeof(int));
+    dict = malloc(size);
+    if (!corpus || !starts || !counts || !last || !dict) goto done;
+
+    for (int i = 0; i < count; i++) {
+        FILE *f = fopen(files[i], "rb");
+        starts[i] = total;
+        if (!f) {
+            fprintf(stderr, "Error: Cannot open file %s\n", files[i]);
+            continue;
+        }
+        size_t room = TRAIN_TOTAL_MAX - total;
+        total += fread(corpus + total, 1, room < TRAIN_SAMPLE_MAX ? room : TRAIN_SAMPLE_MAX, f);
+        fclose(f);
+    }
+    starts[count] = total;
+    if (total == 0) {
+        fprintf(stderr, "Error: No samples could be read\n");
+        goto done;
+    }
+
+    // Document frequency of each substring
+    memset(last, -1, (1 << TRAIN_HASH_BITS) * sizeof(int));
+    for (int s = 0; s < count; s++) {
+        for (size_t i = starts[s]; i + TRAIN_K <= starts[s + 1]; i++) {
+            uint32_t h = kmer_hash(corpus + i);
+            if (last[h] != s) {
+                last[h] = s;
+                counts[h]++;
+            }
+        }
+    }
+
+    // Candidate segments at half-segment steps within each sample
+    segments = malloc((total / (TRAIN_SEGMENT / 2) + 1) * sizeof(segment));
+    if (!segments) goto done;
+    for (int s = 0; s < count; s++) {
+        for (size_t i = starts[s]; i + TRAIN_SEGMENT <= starts[s + 1]; i += TRAIN_SEGMENT / 2) {
+            unsigned long long score = segment_score(counts, corpus + i);
+            if (score == 0) continue;
+            segments[nsegments].pos = i;
+            segments[nsegments].score = score;
+            nsegments++;
+        }
+    }
+    qsort(segments, nsegments, sizeof(segment), compare_segments);
+
+    // Fill from the back: the first pick ends the dictionary
+    for (size_t i = 0; i < nsegments && used + TRAIN_SEGMENT <= size; i++) {
+        const unsigned char *p = corpus + segments[i].pos;
+        if (segment_score(counts, p) * 2 < segments[i].score) continue;
+        for (int j = 0; j + TRAIN_K <= TRAIN_SEGMENT; j++)
+            counts[kmer_hash(p + j)] = 0;
+        used += TRAIN_SEGMENT;
+        memcpy(dict + size - used, p, TRAIN_SEGMENT);
+    }
+
+    // Room left (little is shared between samples): the front is filled
+    // with the end of the corpus, which still holds typical content
+    if (used < size) {
+        size_t fill = size - used < total ? size - used : total;
+        memcpy(dict + size - used - fill, corpus + total - fill, fill);
+        used += fill;
+    }
+
+    if (fwrite(dict + size - used, 1, used, dest) == used) ret = 0;
+
+done:
+    if (ret != 0) fprintf(stderr, "Error: dictionary training failed\n");
+    free(corpus);
+    free(starts);
+    free(counts);
+    free(last);
+    free(dict);
+    free(segments);
+    return ret;
+}
+
+// Function to load a dictionary file
+fc_dict *dict_load(const char *filename) {
+    FILE *f = fopen(filename, "rb");
+    fc_dict *dict;
+
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open dictionary %s\n", filename);
+        return NULL;
+    }
+    dict = calloc(1, sizeof(*dict));
+    if (dict) dict->data = malloc(DICT_MAX);
+    if (!dict || !dict->data) {
+        fclose(f);
+        dict_free(dict);
+        return NULL;
+    }
+    dict->len = fread(dict->data, 1, DICT_MAX, f);
+    if (ferror(f) || getc(f) != EOF) {
+        fprintf(stderr, "Error: Dictionary %s is unreadable or over %d bytes\n", filename, DICT_MAX);
+        fclose(f);
+        dict_free(dict);
+        return NULL;
+    }
+    fclose(f);
+    dict->id = adler32(adler32(0L, Z_NULL, 0), dict->data, dict->len);
+    return dict;
+}
+
+void dict_free(fc_dict *dict) {
+    if (!dict) return;
+    free(dict->data);
+    free(dict);
+}
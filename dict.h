@@ -0,0 +1,25 @@
+#ifndef DICT_H
+#define DICT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Preset dictionaries for small inputs. A dictionary is raw bytes that
+// the encoder and decoder both treat as already-seen history, so even a
+// short record can refer back to common keys and boilerplate. The file
+// format is just those bytes; its ID is their adler32, the same value
+// zlib records for deflateSetDictionary.
+#define DICT_SIZE (32 * 1024)   // Default trained size: deflate's whole window
+#define DICT_MAX (1024 * 1024)
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    uint32_t id;
+} fc_dict;
+
+int dict_train(const char *const *files, int count, size_t size, FILE *dest);
+fc_dict *dict_load(const char *filename);
+void dict_free(fc_dict *dict);
+
+#endif // DICT_H
@@ -0,0 +1,258 @@
+#include <math.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "compress.h"
+#include "entropy.h"
+
+#define STORE_ENTROPY 7.9     // Above this a window is treated as random
+#define FAST_ENTROPY 7.2      // Mostly incompressible: only a cheap pass pays off
+#define TEXT_ENTROPY 5.5      // Text-like data: worth the slow, strong codec
+#define DELTA_MIN_SHARE 4     // Delta needs 1/4 of bytes to step evenly at its stride
+#define DELTA_GAIN 0.75       // and to save this many bits/byte of entropy
+
+// Sixteen bytes handled as one: GCC and Clang compile the arithmetic and
+// comparisons on these to SSE2 or NEON, or to plain code elsewhere
+typedef unsigned char byte_vec __attribute__((vector_size(16)));
+
+// Signatures of formats that are already compressed
+static const struct {
+    const char *magic;
+    size_t len;
+} known_formats[] = {
+    { "\x1f\x8b", 2 },                 // gzip
+    { "BZh", 3 },                      // bzip2
+    { "\xfd" "7zXZ", 5 },              // xz
+    { "\x28\xb5\x2f\xfd", 4 },         // zstd
+    { "\x04\x22\x4d\x18", 4 },         // lz4
+    { "PK\x03\x04", 4 },               // zip, jar, docx
+    { "7z\xbc\xaf\x27\x1c", 6 },       // 7z
+    { "\xff\xd8\xff", 3 },             // JPEG
+    { "\x89PNG", 4 },                  // PNG
+    { "GIF8", 4 },                     // GIF
+    { FC_MAGIC, 4 },                   // our own archives
+};
+
+static double hist_entropy(const size_t *hist, size_t total) {
+    double h = 0.0;
+
+    for (int i = 0; i < 256 && total > 0; i++) {
+        if (hist[i] == 0) continue;
+        double p = (double)hist[i] / total;
+        h -= p * log2(p);
+    }
+    return h;
+}
+
+// Function to compute the order-0 entropy of a buffer in bits per byte
+double byte_entropy(const unsigned char *buf, size_t len) {
+    size_t hist[256] = { 0 };
+
+    for (size_t i = 0; i < len; i++)
+        hist[buf[i]]++;
+    return hist_entropy(hist, len);
+}
+
+static unsigned le16(const unsigned char *p) {
+    return p[0] | p[1] << 8;
+}
+
+static unsigned long le32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned long)p[3] << 24;
+}
+
+// BCJ filter for an ELF, PE or Mach-O header at the start of buf
+static int executable_filter(const unsigned char *buf, size_t len) {
+    unsigned machine = 0;
+
+    if (len >= 20 && memcmp(buf, "\x7f" "ELF", 4) == 0) {
+        machine = buf[5] == 2 ? (unsigned)(buf[18] << 8 | buf[19]) : le16(buf + 18);
+        if (machine == 3 || machine == 62) return FC_FILTER_X86;
+        if (machine == 40) return FC_FILTER_ARM;
+        if (machine == 183) return FC_FILTER_ARM64;
+    } else if (len >= 64 && buf[0] == 'M' && buf[1] == 'Z') {
+        unsigned long pe = le32(buf + 0x3c);
+        if (pe + 6 <= len && memcmp(buf + pe, "PE\0\0", 4) == 0) {
+            machine = le16(buf + pe + 4);
+            if (machine == 0x14c || machine == 0x8664) return FC_FILTER_X86;
+            if (machine == 0x1c0) return FC_FILTER_ARM;
+            if (machine == 0xaa64) return FC_FILTER_ARM64;
+        }
+    } else if (len >= 8 && le32(buf) == 0xfeedfacf) {
+        unsigned long cpu = le32(buf + 4);
+        if (cpu == 0x01000007) return FC_FILTER_X86;
+        if (cpu == 0x0100000c) return FC_FILTER_ARM64;
+    }
+    return FC_FILTER_NONE;
+}
+
+// Function to count, for each stride d up to DELTA_MAX_DIST, the bytes
+// whose difference from the byte d back is within one of the difference
+// a record earlier, adding to scores[d]. Fields that are constant or that
+// step evenly from record to record score; text and noise hardly do.
+static void stride_scores(const unsigned char *buf, size_t len, unsigned long long *scores) {
+    for (size_t d = 1; d <= DELTA_MAX_DIST && 2 * d < len; d++) {
+        byte_vec acc = { 0 };
+        unsigned long long count = 0;
+        size_t i = 2 * d;
+        int steps = 0;
+
+        for (; i + sizeof(byte_vec) <= len; i += sizeof(byte_vec)) {
+            byte_vec cur, prev, prev2;
+            memcpy(&cur, buf + i, sizeof(cur));
+            memcpy(&prev, buf + i - d, sizeof(prev));
+            memcpy(&prev2, buf + i - 2 * d, sizeof(prev2));
+            // -1, 0 and 1 become 0, 1 and 2; a true lane is all ones
+            acc -= (byte_vec)((cur - prev) - (prev - prev2) + 1 <= 2);
+            if (++steps == 255) {
+                for (size_t k = 0; k < sizeof(byte_vec); k++) count += acc[k];
+                acc = (byte_vec){ 0 };
+                steps = 0;
+            }
+        }
+        for (size_t k = 0; k < sizeof(byte_vec); k++) count += acc[k];
+        for (; i < len; i++)
+            count += (unsigned char)(buf[i] - 2 * buf[i - d] + buf[i - 2 * d] + 1) <= 2;
+        scores[d] += count;
+    }
+}
+
+// Function to add the bytes of buf, delta coded at stride d, to hist
+static void delta_histogram(const unsigned char *buf, size_t len, size_t d, size_t *hist) {
+    for (size_t i = 0; i < len; i++)
+        hist[(unsigned char)(buf[i] - (i >= d ? buf[i - d] : 0))]++;
+}
+
+static int has_known_format(const unsigned char *buf, size_t len) {
+    for (size_t i = 0; i < sizeof(known_formats) / sizeof(known_formats[0]); i++) {
+        if (len >= known_formats[i].len &&
+            memcmp(buf, known_formats[i].magic, known_formats[i].len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Function to sample the input without consuming it. Regular files are
+// sampled with pread() at SAMPLE_WINDOWS evenly spaced offsets from the
+// current position. Pipes can only be sampled at the front, so the first
+// window is read into head and *head_len is set; the caller must feed
+// those bytes to the encoder before the rest of the stream.
+int sample_source(FILE *source, unsigned char *head, size_t *head_len, sample_report *report) {
+    unsigned char window[SAMPLE_WINDOW];
+    size_t hist[256] = { 0 }, delta_hist[256] = { 0 };
+    unsigned long long scores[DELTA_MAX_DIST + 1] = { 0 };
+    size_t total = 0;
+    off_t stride = 0;
+    int seekable, best = 0;
+    struct stat st;
+    long pos;
+
+    memset(report, 0, sizeof(*report));
+    *head_len = 0;
+
+    pos = ftell(source);
+    seekable = fstat(fileno(source), &st) == 0 && S_ISREG(st.st_mode) && pos >= 0;
+    if (seekable) {
+        off_t size = st.st_size > pos ? st.st_size - pos : 0;
+        int windows = size > (off_t)SAMPLE_WINDOW * SAMPLE_WINDOWS ? SAMPLE_WINDOWS :
+                      (int)((size + SAMPLE_WINDOW - 1) / SAMPLE_WINDOW);
+        stride = windows > 1 ? (size - SAMPLE_WINDOW) / (windows - 1) : 0;
+
+        for (int i = 0; i < windows; i++) {
+            ssize_t n = pread(fileno(source), window, SAMPLE_WINDOW, pos + i * stride);
+            if (n <= 0) break;
+            if (i == 0) {
+                report->known_format = has_known_format(window, n);
+                report->filter = executable_filter(window, n);
+            }
+            if (byte_entropy(window, n) > STORE_ENTROPY) report->dense_windows++;
+            for (ssize_t j = 0; j < n; j++)
+                hist[window[j]]++;
+            stride_scores(window, n, scores);
+            total += n;
+            report->windows++;
+        }
+    } else {
+        size_t n = fread(head, 1, SAMPLE_WINDOW, source);
+        *head_len = n;
+        if (n > 0) {
+            report->known_format = has_known_format(head, n);
+            report->filter = executable_filter(head, n);
+            if (byte_entropy(head, n) > STORE_ENTROPY) report->dense_windows++;
+            for (size_t j = 0; j < n; j++)
+                hist[head[j]]++;
+            stride_scores(head, n, scores);
+            total = n;
+            report->windows = 1;
+        }
+    }
+    report->entropy = hist_entropy(hist, total);
+
+    // Numeric records: the stride with the most near-equal byte pairs,
+    // kept only if delta coding at it really lowers the entropy
+    for (int d = 1; d <= DELTA_MAX_DIST; d++)
+        if (scores[d] > scores[best]) best = d;
+    if (report->filter != FC_FILTER_NONE || best == 0 ||
+        scores[best] * DELTA_MIN_SHARE < total)
+        return report->windows;
+    if (seekable) {
+        for (int i = 0; i < report->windows; i++) {
+            ssize_t n = pread(fileno(source), window, SAMPLE_WINDOW, pos + i * stride);
+            if (n <= 0) break;
+            delta_histogram(window, n, best, delta_hist);
+        }
+    } else {
+        delta_histogram(head, *head_len, best, delta_hist);
+    }
+    if (hist_entropy(delta_hist, total) + DELTA_GAIN <= report->entropy) {
+        report->filter = FC_FILTER_DELTA;
+        report->delta_dist = best;
+    }
+    return report->windows;
+}
+
+// Function to find the pre-filter for a seekable source without moving
+// it. Pipes get FC_FILTER_NONE: their head cannot be put back.
+int sample_filter(FILE *source, int *delta_dist) {
+    sample_report report;
+    size_t head_len;
+    struct stat st;
+
+    *delta_dist = 0;
+    if (fstat(fileno(source), &st) != 0 || !S_ISREG(st.st_mode) || ftell(source) < 0)
+        return FC_FILTER_NONE;
+    sample_source(source, NULL, &head_len, &report);
+    *delta_dist = report.delta_dist;
+    return report.filter;
+}
+
+// Function to map a sample report to a codec and level
+void choose_codec(sample_report *report) {
+    int mostly_dense = report->windows > 0 && report->dense_windows * 4 >= report->windows * 3;
+
+    if (report->windows == 0) {
+        report->codec = FC_STORE;
+        report->level = 0;
+    } else if (report->filter == FC_FILTER_DELTA) {
+        // Dense bytes can still be smooth records: the delta stream is not
+        report->codec = FC_LZMA;
+        report->level = 6;
+    } else if (mostly_dense || report->entropy > STORE_ENTROPY ||
+               (report->known_format && report->entropy > FAST_ENTROPY)) {
+        report->codec = FC_STORE;
+        report->level = 0;
+    } else if (report->filter != FC_FILTER_NONE) {
+        // Machine code: LZMA behind the BCJ filter
+        report->codec = FC_LZMA;
+        report->level = 6;
+    } else if (report->entropy > FAST_ENTROPY) {
+        report->codec = FC_ZLIB;
+        report->level = 1;
+    } else if (report->entropy > TEXT_ENTROPY) {
+        report->codec = FC_ZLIB;
+        report->level = 6;
+    } else {
+        report->codec = FC_LZMA;
+        report->level = 6;
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef ENTROPY_H
+#define ENTROPY_H
+
+#include <stdio.h>
+
+#define SAMPLE_WINDOW 16384   // Bytes per sampled window
+#define SAMPLE_WINDOWS 8      // Windows spread across a seekable input
+#define DELTA_MAX_DIST 32     // Longest record stride looked for
+
+// Pre-filter for LZMA, undone by the .xz decoder: a BCJ filter turns the
+// relative branch targets of machine code into absolute ones, so repeated
+// calls to a function become repeated bytes; delta stores each byte as
+// the difference from the byte one record earlier, which turns slowly
+// changing integers and floats into runs of small values
+enum fc_filter {
+    FC_FILTER_NONE = 0,
+    FC_FILTER_X86,
+    FC_FILTER_ARM,
+    FC_FILTER_ARM64,
+    FC_FILTER_DELTA
+};
+
+// Result of the sampling pre-pass and the codec picked from it
+typedef struct {
+    double entropy;        // Shannon entropy of all sampled bytes, bits/byte
+    int windows;           // Windows sampled
+    int dense_windows;     // Windows that look incompressible on their own
+    int known_format;      // Input starts with a compressed-format signature
+    int filter;            // enum fc_filter: executable header or numeric records
+    int delta_dist;        // Record stride for FC_FILTER_DELTA
+    int codec;             // enum fc_codec
+    int level;
+} sample_report;
+
+double byte_entropy(const unsigned char *buf, size_t len);
+int sample_source(FILE *source, unsigned char *head, size_t *head_len, sample_report *report);
+int sample_filter(FILE *source, int *delta_dist);
+void choose_codec(sample_report *report);
+
+#endif // ENTROPY_H
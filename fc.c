@@ -0,0 +1,482 @@
+// Command-line front end to the codecs, for use without the GUI:
+//
+//   fc -c [-z codec] [-l level] [-T threads] [-M bytes] [-D | -Y dict] [-R seconds] [-r MB/s] [-P] [-j stats] [-f] [-o out] [file]
+//   fc -d [-z codec] [-Y dict] [-P] [-j stats] [-o out] [file]
+//   fc -t [-z codec] [-T threads] [-Y dict] file
+//   fc -a [-z codec] [-l level] [-T threads] [-U previous] -o out file
+//   fc -b [-T threads] [-M bytes] [-Y dict] dir
+//   fc -y [-S bytes] -o dict sample...
+//
+// Reads file (or stdin) and writes out (or stdout), so it works as a
+// filter: pg_dump | fc -c | ssh host 'fc -d > dump.sql'. Output is
+// written behind the codec and piped input read ahead of it (aio.h).
+//
+// Codecs: auto (default) samples the input and picks one; store, zlib,
+// bz2, lzma and the other registered backends (codec.h, e.g. zstd, lz4)
+// force a codec, and -l / -T apply to those. All of these write
+// an FCMP header, and fc -d reads any of them back. chain is the
+// zlib -> LZMA stream of the GUI's .lzma archive, with no header;
+// fc -d -z chain decodes one. With -d, zlib, bz2 and lzma decode a bare
+// stream of that format (a .bz2 from the GUI, or any .xz file), as do
+// the other backends.
+//
+// race (race.h) compresses with every codec at its strongest settings
+// at once, cancelling the ones clearly losing, and keeps the smallest
+// output, which store keeps from ever being larger than the input plus
+// the header; it prints what each candidate cost. -R limits it to about
+// that many seconds, after which only the leader carries on.
+//
+// -r compresses with zlib on -T threads, steering the level block by
+// block to keep up with that many MB/s of input, and prints how many
+// blocks each level compressed and the throughput reached.
+//
+// -D deduplicates repeated chunks before compressing (dedup.h); with
+// auto it uses zlib, since the sampler cannot see the deduplicated data.
+//
+// -t checks that file decodes, writing nothing. Seekable archives are
+// checked block by block on -T threads against their block checksums,
+// with the offsets of corrupt blocks and the throughput reported.
+//
+// -a writes a seekable block archive (archive.h), which fc -d also
+// reads. It is written to out.tmp and renamed. Progress is checkpointed
+// to disk as it goes, so if fc is killed, running the same command again
+// carries on from the last checkpoint; stale temp files next to out are
+// removed. With -U, blocks unchanged since the previous archive of the
+// file are copied from it rather than compressed again (not resumable);
+// out may be previous itself.
+//
+// -b compresses every file under dir to <file>.fc in parallel and prints
+// the aggregate throughput.
+//
+// -M caps the memory the encoders may use at once (budget.h), e.g. -M 2G:
+// a file or batch worker that would not fit runs on fewer threads or at
+// a lower level, or waits for memory. -b then prints the peak.
+//
+// -y trains a preset dictionary (dict.h) of -S bytes from sample files.
+// -Y uses one: zlib (the default with auto) and lzma prime their history
+// with it, and the same dictionary must be given to fc -d.
+//
+// -P prints progress to stderr every second, and -j writes a JSON run
+// summary (stats.h) to a file, or to stderr for -: bytes, wall and CPU
+// time, and for each stage the time stalled on input and output. The
+// chain codec reports its zlib and LZMA stages separately.
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "aio.h"
+#include "archive.h"
+#include "batch.h"
+#include "budget.h"
+#include "codec.h"
+#include "compress.h"
+#include "race.h"
+
+#define CODEC_AUTO -1
+#define CODEC_CHAIN -2
+#define CODEC_RACE -3
+#define PROGRESS_INTERVAL 1.0
+
+static void usage(const char *prog) {
+    const codec_t *c;
+
+    fprintf(stderr,
+            "usage: %s -c [-z codec] [-l level] [-T threads] [-M bytes] [-D | -Y dict] [-R seconds] [-r MB/s] [-P] [-j stats] [-f] [-o out] [file]\n"
+            "       %s -d [-z codec] [-Y dict] [-P] [-j stats] [-o out] [file]\n"
+            "       %s -t [-z codec] [-T threads] [-Y dict] file\n"
+            "       %s -a [-z codec] [-l level] [-T threads] [-U previous] -o out file\n"
+            "       %s -b [-T threads] [-M bytes] [-Y dict] dir\n"
+            "       %s -y [-S bytes] -o dict sample...\n"
+            "codecs: auto chain race",
+            prog, prog, prog, prog, prog, prog);
+    for (int i = 0; (c = codec_at(i)) != NULL; i++)
+        fprintf(stderr, " %s", c->name);
+    fprintf(stderr, "\n");
+}
+
+static int parse_codec(const char *name) {
+    const codec_t *c = codec_find(name);
+
+    if (strcmp(name, "auto") == 0) return CODEC_AUTO;
+    if (strcmp(name, "chain") == 0) return CODEC_CHAIN;
+    if (strcmp(name, "race") == 0) return CODEC_RACE;
+    return c ? c->id : -100;
+}
+
+// Parses a byte count with an optional K, M or G suffix; 0 if invalid
+static size_t parse_size(const char *text) {
+    char *end;
+    double n = strtod(text, &end);
+
+    switch (*end) {
+    case 'k': case 'K': n *= 1024; end++; break;
+    case 'm': case 'M': n *= 1024 * 1024; end++; break;
+    case 'g': case 'G': n *= 1024.0 * 1024 * 1024; end++; break;
+    }
+    return *end || n < 1 ? 0 : (size_t)n;
+}
+
+static void print_progress(const fc_stats *stats, void *data) {
+    long long in = 0, out = 0;
+    int n = __atomic_load_n(&stats->nstages, __ATOMIC_ACQUIRE);
+
+    (void)data;
+    if (n == 0) return;
+    in = __atomic_load_n(&stats->stages[0].bytes_in, __ATOMIC_RELAXED);
+    out = __atomic_load_n(&stats->stages[n - 1].bytes_out, __ATOMIC_RELAXED);
+    fprintf(stderr, "\r%.1f MB in, %.1f MB out", in / 1e6, out / 1e6);
+    if (stats->wall > 0)
+        fprintf(stderr, " in %.2f s (%.1f MB/s, %s-bound)\n", stats->wall, in / stats->wall / 1e6,
+                stats->io_bound ? "I/O" : "CPU");
+}
+
+// Name of the single stage fc runs for the options given
+static const char *stage_name(int mode, int codec, int dedup, const fc_dict *dict) {
+    if (mode == 'c' && dedup) return "dedup";
+    if (mode == 'c' && dict) return "dict";
+    if (codec == CODEC_AUTO) return mode == 'c' ? "auto" : "decode";
+    if (codec == CODEC_RACE) return "race";
+    return codec_by_id(codec)->name;
+}
+
+// Builds a seekable archive of in_name: resumably, or reusing the blocks
+// of prev_name that have not changed
+static int make_archive(const char *in_name, const char *out_name, const char *prev_name,
+                        int codec, int level, int threads) {
+    char tmp_name[4096];
+    archive_t *prev = NULL;
+    archive_update_report report;
+    archive_resume_report resumed;
+    FILE *source, *dest;
+    int failed;
+
+    if (codec == CODEC_AUTO) codec = FC_ZLIB;
+    if (codec == CODEC_CHAIN) {
+        fprintf(stderr, "Error: archives need a block codec\n");
+        return 2;
+    }
+    if (level < 0) level = codec_by_id(codec)->default_level;
+    if (!prev_name) {
+        int ret = archive_create_file(in_name, out_name, codec, level, 0, threads, &resumed);
+        if (resumed.orphans > 0) fprintf(stderr, "%d stale temp files removed\n", resumed.orphans);
+        if (resumed.resumed_blocks > 0)
+            fprintf(stderr, "%llu blocks, %llu resumed (%.1f MB), %llu checkpoints\n", resumed.blocks,
+                    resumed.resumed_blocks, resumed.resumed_bytes / 1e6, resumed.checkpoints);
+        return ret == 0 ? 0 : 1;
+    }
+    if (snprintf(tmp_name, sizeof(tmp_name), "%s%s", out_name, ARCHIVE_TMP_SUFFIX) >= (int)sizeof(tmp_name))
+        return 2;
+
+    source = fopen(in_name, "rb");
+    if (!source) {
+        fprintf(stderr, "Error: cannot open %s: %s\n", in_name, strerror(errno));
+        return 1;
+    }
+    if (!(prev = archive_open(prev_name))) {
+        fclose(source);
+        return 1;
+    }
+    dest = fopen(tmp_name, "wb");
+    if (!dest) {
+        fprintf(stderr, "Error: cannot create %s: %s\n", tmp_name, strerror(errno));
+        fclose(source);
+        archive_close(prev);
+        return 1;
+    }
+
+    failed = archive_update(source, prev, dest, codec, level, threads, &report) != 0;
+    if (!failed)
+        fprintf(stderr, "%llu blocks, %llu reused (%.1f MB), %.1f MB compressed\n", report.blocks,
+                report.reused_blocks, report.reused_bytes / 1e6, report.compressed_bytes / 1e6);
+    fclose(source);
+    archive_close(prev);
+    if (fclose(dest) != 0) failed = 1;
+    if (!failed && rename(tmp_name, out_name) != 0) {
+        fprintf(stderr, "Error: cannot rename %s: %s\n", tmp_name, strerror(errno));
+        failed = 1;
+    }
+    if (failed) remove(tmp_name);
+    return failed ? 1 : 0;
+}
+
+static int verify_archive(archive_t *archive, int threads) {
+    archive_verify_report report;
+    int ret = archive_verify(archive, threads, &report);
+
+    fprintf(stderr, "%llu blocks, %llu corrupt: %.1f MB checked in %.2f s (%.1f MB/s)\n", report.blocks,
+            report.corrupt, report.bytes_out / 1e6, report.seconds, report.mbps);
+    return ret == 0 ? 0 : 1;
+}
+
+static void print_race(const race_report *report) {
+    for (int i = 0; i < report->count; i++) {
+        const race_result *r = &report->results[i];
+        fprintf(stderr, "%-5s -l %-2d %-9s %8.1f MB in, %11lld bytes out, %7.2f s CPU", codec_by_id(r->codec)->name,
+                r->level, race_state_name(r->state), r->bytes_in / 1e6, r->bytes_out, r->cpu);
+        if (r->state == RACE_LOST || r->state == RACE_TIMED_OUT)
+            fprintf(stderr, " (whole input: ~%lld bytes, ~%.2f s)", r->projected_out, r->projected_cpu);
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, "%.1f MB raced in %.2f s\n", report->bytes_in / 1e6, report->seconds);
+}
+
+static void print_adaptive(const zlib_adaptive_stats *report, double target) {
+    fprintf(stderr, "zlib levels:");
+    for (int l = 1; l <= 9; l++)
+        if (report->level_blocks[l]) fprintf(stderr, " %d:%llu", l, report->level_blocks[l]);
+    fprintf(stderr, " blocks; final level %d, %.1f MB/s (target %.1f)\n", report->final_level, report->mbps,
+            target);
+}
+
+static int is_regular(FILE *file) {
+    struct stat st;
+    return fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// Whether a file starts with the seekable archive magic; rewinds it
+static int is_archive(FILE *file) {
+    char magic[4];
+    int found = fread(magic, 1, 4, file) == 4 && memcmp(magic, ARCHIVE_MAGIC, 4) == 0;
+
+    rewind(file);
+    return found;
+}
+
+int main(int argc, char **argv) {
+    int mode = 0, codec = CODEC_AUTO, level = -1, threads = 0, force = 0, dedup = 0, opt;
+    const char *out_name = NULL, *in_name = NULL, *dict_name = NULL, *json_name = NULL;
+    const char *prev_name = NULL;
+    archive_t *archive = NULL;
+    FILE *source = stdin, *dest = stdout, *in, *out, *io_in = NULL, *io_out;
+    fc_stats stats;
+    stage_stats *st = NULL;
+    int show_progress = 0, verify = 0;
+    fc_dict *dict = NULL;
+    size_t dict_size = DICT_SIZE, mem_limit = 0;
+    double race_time = 0, target_mbps = 0;
+    race_report race;
+    zlib_adaptive_stats adaptive;
+    int failed;
+
+    while ((opt = getopt(argc, argv, "cdtabyz:l:T:M:DY:S:U:R:r:Pj:fo:h")) != -1) {
+        switch (opt) {
+        case 'c':
+        case 'd':
+        case 'a':
+        case 'b':
+        case 'y':
+            mode = opt;
+            break;
+        case 'z':
+            codec = parse_codec(optarg);
+            if (codec == -100) {
+                fprintf(stderr, "Error: unknown codec %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 't':
+            mode = 'd';
+            verify = 1;
+            break;
+        case 'l': level = atoi(optarg); break;
+        case 'T': threads = atoi(optarg); break;
+        case 'M':
+            if (!(mem_limit = parse_size(optarg))) {
+                fprintf(stderr, "Error: bad memory limit %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'D': dedup = 1; break;
+        case 'Y': dict_name = optarg; break;
+        case 'S': dict_size = strtoul(optarg, NULL, 10); break;
+        case 'U': prev_name = optarg; break;
+        case 'R': race_time = strtod(optarg, NULL); break;
+        case 'r':
+            if ((target_mbps = strtod(optarg, NULL)) <= 0) {
+                fprintf(stderr, "Error: bad target throughput %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'P': show_progress = 1; break;
+        case 'j': json_name = optarg; break;
+        case 'f': force = 1; break;
+        case 'o': out_name = optarg; break;
+        default: usage(argv[0]); return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (mode == 'y') {
+        if (!out_name || optind == argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        dest = fopen(out_name, "wb");
+        if (!dest) {
+            fprintf(stderr, "Error: cannot create %s: %s\n", out_name, strerror(errno));
+            return 1;
+        }
+        failed = dict_train((const char *const *)argv + optind, argc - optind, dict_size, dest) != 0;
+        if (fclose(dest) != 0) failed = 1;
+        if (failed) remove(out_name);
+        return failed ? 1 : 0;
+    }
+    if (!mode || optind < argc - 1) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (optind < argc && strcmp(argv[optind], "-") != 0) in_name = argv[optind];
+    if (verify) out_name = "/dev/null";
+    if (mode == 'd' && codec == FC_STORE) codec = CODEC_AUTO;
+    if (threads < 0 || level > codec_by_id(codec >= 0 ? codec : FC_ZLIB)->max_level) {
+        fprintf(stderr, "Error: level above the codec's maximum, or threads < 0\n");
+        return 2;
+    }
+
+    if (target_mbps > 0 && (mode != 'c' || dedup || dict_name || (codec != FC_ZLIB && codec != CODEC_AUTO))) {
+        fprintf(stderr, "Error: -r only compresses with zlib, without -D or -Y\n");
+        return 2;
+    }
+    if (target_mbps > 0) codec = FC_ZLIB;
+    if ((mode != 'c' || dedup || dict_name) && codec == CODEC_RACE) {
+        fprintf(stderr, "Error: race only compresses, without -D or -Y\n");
+        return 2;
+    }
+    if (mode == 'c' && (dedup || dict_name) && codec == CODEC_CHAIN) {
+        fprintf(stderr, "Error: -D and -Y need a codec with an FCMP header\n");
+        return 2;
+    }
+    if (dedup && dict_name) {
+        fprintf(stderr, "Error: -D and -Y cannot be combined\n");
+        return 2;
+    }
+    if (dict_name && !(dict = dict_load(dict_name))) return 1;
+    budget_set(mem_limit);
+
+    if (mode == 'a') {
+        if (!in_name || !out_name) {
+            usage(argv[0]);
+            return 2;
+        }
+        return make_archive(in_name, out_name, prev_name, codec, level, threads);
+    }
+
+    if (mode == 'b') {
+        batch_report report;
+        int ret;
+
+        if (!in_name) {
+            usage(argv[0]);
+            return 2;
+        }
+        ret = batch_compress(in_name, threads, dict, &report);
+        fprintf(stderr, "%llu files, %llu failed, %llu jobs, %llu steals: %.1f MB -> %.1f MB in %.2f s (%.1f MB/s)\n",
+                report.files, report.failed, report.jobs, report.steals, report.bytes_in / 1e6,
+                report.bytes_out / 1e6, report.seconds, report.mbps);
+        if (mem_limit) {
+            budget_report mem;
+            budget_stats(&mem);
+            fprintf(stderr, "memory: peak %.1f MB of %.1f MB, %llu downgraded, %llu waited, %llu over\n",
+                    mem.peak / 1e6, mem.limit / 1e6, mem.downgraded, mem.waits, mem.over);
+        }
+        dict_free(dict);
+        return ret == 0 ? 0 : 1;
+    }
+
+    if (in_name) {
+        source = fopen(in_name, "rb");
+        if (!source) {
+            fprintf(stderr, "Error: cannot open %s: %s\n", in_name, strerror(errno));
+            return 1;
+        }
+        if (mode == 'd' && codec == CODEC_AUTO && is_archive(source) && !(archive = archive_open(in_name)))
+            return 1;
+        if (archive && verify) {
+            int ret = verify_archive(archive, threads);
+            archive_close(archive);
+            fclose(source);
+            return ret;
+        }
+    }
+    if (out_name && strcmp(out_name, "-") != 0) {
+        dest = fopen(out_name, "wb");
+        if (!dest) {
+            fprintf(stderr, "Error: cannot create %s: %s\n", out_name, strerror(errno));
+            return 1;
+        }
+    } else if (mode == 'c' && !force && isatty(fileno(stdout))) {
+        fprintf(stderr, "Error: refusing to write compressed data to a terminal (use -f)\n");
+        return 1;
+    }
+
+    // Always instrumented: the stages also collect codec errors (stats_fail)
+    stats_init(&stats, show_progress ? print_progress : NULL, NULL, PROGRESS_INTERVAL);
+    if (codec != CODEC_CHAIN) st = stats_stage(&stats, stage_name(mode, codec, dedup, dict));
+
+    // Overlap reads and writes with the codec (aio.h). Regular input is
+    // left alone: the codecs map it and prefetch the mapping themselves.
+    if (!archive && !is_regular(source)) io_in = stream_prefetch(source);
+    io_out = stream_writebehind(dest);
+    stats_stage_begin(st, io_in ? io_in : source, io_out ? io_out : dest, &in, &out);
+
+    if (mode == 'c') {
+        if (dict)
+            compress_with_dict(in, out, codec == CODEC_AUTO ? FC_ZLIB : codec, level, dict);
+        else if (dedup)
+            compress_dedup(in, out, codec == CODEC_AUTO ? FC_ZLIB : codec, level, threads);
+        else if (codec == CODEC_AUTO)
+            compress_auto(in, out);
+        else if (codec == CODEC_CHAIN)
+            compress_chain_stats(in, out, &stats);
+        else if (codec == CODEC_RACE) {
+            if (compress_race(in, out, NULL, 0, race_time, &race) != 0) stats_fail();
+            print_race(&race);
+        } else if (target_mbps > 0) {
+            compress_codec_adaptive(in, out, threads, target_mbps, &adaptive);
+            print_adaptive(&adaptive, target_mbps);
+        } else
+            compress_codec(in, out, codec, level, threads);
+    } else {
+        switch (codec) {
+        case CODEC_CHAIN: decompress_chain_stats(in, out, &stats); break;
+        case FC_ZLIB: decompress_zlib(in, out); break;
+        case FC_BZ2: decompress_bz2(in, out); break;
+        case FC_LZMA: decompress_lzma_mt(in, out, threads); break;
+        case CODEC_AUTO:
+            if (!archive)
+                decompress_with_dict(in, out, dict);
+            else if (archive_extract_threads(archive, out, threads) != 0)
+                stats_fail();
+            break;
+        default: codec_decompress(codec_by_id(codec), in, out, threads); break;
+        }
+    }
+    failed = stats_stage_end(st, in, out) != 0 || stats.error;
+    if (io_in && fclose(io_in) != 0) failed = 1;
+    if (io_out && fclose(io_out) != 0) failed = 1;
+
+    // The codecs report their own errors; a short read or write shows here
+    if (ferror(source) || fflush(dest) != 0 || ferror(dest)) failed = 1;
+    if (failed) fprintf(stderr, "Error: %s failed\n", mode == 'c' ? "compression" : "decompression");
+    if (source != stdin) fclose(source);
+    if (dest != stdout && fclose(dest) != 0) failed = 1;
+    dict_free(dict);
+    archive_close(archive);
+
+    stats.error = failed;
+    stats_finish(&stats);
+    if (json_name && strcmp(json_name, "-") == 0) {
+        stats_json(&stats, stderr);
+    } else if (json_name) {
+        FILE *json = fopen(json_name, "w");
+        if (json) {
+            stats_json(&stats, json);
+            if (fclose(json) != 0) failed = 1;
+        } else {
+            fprintf(stderr, "Error: cannot create %s: %s\n", json_name, strerror(errno));
+            failed = 1;
+        }
+    }
+    stats_destroy(&stats);
+    return failed ? 1 : 0;
+}
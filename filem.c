@@ -4,6 +4,7 @@
 #include <dirent.h>
 #include <string.h>
 #include "compress.h"
+#include "jobs.h"
 #include "tmgui.h"
 
 #define MAX_FILENAME_LEN 256
@@ -85,11 +86,21 @@ void compress_selected_file(GtkWidget *widget, gpointer data) {
         char filepath[512];
         snprintf(filepath, sizeof(filepath), "%s/%s", fm_data->current_dir, filename);
 
-        // Call the compress function
-        compress_file("compress", filepath);
+        // Queue the compression; the jobs panel shows its progress
+        submit_compress_job(filepath);
+        g_free(filename);
     }
 }
 
+// Function called when a background job ends: show the new archives
+void on_job_done(CompressJob *job, gpointer data) {
+    FileManagerData *fm_data = (FileManagerData *)data;
+
+    if (job->state == JOB_DONE)
+        g_print("File '%s' compressed successfully.\n", job->path);
+    list_files(fm_data);
+}
+
 // Function to handle file creation
 void create_new_file(GtkWidget *widget, gpointer data) {
     FileManagerData *fm_data = (FileManagerData *)data;
@@ -318,6 +329,9 @@ void activate(GtkApplication *app, gpointer user_data) {
     g_signal_connect(open_tmgui_button, "clicked", G_CALLBACK(open_task_manager), NULL);
     gtk_box_pack_start(GTK_BOX(vbox), open_tmgui_button, FALSE, FALSE, 0);
 
+    // Background compression jobs
+    gtk_box_pack_start(GTK_BOX(vbox), create_jobs_panel(on_job_done, fm_data), FALSE, FALSE, 0);
+
     apply_css();
 
     gtk_widget_show_all(window);
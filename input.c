@@ -0,0 +1,133 @@
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "input.h"
+#include "stats.h"
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Faults in a window of the mapping, so the wait for the disk is
+// measured here rather than hidden in the codec's time
+static void touch(const unsigned char *data, size_t len) {
+    long page = sysconf(_SC_PAGESIZE);
+    volatile unsigned char sink = 0;
+
+    for (size_t i = 0; i < len; i += page) sink ^= data[i];
+    if (len) sink ^= data[len - 1];
+    (void)sink;
+}
+
+// Function to map the rest of a regular file, or set up streaming reads
+void input_open(input_t *in, FILE *file) {
+    struct stat st;
+    long page = sysconf(_SC_PAGESIZE);
+
+    memset(in, 0, offsetof(input_t, buf));
+    in->file = file;
+    in->start = ftell(file);
+    in->tracked = in->start >= 0 && stats_input_tracked(file);
+
+    if (in->start < 0 || fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_size - in->start < INPUT_MAP_MIN) {
+        in->borrower = stream_borrowable(file);
+        return;
+    }
+
+    off_t offset = in->start & ~(off_t)(page - 1);
+    size_t map_len = st.st_size - offset;
+    void *base = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fileno(file), offset);
+    if (base == MAP_FAILED) return;
+
+    madvise(base, map_len, MADV_SEQUENTIAL);
+    in->base = base;
+    in->map_len = map_len;
+    in->data = (const unsigned char *)base + (in->start - offset);
+    in->len = st.st_size - in->start;
+}
+
+int input_mapped(const input_t *in) {
+    return in->base != NULL;
+}
+
+// Bytes left in a mapped input; unknown (0) when streaming
+size_t input_remaining(const input_t *in) {
+    return in->base ? in->len - in->pos : 0;
+}
+
+// Returns 1 once every byte of the input has been handed out
+int input_eof(const input_t *in) {
+    if (in->borrower) return in->ended;
+    return in->base ? in->pos == in->len : feof(in->file);
+}
+
+// Returns 1 if reading the input failed, which input_next reports as its end
+int input_error(const input_t *in) {
+    return !in->base && ferror(in->file);
+}
+
+// Function to get the next piece of input: up to max bytes straight from
+// the mapping, or up to INPUT_CHUNK bytes read into the internal buffer.
+// Returns 0 at end of input. Input that a stats stage reads unwrapped is
+// reported to it as it is consumed.
+size_t input_next(input_t *in, const unsigned char **data, size_t max) {
+    double start = in->tracked ? now_seconds() : 0;
+
+    if (in->borrower) {
+        size_t n = stream_borrow(in->borrower, data, max);
+        if (n == 0) in->ended = 1;
+        return n;
+    }
+    if (!in->base) {
+        size_t n = fread(in->buf, 1, max < INPUT_CHUNK ? max : INPUT_CHUNK, in->file);
+        *data = in->buf;
+        in->pos += n;
+        if (in->tracked) stats_input(in->file, in->start + (long)in->pos, now_seconds() - start);
+        return n;
+    }
+
+    size_t n = in->len - in->pos;
+    if (n > max) n = max;
+    *data = in->data + in->pos;
+    in->pos += n;
+
+    // Prefetch the next window and drop pages two windows behind, so the
+    // mapping does not pin the whole file in our resident set
+    size_t mapped_pos = (in->data - in->base) + in->pos;
+    if (in->pos < in->len) {
+        size_t ahead = in->map_len - mapped_pos < INPUT_WINDOW ? in->map_len - mapped_pos : INPUT_WINDOW;
+        long page = sysconf(_SC_PAGESIZE);
+        size_t aligned = mapped_pos & ~(size_t)(page - 1);
+        madvise(in->base + aligned, ahead + (mapped_pos - aligned), MADV_WILLNEED);
+    }
+    if (mapped_pos > in->advised + 3 * (size_t)INPUT_WINDOW) {
+        size_t release = mapped_pos - 2 * (size_t)INPUT_WINDOW - in->advised;
+        release -= release % sysconf(_SC_PAGESIZE);
+        madvise(in->base + in->advised, release, MADV_DONTNEED);
+        in->advised += release;
+    }
+    if (in->tracked) {
+        touch(*data, n);
+        stats_input(in->file, in->start + (long)in->pos, now_seconds() - start);
+    }
+    return n;
+}
+
+// Function to release the mapping and leave the FILE positioned just past
+// the bytes the codec consumed; a pipe gets back what it lent unconsumed
+void input_close(input_t *in, size_t unconsumed) {
+    if (in->borrower) {
+        stream_unborrow(in->borrower, unconsumed);
+        in->borrower = NULL;
+    }
+    if (!in->base) return;
+    munmap(in->base, in->map_len);
+    fseek(in->file, in->start + (long)(in->pos - unconsumed), SEEK_SET);
+    in->base = NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdio.h>
+#include "pipeline.h"
+
+#define INPUT_CHUNK 16384            // Read size when streaming
+#define INPUT_WINDOW (8 << 20)       // Window handed to codecs when mapped
+#define INPUT_MAP_MIN (64 * 1024)    // Smaller inputs are cheaper to read
+
+// Codec input. Regular files are memory-mapped from the current position
+// and handed to the codec in large windows without copying; in-memory
+// pipes lend their buffers in place (pipeline.h); other streams fall back
+// to fread into a small buffer.
+typedef struct {
+    FILE *file;
+    unsigned char *base;             // Page-aligned mapping, NULL when streaming
+    size_t map_len;
+    const unsigned char *data;       // First byte at the starting file position
+    size_t len, pos;
+    long start;
+    size_t advised;                  // Mapped bytes already released behind us
+    int tracked;                     // Progress goes to the stage reading it (stats.h)
+    stream_borrower *borrower;       // Borrowing from a pipe, else NULL
+    int ended;                       // The borrower has run dry
+    unsigned char buf[INPUT_CHUNK];
+} input_t;
+
+void input_open(input_t *in, FILE *file);
+size_t input_next(input_t *in, const unsigned char **data, size_t max);
+int input_mapped(const input_t *in);
+size_t input_remaining(const input_t *in);
+int input_eof(const input_t *in);
+int input_error(const input_t *in);
+void input_close(input_t *in, size_t unconsumed);
+
+#endif // INPUT_H
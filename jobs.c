@@ -0,0 +1,257 @@
+#include "jobs.h"
+#include <gtk/gtk.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "aio.h"
+#include "budget.h"
+#include "compress.h"
+
+enum {
+    COL_FILE,
+    COL_STATUS,
+    COL_PROGRESS,
+    COL_RATE,
+    COL_ETA,
+    COL_JOB,
+    N_COLS
+};
+
+static GThreadPool *job_pool;
+static GtkListStore *job_store;
+static GtkWidget *job_view;
+static JobDoneFunc job_done_func;
+static gpointer job_done_data;
+
+static const char *state_names[] = { "Queued", "Running", "Done", "Failed", "Cancelled" };
+
+static int job_state(CompressJob *job) {
+    return __atomic_load_n(&job->state, __ATOMIC_ACQUIRE);
+}
+
+static void set_job_state(CompressJob *job, int state) {
+    __atomic_store_n(&job->state, state, __ATOMIC_RELEASE);
+}
+
+// Main loop callback: the worker has finished with the job, which may
+// be freed from now on
+static gboolean job_finished(gpointer data) {
+    CompressJob *job = (CompressJob *)data;
+
+    job->reported = 1;
+    if (job_done_func) job_done_func(job, job_done_data);
+    return G_SOURCE_REMOVE;
+}
+
+// Worker thread: run the compress cascade over a counted stream
+static void run_job(gpointer data, gpointer user_data) {
+    CompressJob *job = (CompressJob *)data;
+    FILE *file, *prefetch = NULL, *source = NULL;
+    int state, ret;
+
+    (void)user_data;
+    job->started = g_get_monotonic_time();
+    if (__atomic_load_n(&job->progress.cancel, __ATOMIC_RELAXED)) {
+        job->finished = job->started;
+        set_job_state(job, JOB_CANCELLED);
+        g_idle_add(job_finished, job);
+        return;
+    }
+    set_job_state(job, JOB_RUNNING);
+
+    // The counted stream hides the file from the codecs' mapping, so the
+    // reads under it are overlapped instead
+    file = fopen(job->path, "rb");
+    if (file) {
+        prefetch = stream_prefetch(file);
+        source = stream_counted(prefetch ? prefetch : file, &job->progress);
+    }
+    if (!source) {
+        if (prefetch) fclose(prefetch);
+        if (file) fclose(file);
+        printf("Error: Cannot open file %s\n", job->path);
+        state = JOB_FAILED;
+    } else {
+        ret = compress_file_stream(source, job->path);
+        if (prefetch) fclose(file);     // Closing the prefetch stream left it open
+        if (__atomic_load_n(&job->progress.cancel, __ATOMIC_RELAXED))
+            state = JOB_CANCELLED;
+        else if (ret != 0 || __atomic_load_n(&job->progress.error, __ATOMIC_RELAXED))
+            state = JOB_FAILED;
+        else
+            state = JOB_DONE;
+    }
+
+    job->finished = g_get_monotonic_time();
+    set_job_state(job, state);
+    g_idle_add(job_finished, job);
+}
+
+static void format_eta(char *buf, size_t size, double seconds) {
+    int s = (int)(seconds + 0.5);
+
+    if (s >= 3600)
+        snprintf(buf, size, "%d:%02d:%02d", s / 3600, s / 60 % 60, s % 60);
+    else
+        snprintf(buf, size, "%d:%02d", s / 60, s % 60);
+}
+
+// Timer callback: refresh progress, throughput and ETA of every row
+static gboolean refresh_jobs(gpointer data) {
+    GtkTreeModel *model = GTK_TREE_MODEL(job_store);
+    GtkTreeIter iter;
+    gboolean valid;
+    gint64 now = g_get_monotonic_time();
+
+    (void)data;
+    for (valid = gtk_tree_model_get_iter_first(model, &iter); valid;
+         valid = gtk_tree_model_iter_next(model, &iter)) {
+        CompressJob *job;
+        char rate[32] = "", eta[32] = "";
+        int state, percent = 0;
+        long long bytes;
+        double elapsed, mbps = 0;
+
+        gtk_tree_model_get(model, &iter, COL_JOB, &job, -1);
+        state = job_state(job);
+        bytes = __atomic_load_n(&job->progress.bytes, __ATOMIC_RELAXED);
+        if (job->total > 0) percent = (int)(bytes * 100 / job->total);
+        if (percent > 100) percent = 100;
+
+        if (state != JOB_QUEUED) {
+            elapsed = ((state == JOB_RUNNING ? now : job->finished) - job->started) / 1e6;
+            if (elapsed > 0) mbps = bytes / elapsed / 1e6;
+            snprintf(rate, sizeof(rate), "%.1f MB/s", mbps);
+        }
+        if (state == JOB_RUNNING && mbps > 0)
+            format_eta(eta, sizeof(eta), (job->total - bytes) / (mbps * 1e6));
+        else if (state == JOB_DONE)
+            percent = 100;
+
+        gtk_list_store_set(job_store, &iter,
+                           COL_STATUS, state_names[state],
+                           COL_PROGRESS, percent,
+                           COL_RATE, rate,
+                           COL_ETA, eta,
+                           -1);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+// Function to queue a file for compression; returns immediately
+void submit_compress_job(const char *path) {
+    CompressJob *job = g_malloc0(sizeof(CompressJob));
+    GtkTreeIter iter;
+    struct stat st;
+
+    snprintf(job->path, sizeof(job->path), "%s", path);
+    job->total = stat(path, &st) == 0 ? st.st_size : 0;
+    set_job_state(job, JOB_QUEUED);
+
+    gtk_list_store_append(job_store, &iter);
+    gtk_list_store_set(job_store, &iter,
+                       COL_FILE, path,
+                       COL_STATUS, state_names[JOB_QUEUED],
+                       COL_PROGRESS, 0,
+                       COL_RATE, "",
+                       COL_ETA, "",
+                       COL_JOB, job,
+                       -1);
+    g_thread_pool_push(job_pool, job, NULL);
+}
+
+// Function to handle the "Cancel Job" button: the worker's next read
+// fails and the cascade stops
+void on_cancel_job_clicked(GtkWidget *widget, gpointer data) {
+    GtkTreeSelection *selection;
+    GtkTreeModel *model;
+    GtkTreeIter iter;
+    CompressJob *job;
+
+    (void)widget;
+    (void)data;
+    selection = gtk_tree_view_get_selection(GTK_TREE_VIEW(job_view));
+    if (gtk_tree_selection_get_selected(selection, &model, &iter)) {
+        gtk_tree_model_get(model, &iter, COL_JOB, &job, -1);
+        __atomic_store_n(&job->progress.cancel, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Function to handle the "Clear Finished" button. A job is only removed
+// once job_finished has run: its final state is set before that callback
+// is queued, and the callback still uses the job.
+void on_clear_jobs_clicked(GtkWidget *widget, gpointer data) {
+    GtkTreeModel *model = GTK_TREE_MODEL(job_store);
+    GtkTreeIter iter;
+    gboolean valid;
+
+    (void)widget;
+    (void)data;
+    valid = gtk_tree_model_get_iter_first(model, &iter);
+    while (valid) {
+        CompressJob *job;
+        gtk_tree_model_get(model, &iter, COL_JOB, &job, -1);
+        if (job->reported) {
+            valid = gtk_list_store_remove(job_store, &iter);
+            g_free(job);
+        } else {
+            valid = gtk_tree_model_iter_next(model, &iter);
+        }
+    }
+}
+
+// Function to create the job panel and the worker pool. on_done runs on
+// the main thread after each job ends.
+GtkWidget *create_jobs_panel(JobDoneFunc on_done, gpointer data) {
+    GtkWidget *vbox, *hbox, *scrolled_window, *cancel_button, *clear_button;
+    GtkCellRenderer *renderer;
+    GtkTreeViewColumn *col;
+    const char *column_titles[] = { "File", "Status", "Progress", "Throughput", "ETA" };
+    int threads = g_get_num_processors();
+
+    job_done_func = on_done;
+    job_done_data = data;
+    if (threads > JOBS_MAX_RUNNING) threads = JOBS_MAX_RUNNING;
+    // Each cascade's LZMA encoder would otherwise size itself to a quarter
+    // of RAM, so a few jobs at once could exhaust it
+    budget_set(budget_default_limit());
+    job_pool = g_thread_pool_new(run_job, NULL, threads, FALSE, NULL);
+
+    job_store = gtk_list_store_new(N_COLS, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_INT,
+                                   G_TYPE_STRING, G_TYPE_STRING, G_TYPE_POINTER);
+    job_view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(job_store));
+    g_object_unref(job_store);
+
+    for (int i = 0; i < COL_JOB; i++) {
+        if (i == COL_PROGRESS) {
+            renderer = gtk_cell_renderer_progress_new();
+            col = gtk_tree_view_column_new_with_attributes(column_titles[i], renderer, "value", i, NULL);
+            gtk_tree_view_column_set_expand(col, TRUE);
+        } else {
+            renderer = gtk_cell_renderer_text_new();
+            col = gtk_tree_view_column_new_with_attributes(column_titles[i], renderer, "text", i, NULL);
+        }
+        gtk_tree_view_append_column(GTK_TREE_VIEW(job_view), col);
+    }
+
+    scrolled_window = gtk_scrolled_window_new(NULL, NULL);
+    gtk_widget_set_size_request(scrolled_window, -1, 150);
+    gtk_container_add(GTK_CONTAINER(scrolled_window), job_view);
+
+    cancel_button = gtk_button_new_with_label("Cancel Job");
+    g_signal_connect(cancel_button, "clicked", G_CALLBACK(on_cancel_job_clicked), NULL);
+    clear_button = gtk_button_new_with_label("Clear Finished");
+    g_signal_connect(clear_button, "clicked", G_CALLBACK(on_clear_jobs_clicked), NULL);
+
+    hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_pack_start(GTK_BOX(hbox), cancel_button, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(hbox), clear_button, TRUE, TRUE, 0);
+
+    vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+    gtk_box_pack_start(GTK_BOX(vbox), scrolled_window, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), hbox, FALSE, FALSE, 0);
+
+    g_timeout_add(JOBS_REFRESH_MS, refresh_jobs, NULL);
+    return vbox;
+}
@@ -0,0 +1,39 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <gtk/gtk.h>
+#include "pipeline.h"
+
+// Background compression jobs for the file manager. Jobs run on a
+// GThreadPool; a panel shows each job's progress, throughput and ETA,
+// and results are posted back to the GTK main loop. Running jobs share a
+// memory budget of half of RAM (budget.h).
+#define JOBS_MAX_RUNNING 4          // Jobs compressing at once
+#define JOBS_REFRESH_MS 250         // Panel refresh interval
+
+typedef enum {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED,
+    JOB_CANCELLED
+} JobState;
+
+typedef struct {
+    char path[512];
+    long long total;                // Input size in bytes
+    stream_progress progress;       // Updated by the worker as it reads
+    int state;                      // JobState, written by the worker
+    gint64 started, finished;       // Monotonic microseconds
+    int reported;                   // job_finished has run (main thread only)
+} CompressJob;
+
+// Called on the main thread when a job ends
+typedef void (*JobDoneFunc)(CompressJob *job, gpointer data);
+
+GtkWidget *create_jobs_panel(JobDoneFunc on_done, gpointer data);
+void submit_compress_job(const char *path);
+void on_cancel_job_clicked(GtkWidget *widget, gpointer data);
+void on_clear_jobs_clicked(GtkWidget *widget, gpointer data);
+
+#endif // JOBS_H
@@ -0,0 +1,470 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pipeline.h"
+
+#define PIPE_BUFFER 65536   // stdio buffer on each end, so queue items are ~64 KB
+#define PIPE_DEPTH 8        // Buffers queued before the writer blocks
+
+// One piece of the stream, shared by every reader it was fanned out to
+typedef struct qbuf {
+    int refs;
+    size_t len;
+    unsigned char data[];
+} qbuf;
+
+// Bounded queue of buffer references feeding one reader
+typedef struct bqueue {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    qbuf *items[PIPE_DEPTH];
+    int head, depth;
+    int writer_closed;
+    int reader_closed;
+    int refs;               // Open ends; the last close frees the queue
+} bqueue;
+
+// Reader end: the buffer currently being consumed. It is released only
+// once the next one is needed, as the codec may still be reading it.
+typedef struct pipe_reader {
+    bqueue *q;
+    qbuf *cur;
+    size_t pos;
+    stream_borrower borrower;
+} pipe_reader;
+
+static pthread_mutex_t borrowers_lock = PTHREAD_MUTEX_INITIALIZER;
+static stream_borrower *borrowers;
+
+// Function to make file borrowable through the given functions, until
+// stream_clear_borrower(b); b must stay valid until then
+void stream_set_borrower(stream_borrower *b, FILE *file, borrow_fn borrow, unborrow_fn unborrow, void *ctx) {
+    b->file = file;
+    b->borrow = borrow;
+    b->unborrow = unborrow;
+    b->ctx = ctx;
+    pthread_mutex_lock(&borrowers_lock);
+    b->next = borrowers;
+    borrowers = b;
+    pthread_mutex_unlock(&borrowers_lock);
+}
+
+void stream_clear_borrower(stream_borrower *b) {
+    pthread_mutex_lock(&borrowers_lock);
+    for (stream_borrower **p = &borrowers; *p; p = &(*p)->next) {
+        if (*p == b) {
+            *p = b->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&borrowers_lock);
+}
+
+// Function to find how to borrow from file, or NULL if it is not
+// borrowable
+stream_borrower *stream_borrowable(FILE *file) {
+    stream_borrower *b;
+
+    pthread_mutex_lock(&borrowers_lock);
+    for (b = borrowers; b && b->file != file; b = b->next)
+        ;
+    pthread_mutex_unlock(&borrowers_lock);
+    return b;
+}
+
+// Function to borrow up to max bytes from a stream. Bytes stdio has read
+// ahead come first, lent straight out of the FILE's buffer (glibc): taking
+// them is what getc does, and giving them back what ungetc does.
+size_t stream_borrow(stream_borrower *b, const unsigned char **data, size_t max) {
+    FILE *f = b->file;
+    size_t ahead = f->_IO_read_end - f->_IO_read_ptr;
+
+    b->from_stdio = ahead > 0;
+    if (!ahead) return b->borrow(b->ctx, data, max);
+    if (ahead > max) ahead = max;
+    *data = (const unsigned char *)f->_IO_read_ptr;
+    f->_IO_read_ptr += ahead;
+    return ahead;
+}
+
+void stream_unborrow(stream_borrower *b, size_t n) {
+    if (!n) return;
+    if (b->from_stdio) b->file->_IO_read_ptr -= n;
+    else b->unborrow(b->ctx, n);
+}
+
+// Writer end: one buffer is pushed to every reader's queue
+typedef struct fanout {
+    int count;
+    bqueue *queues[];
+} fanout;
+
+// Drops one reference to a buffer; the last reader frees it
+static void qbuf_release(qbuf *b) {
+    if (b && __atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(b);
+}
+
+// Drops one end's reference and frees the queue after the last one
+static void bqueue_release(bqueue *q) {
+    int refs;
+
+    pthread_mutex_lock(&q->lock);
+    refs = --q->refs;
+    pthread_mutex_unlock(&q->lock);
+    if (refs > 0) return;
+
+    for (int i = 0; i < q->depth; i++)
+        qbuf_release(q->items[(q->head + i) % PIPE_DEPTH]);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->changed);
+    free(q);
+}
+
+// Queues a buffer reference; returns 0 if the reader has gone away
+static int bqueue_push(bqueue *q, qbuf *b) {
+    pthread_mutex_lock(&q->lock);
+    while (q->depth >= PIPE_DEPTH && !q->reader_closed)
+        pthread_cond_wait(&q->changed, &q->lock);
+    if (q->reader_closed) {
+        pthread_mutex_unlock(&q->lock);
+        return 0;
+    }
+    q->items[(q->head + q->depth) % PIPE_DEPTH] = b;
+    q->depth++;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+    return 1;
+}
+
+// Copies the data once and hands the same buffer to every live reader
+static ssize_t fanout_write(void *cookie, const char *buf, size_t size) {
+    fanout *fo = (fanout *)cookie;
+    qbuf *b = malloc(sizeof(qbuf) + size);
+    int delivered = 0;
+
+    if (!b) return -1;
+    b->refs = fo->count + 1;
+    b->len = size;
+    memcpy(b->data, buf, size);
+
+    for (int i = 0; i < fo->count; i++) {
+        if (bqueue_push(fo->queues[i], b)) delivered++;
+        else qbuf_release(b);
+    }
+    qbuf_release(b);
+    return delivered > 0 ? (ssize_t)size : -1;
+}
+
+static int fanout_close(void *cookie) {
+    fanout *fo = (fanout *)cookie;
+
+    for (int i = 0; i < fo->count; i++) {
+        bqueue *q = fo->queues[i];
+        pthread_mutex_lock(&q->lock);
+        q->writer_closed = 1;
+        pthread_cond_broadcast(&q->changed);
+        pthread_mutex_unlock(&q->lock);
+        bqueue_release(q);
+    }
+    free(fo);
+    return 0;
+}
+
+// Makes sure the reader has unread bytes, releasing the spent buffer and
+// waiting for the next; returns 0 at end of stream
+static int next_buffer(pipe_reader *r) {
+    bqueue *q = r->q;
+
+    if (r->cur && r->pos < r->cur->len) return 1;
+    qbuf_release(r->cur);
+    r->cur = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->depth == 0 && !q->writer_closed)
+        pthread_cond_wait(&q->changed, &q->lock);
+    if (q->depth > 0) {
+        r->cur = q->items[q->head];
+        q->head = (q->head + 1) % PIPE_DEPTH;
+        q->depth--;
+        r->pos = 0;
+        pthread_cond_broadcast(&q->changed);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return r->cur != NULL;
+}
+
+static ssize_t pipe_read(void *cookie, char *buf, size_t size) {
+    pipe_reader *r = (pipe_reader *)cookie;
+
+    if (!next_buffer(r)) return 0;
+    size_t n = r->cur->len - r->pos;
+    if (n > size) n = size;
+    memcpy(buf, r->cur->data + r->pos, n);
+    r->pos += n;
+    return n;
+}
+
+// Lends the rest of the current buffer, up to max bytes, in place
+static size_t pipe_borrow(void *ctx, const unsigned char **data, size_t max) {
+    pipe_reader *r = (pipe_reader *)ctx;
+
+    if (!next_buffer(r)) return 0;
+    size_t n = r->cur->len - r->pos;
+    if (n > max) n = max;
+    *data = r->cur->data + r->pos;
+    r->pos += n;
+    return n;
+}
+
+static void pipe_unborrow(void *ctx, size_t n) {
+    ((pipe_reader *)ctx)->pos -= n;
+}
+
+static int pipe_close_reader(void *cookie) {
+    pipe_reader *r = (pipe_reader *)cookie;
+    bqueue *q = r->q;
+
+    pthread_mutex_lock(&q->lock);
+    q->reader_closed = 1;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+    stream_clear_borrower(&r->borrower);
+    qbuf_release(r->cur);
+    free(r);
+    bqueue_release(q);
+    return 0;
+}
+
+// Creates one queue and its reader stream; the writer side keeps a reference
+static bqueue *open_reader(FILE **reader) {
+    cookie_io_functions_t rio = { .read = pipe_read, .close = pipe_close_reader };
+    bqueue *q = calloc(1, sizeof(*q));
+    pipe_reader *r = calloc(1, sizeof(*r));
+
+    if (!q || !r) {
+        free(q);
+        free(r);
+        return NULL;
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->changed, NULL);
+    q->refs = 2;
+    r->q = q;
+
+    *reader = fopencookie(r, "rb", rio);
+    if (!*reader) {
+        pthread_mutex_destroy(&q->lock);
+        pthread_cond_destroy(&q->changed);
+        free(q);
+        free(r);
+        return NULL;
+    }
+    setvbuf(*reader, NULL, _IOFBF, PIPE_BUFFER);
+    stream_set_borrower(&r->borrower, *reader, pipe_borrow, pipe_unborrow, r);
+    return q;
+}
+
+// Function to create a writer whose buffers reach all count readers.
+// Each buffer is copied once and shared by reference: readers borrow it
+// in place (input.h) or fread straight out of it, and a slow reader only
+// holds back the writer once its own queue is full.
+FILE *stream_fanout(FILE **readers, int count) {
+    cookie_io_functions_t wio = { .write = fanout_write, .close = fanout_close };
+    fanout *fo = calloc(1, sizeof(fanout) + count * sizeof(bqueue *));
+    FILE *writer;
+
+    if (!fo) return NULL;
+    for (; fo->count < count; fo->count++) {
+        fo->queues[fo->count] = open_reader(&readers[fo->count]);
+        if (!fo->queues[fo->count]) break;
+    }
+    if (fo->count == count && (writer = fopencookie(fo, "wb", wio)) != NULL) {
+        setvbuf(writer, NULL, _IOFBF, PIPE_BUFFER);
+        return writer;
+    }
+
+    // Unwind: close the readers that were opened, then the writer side
+    for (int i = 0; i < fo->count; i++)
+        fclose(readers[i]);
+    fanout_close(fo);
+    return NULL;
+}
+
+// Function to create a bounded in-memory pipe between two stages
+int stream_pipe(FILE **reader, FILE **writer) {
+    *writer = stream_fanout(reader, 1);
+    return *writer ? 0 : -1;
+}
+
+// Prefixed stream: buffered bytes first, then the rest of another stream
+typedef struct prefixed {
+    FILE *rest;
+    size_t len, pos;
+    unsigned char data[];
+} prefixed;
+
+static ssize_t prefixed_read(void *cookie, char *buf, size_t size) {
+    prefixed *p = (prefixed *)cookie;
+
+    if (p->pos < p->len) {
+        size_t n = p->len - p->pos;
+        if (n > size) n = size;
+        memcpy(buf, p->data + p->pos, n);
+        p->pos += n;
+        return n;
+    }
+    size_t n = fread(buf, 1, size, p->rest);
+    return n == 0 && ferror(p->rest) ? -1 : (ssize_t)n;
+}
+
+static int prefixed_close(void *cookie) {
+    free(cookie);
+    return 0;
+}
+
+// Function to put already-consumed bytes back in front of a stream, for
+// inputs such as pipes that cannot seek. Closing the result leaves rest open.
+FILE *stream_prefixed(const unsigned char *prefix, size_t len, FILE *rest) {
+    cookie_io_functions_t io = { .read = prefixed_read, .close = prefixed_close };
+    prefixed *p = malloc(sizeof(prefixed) + len);
+    FILE *f;
+
+    if (!p) return NULL;
+    p->rest = rest;
+    p->len = len;
+    p->pos = 0;
+    memcpy(p->data, prefix, len);
+    f = fopencookie(p, "rb", io);
+    if (!f) free(p);
+    return f;
+}
+
+// Counted stream: reads pass through, updating a stream_progress
+typedef struct counted {
+    FILE *source;
+    stream_progress *progress;
+} counted;
+
+static ssize_t counted_read(void *cookie, char *buf, size_t size) {
+    counted *c = (counted *)cookie;
+    size_t n;
+
+    if (__atomic_load_n(&c->progress->cancel, __ATOMIC_RELAXED)) return -1;
+    n = fread(buf, 1, size, c->source);
+    if (n == 0 && ferror(c->source)) {
+        __atomic_store_n(&c->progress->error, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    __atomic_add_fetch(&c->progress->bytes, n, __ATOMIC_RELAXED);
+    return n;
+}
+
+static int counted_close(void *cookie) {
+    counted *c = (counted *)cookie;
+    int ret = fclose(c->source);
+
+    free(c);
+    return ret;
+}
+
+// Function to wrap a stream so another thread can watch how far it has
+// been read and cancel it. Closing the result closes source.
+FILE *stream_counted(FILE *source, stream_progress *progress) {
+    cookie_io_functions_t io = { .read = counted_read, .close = counted_close };
+    counted *c = malloc(sizeof(*c));
+    FILE *f;
+
+    if (!c) return NULL;
+    c->source = source;
+    c->progress = progress;
+    f = fopencookie(c, "rb", io);
+    if (!f) free(c);
+    return f;
+}
+
+struct stage {
+    pthread_t thread;
+    stage_fn fn;
+    stage_arg_fn arg_fn;
+    void *arg;
+    FILE *source, *dest;
+    int close_source;
+    stage_stats *stats;
+};
+
+static void *stage_main(void *arg) {
+    stage_t *st = (stage_t *)arg;
+    FILE *in, *out;
+
+    stats_stage_begin(st->stats, st->source, st->dest, &in, &out);
+    if (st->arg_fn) st->arg_fn(in, out, st->arg);
+    else st->fn(in, out);
+    stats_stage_end(st->stats, in, out);
+    if (st->close_source) fclose(st->source);
+    fclose(st->dest);
+    return NULL;
+}
+
+static stage_t *start(stage_fn fn, stage_arg_fn arg_fn, void *arg, FILE *source, FILE *dest,
+                      int close_source, stage_stats *stats) {
+    stage_t *st = malloc(sizeof(*st));
+
+    if (st) {
+        st->fn = fn;
+        st->arg_fn = arg_fn;
+        st->arg = arg;
+        st->source = source;
+        st->dest = dest;
+        st->close_source = close_source;
+        st->stats = stats;
+        if (pthread_create(&st->thread, NULL, stage_main, st) == 0)
+            return st;
+        free(st);
+    }
+    if (close_source) fclose(source);
+    fclose(dest);
+    return NULL;
+}
+
+// Function to run a codec on its own thread; on failure both streams are
+// closed so the neighbouring stages see end of stream and return
+stage_t *stage_start(stage_fn fn, FILE *source, FILE *dest) {
+    return start(fn, NULL, NULL, source, dest, 1, NULL);
+}
+
+// Same, for a source the caller keeps (stdin, a file it will read on
+// from); only dest is closed
+stage_t *stage_start_borrowed(stage_fn fn, FILE *source, FILE *dest) {
+    return start(fn, NULL, NULL, source, dest, 0, NULL);
+}
+
+// Same as stage_start_borrowed, with the stage's bytes and times recorded
+// in stats (which may be NULL)
+stage_t *stage_start_stats(stage_fn fn, FILE *source, FILE *dest, stage_stats *stats) {
+    return start(fn, NULL, NULL, source, dest, 0, stats);
+}
+
+// Same as stage_start, for a codec that takes an argument
+stage_t *stage_start_arg(stage_arg_fn fn, void *arg, FILE *source, FILE *dest) {
+    return start(NULL, fn, arg, source, dest, 1, NULL);
+}
+
+// Same as stage_start, with the stage recorded in stats
+stage_t *stage_start_owned_stats(stage_fn fn, FILE *source, FILE *dest, stage_stats *stats) {
+    return start(fn, NULL, NULL, source, dest, 1, stats);
+}
+
+// Same as stage_start_arg, with the stage recorded in stats
+stage_t *stage_start_arg_stats(stage_arg_fn fn, void *arg, FILE *source, FILE *dest, stage_stats *stats) {
+    return start(NULL, fn, arg, source, dest, 1, stats);
+}
+
+// Function to wait for a stage to finish
+void stage_join(stage_t *stage) {
+    if (!stage) return;
+    pthread_join(stage->thread, NULL);
+    free(stage);
+}
@@ -0,0 +1,71 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdio.h>
+#include "stats.h"
+
+// In-memory streaming between codec stages. A stream pipe is a bounded
+// queue of buffers with a FILE* on each end, so the existing codec
+// functions can be chained without temp files. Closing the writer signals
+// end of stream; closing the reader early makes further writes fail.
+// A fan-out writer shares every buffer by reference with several readers.
+int stream_pipe(FILE **reader, FILE **writer);
+FILE *stream_fanout(FILE **readers, int count);
+FILE *stream_prefixed(const unsigned char *prefix, size_t len, FILE *rest);
+
+// Zero-copy reads, used by input.h. A borrowable stream lends out its
+// buffers in place: stream_borrow() returns up to max bytes, valid until
+// the next read from the stream, or 0 at end of stream, and
+// stream_unborrow() gives back the last n bytes lent. Pipe and fan-out
+// readers are borrowable, as are stats probes over them (stats.h), so the
+// consumers of a fan-out read the producer's buffers without copying.
+// Reads through the FILE* itself still work and share the position:
+// bytes stdio has read ahead are lent out of its buffer first.
+typedef size_t (*borrow_fn)(void *ctx, const unsigned char **data, size_t max);
+typedef void (*unborrow_fn)(void *ctx, size_t n);
+
+typedef struct stream_borrower {
+    FILE *file;
+    borrow_fn borrow;
+    unborrow_fn unborrow;
+    void *ctx;
+
+    // Private
+    int from_stdio;                 // The last loan came out of the FILE's buffer
+    struct stream_borrower *next;   // Registry of borrowable streams
+} stream_borrower;
+
+void stream_set_borrower(stream_borrower *b, FILE *file, borrow_fn borrow, unborrow_fn unborrow, void *ctx);
+void stream_clear_borrower(stream_borrower *b);
+stream_borrower *stream_borrowable(FILE *file);
+size_t stream_borrow(stream_borrower *b, const unsigned char **data, size_t max);
+void stream_unborrow(stream_borrower *b, size_t n);
+
+// Progress of a counted stream, shared with other threads through the
+// __atomic builtins: bytes read so far, whether a read failed, and a
+// cancel flag that makes further reads fail so the codec reading it stops
+typedef struct {
+    long long bytes;
+    int error;
+    int cancel;
+} stream_progress;
+
+FILE *stream_counted(FILE *source, stream_progress *progress);
+
+// A codec function running on its own thread. The stage owns both
+// streams and closes them when the codec returns; a borrowed stage leaves
+// its source open for the caller. An instrumented stage records its run
+// in a stats stage (stats.h).
+typedef void (*stage_fn)(FILE *source, FILE *dest);
+typedef void (*stage_arg_fn)(FILE *source, FILE *dest, void *arg);
+typedef struct stage stage_t;
+
+stage_t *stage_start(stage_fn fn, FILE *source, FILE *dest);
+stage_t *stage_start_borrowed(stage_fn fn, FILE *source, FILE *dest);
+stage_t *stage_start_stats(stage_fn fn, FILE *source, FILE *dest, stage_stats *stats);
+stage_t *stage_start_arg(stage_arg_fn fn, void *arg, FILE *source, FILE *dest);
+stage_t *stage_start_owned_stats(stage_fn fn, FILE *source, FILE *dest, stage_stats *stats);
+stage_t *stage_start_arg_stats(stage_arg_fn fn, void *arg, FILE *source, FILE *dest, stage_stats *stats);
+void stage_join(stage_t *stage);
+
+#endif // PIPELINE_H
@@ -0,0 +1,132 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "pool.h"
+
+// A queued unit of work
+typedef struct pool_job {
+    pool_fn fn;
+    void *arg;
+    struct pool_job *next;
+} pool_job;
+
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;     // Signalled when a job is queued or on shutdown
+    pthread_cond_t idle;     // Signalled when the last pending job finishes
+    pool_job *head, *tail;
+    int pending;             // Jobs queued or running
+    int shutdown;
+    int nthreads;
+    pthread_t *threads;
+};
+
+// Worker loop: pop jobs until the pool shuts down
+static void *pool_worker(void *arg) {
+    pool_t *pool = (pool_t *)arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->head == NULL && !pool->shutdown)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if (pool->head == NULL && pool->shutdown) break;
+
+        pool_job *job = pool->head;
+        pool->head = job->next;
+        if (pool->head == NULL) pool->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        job->fn(job->arg);
+        free(job);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+            pthread_cond_broadcast(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Number of online CPUs, used when the caller asks for 0 threads
+int pool_default_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+// Function to start a pool with the given number of workers
+pool_t *pool_create(int threads) {
+    pool_t *pool = calloc(1, sizeof(*pool));
+    if (!pool) return NULL;
+
+    if (threads <= 0) threads = pool_default_threads();
+    pool->threads = calloc(threads, sizeof(pthread_t));
+    if (!pool->threads) {
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0) break;
+        pool->nthreads++;
+    }
+    if (pool->nthreads == 0) {
+        pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+// Function to queue a job; runs inline if the job cannot be allocated
+void pool_submit(pool_t *pool, pool_fn fn, void *arg) {
+    pool_job *job = malloc(sizeof(*job));
+    if (!job) {
+        fn(arg);
+        return;
+    }
+    job->fn = fn;
+    job->arg = arg;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail) pool->tail->next = job;
+    else pool->head = job;
+    pool->tail = job;
+    pool->pending++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Function to block until every submitted job has finished
+void pool_wait(pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int pool_threads(const pool_t *pool) {
+    return pool->nthreads;
+}
+
+// Function to drain the queue and join all workers
+void pool_destroy(pool_t *pool) {
+    if (!pool) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,16 @@
+#ifndef POOL_H
+#define POOL_H
+
+// Fixed-size worker pool used by the block-parallel codecs
+typedef void (*pool_fn)(void *arg);
+
+typedef struct pool pool_t;
+
+pool_t *pool_create(int threads);
+void pool_submit(pool_t *pool, pool_fn fn, void *arg);
+void pool_wait(pool_t *pool);
+void pool_destroy(pool_t *pool);
+int pool_threads(const pool_t *pool);
+int pool_default_threads(void);
+
+#endif // POOL_H
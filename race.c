@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "budget.h"
+#include "codec.h"
+#include "compress.h"
+#include "entropy.h"
+#include "input.h"
+#include "pipeline.h"
+#include "race.h"
+
+#define COPY_CHUNK 65536
+#define RACE_QUEUED (8 * RACE_FEED)     // Input the fan-out queues may hold at once
+
+// One candidate's run
+typedef struct {
+    int codec, level;
+    int filter, dist;               // LZMA pre-filter (entropy.h)
+    int state;                      // enum race_state once decided, else -1
+    int done;                       // The codec has returned
+    int started;
+    int cancel;                     // Ends its input early
+    FILE *reader;                   // Its fan-out queue
+    FILE *input;                    // reader, as the codec sees it
+    FILE *output;                   // Temporary file, kept after the run
+    FILE *sink;                     // Stage output, under the byte counter
+    stage_stats *stats;             // Bytes and times, updated while it runs
+    long long produced;             // Bytes the codec has written so far
+    long long seen_out, seen_in;    // Output when last seen growing, and input read by then
+    pthread_t thread;
+} runner;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runner input: the fan-out reader, ending early once cancelled, so the
+// codec winds down as at end of input rather than reporting an error
+static ssize_t runner_read(void *cookie, char *buf, size_t size) {
+    runner *r = (runner *)cookie;
+    size_t n;
+
+    if (__atomic_load_n(&r->cancel, __ATOMIC_RELAXED)) return 0;
+    n = fread(buf, 1, size, r->reader);
+    return n == 0 && ferror(r->reader) ? -1 : (ssize_t)n;
+}
+
+static int runner_close(void *cookie) {
+    return fclose(((runner *)cookie)->reader);
+}
+
+// Runner output: counted as the codec writes it. The stage's own count
+// moves only when its buffer fills, which a strong codec may not do for
+// many MB of input.
+static ssize_t runner_write(void *cookie, const char *buf, size_t size) {
+    runner *r = (runner *)cookie;
+    size_t n = fwrite(buf, 1, size, r->sink);
+
+    __atomic_add_fetch(&r->produced, n, __ATOMIC_RELAXED);
+    return n == 0 && size > 0 ? -1 : (ssize_t)n;
+}
+
+static void *run(void *arg) {
+    runner *r = (runner *)arg;
+    cookie_io_functions_t io = { .write = runner_write };
+    FILE *in, *out, *counted;
+
+    stats_stage_begin(r->stats, r->input, r->output, &in, &out);
+    r->sink = out;
+    counted = fopencookie(r, "wb", io);
+    if (counted) {
+        setvbuf(counted, NULL, _IONBF, 0);
+        compress_codec_reserved(in, counted, r->codec, r->level, 1, r->filter, r->dist);
+        if (fclose(counted) != 0) stats_fail();
+    } else {
+        stats_fail();
+    }
+    stats_stage_end(r->stats, in, out);
+    // Closing its reader lets the fan-out skip this runner from now on
+    fclose(r->input);
+    __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static int running(runner *r) {
+    return r->started && r->state < 0 && !__atomic_load_n(&r->done, __ATOMIC_ACQUIRE);
+}
+
+// Whether a runner that has stopped failed on its own
+static int failed(runner *r) {
+    return !r->started || (__atomic_load_n(&r->done, __ATOMIC_ACQUIRE) && r->state < 0 && r->stats->error);
+}
+
+static void cancel(runner *r, int state) {
+    r->state = state;
+    __atomic_store_n(&r->cancel, 1, __ATOMIC_RELAXED);
+}
+
+// A runner is judged by its input when its output last grew: a codec
+// that holds back input (bz2 a whole block) would otherwise look better
+// than it is until it flushes
+static void observe(runner *r) {
+    long long out = __atomic_load_n(&r->produced, __ATOMIC_RELAXED);
+
+    if (out != r->seen_out) {
+        r->seen_out = out;
+        r->seen_in = __atomic_load_n(&r->stats->bytes_in, __ATOMIC_RELAXED);
+    }
+}
+
+// Output per input byte so far; negative before the runner has read
+// min_in bytes and written something, or once it is out of the race
+static double ratio(runner *r, long long min_in) {
+    if (r->state >= 0 || failed(r)) return -1;
+    if (__atomic_load_n(&r->done, __ATOMIC_ACQUIRE))
+        return r->stats->bytes_in ? (double)r->stats->bytes_out / r->stats->bytes_in : 0;
+    if (r->seen_in < min_in || r->seen_in == 0 || r->seen_out == 0) return -1;
+    return (double)r->seen_out / r->seen_in;
+}
+
+// Cancels the runners clearly behind the leader and, once out of time,
+// every runner but the leader
+static void referee(runner *runners, int count, int out_of_time) {
+    int leader = -1;
+    double best = 0;
+
+    for (int i = 0; i < count; i++)
+        if (running(&runners[i])) observe(&runners[i]);
+    for (int i = 0; i < count; i++) {
+        double r = ratio(&runners[i], RACE_WARMUP);
+        if (r >= 0 && (leader < 0 || r < best)) {
+            leader = i;
+            best = r;
+        }
+    }
+    if (leader < 0 && out_of_time) {
+        // Nobody can be judged yet: go by what there is
+        for (int i = 0; i < count; i++) {
+            double r = ratio(&runners[i], 1);
+            if (r >= 0 && (leader < 0 || r < best)) {
+                leader = i;
+                best = r;
+            }
+        }
+        for (int i = 0; i < count && leader < 0; i++)
+            if (running(&runners[i])) leader = i;
+    }
+    if (leader < 0) return;
+
+    for (int i = 0; i < count; i++) {
+        runner *r = &runners[i];
+        if (i == leader || !running(r)) continue;
+        if (out_of_time) {
+            cancel(r, RACE_TIMED_OUT);
+        } else {
+            double ri = ratio(r, RACE_WARMUP);
+            if (ri >= 0 && ri > best * (1 + RACE_MARGIN)) cancel(r, RACE_LOST);
+        }
+    }
+}
+
+static int copy_file(FILE *source, FILE *dest) {
+    unsigned char buf[COPY_CHUNK];
+    size_t n;
+
+    rewind(source);
+    while ((n = fread(buf, 1, sizeof(buf), source)) > 0)
+        if (fwrite(buf, 1, n, dest) != n) return -1;
+    return ferror(source) ? -1 : 0;
+}
+
+// Function to fill candidates with the default field: store, so the
+// data never grows by more than the header, zlib, bz2 and LZMA at their
+// strongest settings, LZMA also at its default, and every other
+// registered backend at its maximum level. Returns the count.
+int race_default_candidates(race_candidate *candidates) {
+    static const race_candidate builtin[] = {
+        { FC_STORE, 0 }, { FC_ZLIB, 9 }, { FC_BZ2, 9 }, { FC_LZMA, 6 }, { FC_LZMA, 9 },
+    };
+    const codec_t *c;
+    int n = 0;
+
+    for (size_t i = 0; i < sizeof(builtin) / sizeof(builtin[0]); i++)
+        candidates[n++] = builtin[i];
+    for (int i = 0; (c = codec_at(i)) != NULL && n < RACE_MAX; i++) {
+        if (c->id == FC_STORE || c->id == FC_ZLIB || c->id == FC_BZ2 || c->id == FC_LZMA)
+            continue;
+        candidates[n].codec = c->id;
+        candidates[n++].level = c->max_level;
+    }
+    return n;
+}
+
+// Function to race candidates (NULL = the default field) over source and
+// write the smallest result to dest. time_limit is in seconds, 0 for
+// none. report may be NULL. Returns 0, or -1 if the input could not be read
+// or no candidate finished.
+int compress_race(FILE *source, FILE *dest, const race_candidate *candidates, int count,
+                  double time_limit, race_report *report) {
+    race_candidate field[RACE_MAX];
+    runner runners[RACE_MAX];
+    cookie_io_functions_t io = { .read = runner_read, .close = runner_close };
+    FILE *readers[RACE_MAX], *fanout;
+    fc_stats stats;
+    budget_grant grant;
+    input_t in;
+    const unsigned char *data;
+    size_t n, memory = RACE_QUEUED;
+    long long total = 0;
+    int filter, dist, winner = -1, active, unread;
+    double start = now_seconds();
+
+    if (report) {
+        memset(report, 0, sizeof(*report));
+        report->winner = -1;
+    }
+    if (!candidates) {
+        count = race_default_candidates(field);
+        candidates = field;
+    }
+    if (count > RACE_MAX) count = RACE_MAX;
+    if (count <= 0) {
+        fprintf(stderr, "Error: No codecs to race\n");
+        return -1;
+    }
+
+    memset(runners, 0, sizeof(runners));
+    filter = sample_filter(source, &dist);
+    for (int i = 0; i < count; i++) {
+        const codec_t *c = codec_by_id(candidates[i].codec);
+        runner *r = &runners[i];
+
+        r->codec = candidates[i].codec;
+        r->level = candidates[i].level < 0 && c ? c->default_level : candidates[i].level;
+        r->state = -1;
+        if (r->codec == FC_LZMA) {
+            r->filter = filter;
+            r->dist = dist;
+        }
+        memory += codec_memusage(r->codec, r->level, 1);
+    }
+
+    fanout = stream_fanout(readers, count);
+    if (!fanout) {
+        fprintf(stderr, "Error: Cannot start the race\n");
+        return -1;
+    }
+    stats_init(&stats, NULL, NULL, 0);
+
+    // The whole race is admitted at once: a runner waiting for memory
+    // would stall the fan-out and with it every other runner
+    budget_acquire(&grant, FC_STORE, 0, 1, memory);
+
+    for (int i = 0; i < count; i++) {
+        runner *r = &runners[i];
+        const codec_t *c = codec_by_id(r->codec);
+
+        r->stats = stats_stage(&stats, c ? c->name : "?");
+        r->reader = readers[i];
+        r->output = tmpfile();
+        r->input = r->output ? fopencookie(r, "rb", io) : NULL;
+        if (r->input && pthread_create(&r->thread, NULL, run, r) == 0) {
+            r->started = 1;
+            continue;
+        }
+        // The fan-out skips a closed reader
+        fprintf(stderr, "Error: Cannot start the %s runner\n", c ? c->name : "?");
+        if (r->input) fclose(r->input);
+        else fclose(readers[i]);
+    }
+
+    // Feed the runners, refereeing whenever the slowest has taken a buffer
+    input_open(&in, source);
+    while ((n = input_next(&in, &data, RACE_FEED)) > 0) {
+        total += n;
+        if (fwrite(data, 1, n, fanout) != n) break;     // Every runner has stopped
+        referee(runners, count, time_limit > 0 && now_seconds() - start > time_limit);
+    }
+    // The runners only see the end of the fan-out, so a failed read would
+    // let them finish on part of the input
+    unread = input_error(&in);
+    input_close(&in, 0);
+    fclose(fanout);
+
+    do {
+        struct timespec pause = { 0, (long)(RACE_POLL * 1e9) };
+        active = 0;
+        for (int i = 0; i < count; i++)
+            if (running(&runners[i])) active++;
+        if (active > 0) {
+            nanosleep(&pause, NULL);
+            referee(runners, count, time_limit > 0 && now_seconds() - start > time_limit);
+        }
+    } while (active > 0);
+
+    for (int i = 0; i < count; i++) {
+        runner *r = &runners[i];
+        if (!r->started) continue;
+        pthread_join(r->thread, NULL);
+        if (r->state < 0 && !r->stats->error &&
+            (winner < 0 || r->stats->bytes_out < runners[winner].stats->bytes_out))
+            winner = i;
+    }
+    budget_release(&grant);
+
+    if (unread) {
+        fprintf(stderr, "Error: Cannot read the race input\n");
+        winner = -1;
+    } else if (winner >= 0 && copy_file(runners[winner].output, dest) != 0) {
+        fprintf(stderr, "Error: Cannot copy the race winner\n");
+        winner = -1;
+    } else if (winner < 0) {
+        fprintf(stderr, "Error: No codec finished the race\n");
+    }
+
+    if (report) {
+        report->count = count;
+        report->winner = winner;
+        report->bytes_in = total;
+        report->seconds = now_seconds() - start;
+    }
+    for (int i = 0; i < count; i++) {
+        runner *r = &runners[i];
+        if (report) {
+            race_result *res = &report->results[i];
+            res->codec = r->codec;
+            res->level = r->level;
+            res->state = i == winner ? RACE_WON : r->state >= 0 ? r->state : failed(r) ? RACE_FAILED : RACE_FINISHED;
+            if (r->stats) {
+                res->bytes_in = r->stats->bytes_in;
+                res->bytes_out = r->stats->bytes_out;
+                res->wall = r->stats->wall;
+                res->cpu = r->stats->cpu;
+            }
+            res->projected_out = res->bytes_out;
+            res->projected_cpu = res->cpu;
+            if (res->state == RACE_LOST || res->state == RACE_TIMED_OUT) {
+                double scale = res->bytes_in > 0 ? (double)total / res->bytes_in : 0;
+                res->projected_out = (long long)(res->bytes_out * scale);
+                res->projected_cpu = res->cpu * scale;
+            }
+        }
+        if (r->output) fclose(r->output);
+    }
+    stats_destroy(&stats);
+    return winner >= 0 ? 0 : -1;
+}
+
+const char *race_state_name(int state) {
+    switch (state) {
+    case RACE_FINISHED: return "finished";
+    case RACE_WON: return "won";
+    case RACE_LOST: return "lost";
+    case RACE_TIMED_OUT: return "timed out";
+    default: return "failed";
+    }
+}
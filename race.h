@@ -0,0 +1,65 @@
+#ifndef RACE_H
+#define RACE_H
+
+#include <stdio.h>
+
+// Codec race, for cold data where ratio matters more than time. Every
+// candidate codec and level compresses the same input at once, each on
+// its own thread, all fed from one read of the source. Once a candidate
+// has read RACE_WARMUP bytes, it is cancelled if its output per input
+// byte so far is over RACE_MARGIN above the leader's. Past the time
+// limit every candidate but the leader is cancelled, and the leader runs
+// to the end. The smallest complete output is written to dest; it is an
+// ordinary FCMP stream whose header records the winning codec and level.
+//
+// Candidates run in lock step, as the source is read once, so they are
+// judged at nearly the same point in the input and a race takes about as
+// long as its slowest candidate still running. The whole race is
+// admitted to the memory budget (budget.h) at once, as one candidate
+// waiting for memory would stall all the others.
+//
+// The report gives what each candidate cost: bytes in and out, CPU and
+// wall time, and, for the cancelled ones, the output size and CPU time
+// they would have taken on the whole input, projected from how far they
+// got.
+#define RACE_MAX 8                  // Candidates per race
+#define RACE_WARMUP (8 << 20)       // Input read before any is cancelled
+#define RACE_MARGIN 0.25            // Ratio this far behind the leader loses
+#define RACE_POLL 0.05              // Seconds between checks on the runners
+#define RACE_FEED (128 * 1024)      // Bytes fanned out to the runners at a time
+
+enum race_state {
+    RACE_FINISHED,                  // Ran to the end, but was larger
+    RACE_WON,
+    RACE_LOST,                      // Cancelled: clearly behind the leader
+    RACE_TIMED_OUT,                 // Cancelled: out of time
+    RACE_FAILED                     // Codec or output error
+};
+
+typedef struct {
+    int codec, level;
+} race_candidate;
+
+typedef struct {
+    int codec, level;
+    int state;                      // enum race_state
+    long long bytes_in, bytes_out;  // Bytes read and written before it stopped
+    double wall, cpu;               // Seconds
+    long long projected_out;        // On the whole input; bytes_out if it finished
+    double projected_cpu;
+} race_result;
+
+typedef struct {
+    race_result results[RACE_MAX];
+    int count;
+    int winner;                     // Index into results, -1 if all failed
+    long long bytes_in;             // Input size
+    double seconds;
+} race_report;
+
+int race_default_candidates(race_candidate *candidates);
+int compress_race(FILE *source, FILE *dest, const race_candidate *candidates, int count,
+                  double time_limit, race_report *report);
+const char *race_state_name(int state);
+
+#endif // RACE_H
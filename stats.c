@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "pipeline.h"
+#include "stats.h"
+
+// Probe stream: reads or writes pass through to file, timed and counted.
+// A probe over a borrowable stream (pipeline.h) lends its buffers on.
+typedef struct probe {
+    FILE *file;
+    stage_stats *st;
+    stream_borrower *inner;
+    stream_borrower borrower;
+} probe;
+
+// Stage being timed on this thread, for stats_fail()
+static __thread stage_stats *current;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double thread_cpu_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double process_cpu_seconds(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+// Calls the progress callback if interval has passed. A thread that finds
+// another one reporting skips instead of waiting.
+static void tick(fc_stats *stats) {
+    double now;
+
+    if (!stats->progress || pthread_mutex_trylock(&stats->lock) != 0) return;
+    now = now_seconds();
+    if (now - stats->last_progress >= stats->interval) {
+        stats->last_progress = now;
+        stats->progress(stats, stats->progress_data);
+    }
+    pthread_mutex_unlock(&stats->lock);
+}
+
+static ssize_t probe_read(void *cookie, char *buf, size_t size) {
+    probe *p = (probe *)cookie;
+    double start = now_seconds();
+    size_t n = fread(buf, 1, size, p->file);
+
+    p->st->read_wait += now_seconds() - start;
+    if (n == 0 && ferror(p->file)) {
+        p->st->error = 1;
+        return -1;
+    }
+    __atomic_add_fetch(&p->st->bytes_in, n, __ATOMIC_RELAXED);
+    tick(p->st->owner);
+    return n;
+}
+
+static size_t probe_borrow(void *ctx, const unsigned char **data, size_t max) {
+    probe *p = (probe *)ctx;
+    double start = now_seconds();
+    size_t n = stream_borrow(p->inner, data, max);
+
+    p->st->read_wait += now_seconds() - start;
+    __atomic_add_fetch(&p->st->bytes_in, n, __ATOMIC_RELAXED);
+    tick(p->st->owner);
+    return n;
+}
+
+static void probe_unborrow(void *ctx, size_t n) {
+    probe *p = (probe *)ctx;
+
+    stream_unborrow(p->inner, n);
+    __atomic_sub_fetch(&p->st->bytes_in, n, __ATOMIC_RELAXED);
+}
+
+static ssize_t probe_write(void *cookie, const char *buf, size_t size) {
+    probe *p = (probe *)cookie;
+    double start = now_seconds();
+    size_t n = fwrite(buf, 1, size, p->file);
+
+    p->st->write_wait += now_seconds() - start;
+    __atomic_add_fetch(&p->st->bytes_out, n, __ATOMIC_RELAXED);
+    if (n < size) {
+        p->st->error = 1;
+        return n ? (ssize_t)n : -1;
+    }
+    tick(p->st->owner);
+    return n;
+}
+
+// Closing a probe flushes the stream under it but leaves it open
+static int probe_close(void *cookie) {
+    probe *p = (probe *)cookie;
+    int ret = 0;
+
+    if (p->st && p->file) {
+        double start = now_seconds();
+        ret = fflush(p->file);
+        p->st->write_wait += now_seconds() - start;
+    }
+    free(p);
+    return ret;
+}
+
+static int probe_close_reader(void *cookie) {
+    probe *p = (probe *)cookie;
+
+    if (p->inner) stream_clear_borrower(&p->borrower);
+    p->file = NULL;
+    return probe_close(cookie);
+}
+
+static FILE *probe_open(FILE *file, stage_stats *st, int write) {
+    cookie_io_functions_t io = { 0 };
+    probe *p = malloc(sizeof(*p));
+    FILE *f;
+
+    if (!p) return NULL;
+    p->file = file;
+    p->st = st;
+    p->inner = write ? NULL : stream_borrowable(file);
+    if (write) {
+        io.write = probe_write;
+        io.close = probe_close;
+    } else {
+        io.read = probe_read;
+        io.close = probe_close_reader;
+    }
+    f = fopencookie(p, write ? "wb" : "rb", io);
+    if (!f) {
+        free(p);
+        return NULL;
+    }
+    setvbuf(f, NULL, _IOFBF, STATS_BUFFER);
+    if (p->inner) stream_set_borrower(&p->borrower, f, probe_borrow, probe_unborrow, p);
+    return f;
+}
+
+// Function to start collecting statistics for a run. progress may be
+// NULL; otherwise it is called about every interval seconds.
+void stats_init(fc_stats *stats, stats_progress_fn progress, void *data, double interval) {
+    memset(stats, 0, sizeof(*stats));
+    stats->progress = progress;
+    stats->progress_data = data;
+    stats->interval = interval;
+    stats->start = now_seconds();
+    stats->cpu_start = process_cpu_seconds();
+    stats->last_progress = stats->start;
+    pthread_mutex_init(&stats->lock, NULL);
+}
+
+// Function to add a named stage, or NULL if there are too many. Stages
+// are reported in the order they are added, which should be data order.
+stage_stats *stats_stage(fc_stats *stats, const char *name) {
+    stage_stats *st = NULL;
+
+    pthread_mutex_lock(&stats->lock);
+    if (stats->nstages < STATS_MAX_STAGES) {
+        st = &stats->stages[stats->nstages];
+        snprintf(st->name, sizeof(st->name), "%s", name);
+        st->owner = stats;
+        __atomic_store_n(&stats->nstages, stats->nstages + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&stats->lock);
+    return st;
+}
+
+// Function to start timing a stage on the calling thread. The codec is
+// then run on *in and *out instead of source and dest. st may be NULL, in
+// which case the streams are passed through.
+void stats_stage_begin(stage_stats *st, FILE *source, FILE *dest, FILE **in, FILE **out) {
+    struct stat sb;
+    long pos;
+
+    *in = source;
+    *out = dest;
+    if (!st) return;
+    st->start = now_seconds();
+    st->cpu_start = thread_cpu_seconds();
+    st->process_cpu_start = process_cpu_seconds();
+    st->running = 1;
+    st->outer = current;
+    current = st;
+
+    // Process CPU time cannot be split between stages running at once
+    pthread_mutex_lock(&st->owner->lock);
+    if (++st->owner->active > 1) {
+        for (int i = 0; i < st->owner->nstages; i++)
+            if (st->owner->stages[i].running) st->owner->stages[i].cpu_shared = 1;
+    }
+    pthread_mutex_unlock(&st->owner->lock);
+
+    if (fstat(fileno(source), &sb) == 0 && S_ISREG(sb.st_mode) && (pos = ftell(source)) >= 0) {
+        st->file_in = source;
+        st->file_in_start = pos;
+    } else if (!(*in = probe_open(source, st, 0))) {
+        *in = source;
+        st->file_in = source;
+        st->file_in_start = -1;
+    }
+    if (!(*out = probe_open(dest, st, 1))) {
+        *out = dest;
+        st->file_out = dest;
+    }
+}
+
+// Function to finish a stage begun with stats_stage_begin. The probes are
+// closed; source and dest stay open. Returns -1 if a read or write failed.
+int stats_stage_end(stage_stats *st, FILE *in, FILE *out) {
+    if (!st) return ferror(in) || ferror(out) ? -1 : 0;
+
+    if (in == st->file_in) {
+        long pos = ftell(in);
+        if (st->file_in_start >= 0 && pos >= st->file_in_start)
+            __atomic_store_n(&st->bytes_in, pos - st->file_in_start, __ATOMIC_RELAXED);
+        if (ferror(in)) st->error = 1;
+    } else {
+        if (ferror(in)) st->error = 1;
+        if (fclose(in) != 0) st->error = 1;
+    }
+    if (ferror(out)) st->error = 1;
+    if (out != st->file_out && fclose(out) != 0) st->error = 1;
+
+    st->wall = now_seconds() - st->start;
+    pthread_mutex_lock(&st->owner->lock);
+    st->cpu = st->cpu_shared ? thread_cpu_seconds() - st->cpu_start
+                             : process_cpu_seconds() - st->process_cpu_start;
+    st->running = 0;
+    st->owner->active--;
+    pthread_mutex_unlock(&st->owner->lock);
+    current = st->outer;
+    if (st->error) st->owner->error = 1;
+    return st->error ? -1 : 0;
+}
+
+// Function to mark the stage running on this thread as failed
+void stats_fail(void) {
+    if (current) current->error = 1;
+}
+
+// Function to tell whether file is the unwrapped input of the stage
+// running on this thread, whose progress input.c should report
+int stats_input_tracked(FILE *file) {
+    return current && file && current->file_in == file && current->file_in_start >= 0;
+}
+
+// Function to record that the stage on this thread has consumed its
+// unwrapped input up to offset, waiting wait seconds for it
+void stats_input(FILE *file, long offset, double wait) {
+    stage_stats *st = current;
+
+    if (!stats_input_tracked(file) || offset < st->file_in_start) return;
+    st->read_wait += wait;
+    __atomic_store_n(&st->bytes_in, offset - st->file_in_start, __ATOMIC_RELAXED);
+    tick(st->owner);
+}
+
+// Function to end the run: totals are filled in and the progress
+// callback gets a final call
+void stats_finish(fc_stats *stats) {
+    int n = stats->nstages;
+
+    stats->wall = now_seconds() - stats->start;
+    stats->cpu = process_cpu_seconds() - stats->cpu_start;
+    stats->io_wait = n ? stats->stages[0].read_wait + stats->stages[n - 1].write_wait : 0;
+    stats->io_bound = stats->io_wait * 2 > stats->wall;
+    if (stats->progress) {
+        pthread_mutex_lock(&stats->lock);
+        stats->progress(stats, stats->progress_data);
+        pthread_mutex_unlock(&stats->lock);
+    }
+}
+
+void stats_destroy(fc_stats *stats) {
+    pthread_mutex_destroy(&stats->lock);
+}
+
+// Function to write a finished run as one JSON object
+void stats_json(const fc_stats *stats, FILE *out) {
+    int n = stats->nstages;
+    long long in = n ? stats->stages[0].bytes_in : 0;
+    long long written = n ? stats->stages[n - 1].bytes_out : 0;
+
+    fprintf(out, "{\"wall\": %.6f, \"cpu\": %.6f, \"bytes_in\": %lld, \"bytes_out\": %lld, "
+                 "\"ratio\": %.4f, \"mbps\": %.2f, \"io_wait\": %.6f, \"bound\": \"%s\", "
+                 "\"error\": %s, \"stages\": [",
+            stats->wall, stats->cpu, in, written, in ? (double)written / in : 0,
+            stats->wall > 0 ? in / stats->wall / 1e6 : 0, stats->io_wait,
+            stats->io_bound ? "io" : "cpu", stats->error ? "true" : "false");
+    for (int i = 0; i < n; i++) {
+        const stage_stats *st = &stats->stages[i];
+        double codec = st->wall - st->read_wait - st->write_wait;
+
+        fprintf(out, "%s\n  {\"name\": \"%s\", \"bytes_in\": %lld, \"bytes_out\": %lld, "
+                     "\"wall\": %.6f, \"cpu\": %.6f, \"cpu_scope\": \"%s\", \"read_wait\": %.6f, "
+                     "\"write_wait\": %.6f, \"codec\": %.6f, \"error\": %s}",
+                i ? "," : "", st->name, st->bytes_in, st->bytes_out, st->wall, st->cpu,
+                st->cpu_shared ? "thread" : "process",
+                st->read_wait, st->write_wait, codec > 0 ? codec : 0, st->error ? "true" : "false");
+    }
+    fprintf(out, "%s]}\n", n ? "\n" : "");
+}
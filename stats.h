@@ -0,0 +1,78 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+// Run statistics for the codec functions. A stage is one codec function
+// between an input and an output stream: stats_stage_begin() wraps the
+// streams in probes that count bytes and time every read and write, and
+// stats_stage_end() adds up wall and CPU time. Time blocked reading input
+// or writing output is a stall; the rest of the wall time is the codec.
+// A stage fed by a pipe stalls on the stage before it, so in a pipeline
+// the slowest stage is the one that stalls least.
+//
+// Codecs call stats_fail() when they hit corrupt input or a codec error;
+// it marks the stage running on the calling thread, if any, as failed.
+//
+// Regular-file input is not wrapped, so the codecs can still map it
+// (input.h); input_next() reports the bytes consumed and the time spent
+// faulting them in through stats_input() instead.
+//
+// A stage's CPU time is that of the whole process while it ran, so it
+// includes the worker threads of parallel codecs, unless other stages of
+// the run overlapped it; then only its own thread can be told apart.
+#define STATS_MAX_STAGES 8
+#define STATS_BUFFER (64 * 1024)    // Probe buffer: one clock read per 64 KB
+
+typedef struct fc_stats fc_stats;
+
+typedef struct {
+    char name[16];
+    long long bytes_in, bytes_out;  // Updated atomically while running
+    double wall, cpu;               // Seconds
+    int cpu_shared;                 // Overlapped other stages: cpu is its own thread's only
+    double read_wait, write_wait;   // Seconds blocked on input / output
+    int error;                      // A read or write failed
+    int running;
+
+    // Private
+    fc_stats *owner;
+    double start, cpu_start, process_cpu_start;
+    FILE *file_in, *file_out;       // Streams used unwrapped
+    long file_in_start;
+    void *outer;                    // Stage this one nests in on its thread
+} stage_stats;
+
+// Called at most every interval seconds from whichever thread is reading,
+// and once more from stats_finish(); it must not block for long
+typedef void (*stats_progress_fn)(const fc_stats *stats, void *data);
+
+struct fc_stats {
+    stage_stats stages[STATS_MAX_STAGES];
+    int nstages;
+    double wall, cpu;               // Whole run, all threads (stats_finish)
+    double io_wait;                 // First stage's reads + last stage's writes
+    int io_bound;                   // io_wait is over half the wall time
+    int error;
+
+    // Private
+    stats_progress_fn progress;
+    void *progress_data;
+    double interval, start, cpu_start, last_progress;
+    int active;                     // Stages running, under lock
+    pthread_mutex_t lock;
+};
+
+void stats_init(fc_stats *stats, stats_progress_fn progress, void *data, double interval);
+stage_stats *stats_stage(fc_stats *stats, const char *name);
+void stats_stage_begin(stage_stats *st, FILE *source, FILE *dest, FILE **in, FILE **out);
+int stats_stage_end(stage_stats *st, FILE *in, FILE *out);
+void stats_fail(void);
+int stats_input_tracked(FILE *file);
+void stats_input(FILE *file, long offset, double wait);
+void stats_finish(fc_stats *stats);
+void stats_destroy(fc_stats *stats);
+void stats_json(const fc_stats *stats, FILE *out);
+
+#endif // STATS_H